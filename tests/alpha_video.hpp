@@ -0,0 +1,410 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "webm/mkvparser/mkvparser.h"
+#include "simplewebm/WebMDemuxer.hpp"
+#include "simplewebm/VPXDecoder.hpp"
+#include "vpx/vpx_image.h"
+
+#include "../tests/simd.hpp"
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Reads the alpha stream WebM stores next to each video frame, in Matroska BlockAdditional
+ * @note WebMDemuxer only returns a block's own payload and mkvparser does not parse BlockAdditions,
+ * so this reader walks the video track on its own and reads the BlockGroup elements directly. The
+ * alpha frame is a second VP8/VP9 frame whose luma plane is the alpha, BlockAddID 1 marks it.
+ *
+ * Clusters are indexed one at a time as playback reaches them, only BlockGroup headers and the
+ * BlockAdditional payload that is due are read. Frames stay in lockstep with WebMDemuxer by time,
+ * a video frame without a matching block gets no alpha and is shown opaque.
+ */
+class BlockAdditionalReader {
+    public:
+    static constexpr long long ALPHA_ADD_ID = 1;
+
+    /**
+     * @param reader Reader for the WebM file, it must outlive this object
+     */
+    BlockAdditionalReader(mkvparser::IMkvReader* reader): m_reader(reader) {
+        mkvparser::EBMLHeader ebmlHeader;
+        long long pos = 0;
+        if (ebmlHeader.Parse(m_reader, pos) < 0) return;
+        if (mkvparser::Segment::CreateInstance(m_reader, pos, m_segment) < 0 || !m_segment) return;
+        if (m_segment->ParseHeaders() < 0) return;
+
+        // the first VP8 or VP9 track is the one WebMDemuxer plays
+        const mkvparser::Tracks* tracks = m_segment->GetTracks();
+        for (unsigned long i = 0; tracks && i < tracks->GetTracksCount(); ++i) {
+            const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+            if (track && track->GetType() == mkvparser::Track::kVideo &&
+                (strcmp(track->GetCodecId(), "V_VP8") == 0 || strcmp(track->GetCodecId(), "V_VP9") == 0)) {
+                m_track = track;
+                break;
+            }
+        }
+        if (!m_track) return;
+
+        // clusters are loaded as they are reached, only until the track's first block here
+        long status;
+        while ((status = m_track->GetFirst(m_entry)) == mkvparser::E_BUFFER_NOT_FULL) {
+            if (m_segment->LoadCluster() < 0) break;
+        }
+        m_isOpen = (status >= 0) && m_entry && !m_entry->EOS();
+    }
+    ~BlockAdditionalReader() {
+        delete m_segment;
+    }
+
+    bool isOpen() const { return m_isOpen; }
+
+    /**
+     * @brief True when the first video frame carries an alpha frame, encoders give every frame one
+     */
+    bool hasAlpha() {
+        if (!m_isOpen) return false;
+        const mkvparser::Block* block = m_entry->GetBlock();
+        return block && findAddition(m_entry, block) != nullptr;
+    }
+
+    /**
+     * @brief Reads the alpha frame of the video frame WebMDemuxer returned at the given time
+     * @param time The video frame's time in seconds, frames must be asked for in playback order
+     * @param alpha Receives the alpha frame, its buffer is grown as WebMDemuxer::readFrame grows it
+     * @return false if that frame has no alpha, alpha->bufferSize is then 0
+     */
+    bool read(double time, WebMFrame* alpha) {
+        TRACE_SCOPE(DEMUX, "BlockAdditionalReader::read", 0);
+        alpha->bufferSize = 0;
+        alpha->time = time;
+
+        while (m_isOpen && m_entry && !m_entry->EOS()) {
+            const mkvparser::BlockEntry* entry = m_entry;
+            const mkvparser::Block* block = entry->GetBlock();
+            const double blockTime = block->GetTime(entry->GetCluster()) / 1e9;
+            if (blockTime > time + TIME_TOLERANCE) return false; // the video frame has no block here, keep this one
+
+            if (m_track->GetNext(entry, m_entry) < 0) m_entry = nullptr;
+            if (blockTime < time - TIME_TOLERANCE) continue; // a frame WebMDemuxer skipped
+
+            const Extent* extent = findAddition(entry, block);
+            if (!extent) return false;
+            if (extent->len > alpha->bufferCapacity) {
+                unsigned char* buffer = static_cast<unsigned char*>(realloc(alpha->buffer, extent->len));
+                if (!buffer) return false;
+                alpha->buffer = buffer;
+                alpha->bufferCapacity = extent->len;
+            }
+            if (m_reader->Read(extent->pos, extent->len, alpha->buffer) < 0) {
+                std::cerr << "Failed to read the alpha frame at " << blockTime << " s" << std::endl;
+                return false;
+            }
+            alpha->bufferSize = extent->len;
+            alpha->key = block->IsKey();
+            m_bytesRead += extent->len;
+            return true;
+        }
+        return false;
+    }
+
+    long long getBytesRead() const { return m_bytesRead; } // alpha payload bytes
+
+    private:
+    static constexpr double TIME_TOLERANCE = 1e-6; // seconds, block times come from the same timecodes
+
+    // EBML IDs, with their length marker like the spec writes them
+    static constexpr long long ID_CLUSTER_TIMECODE = 0xE7, ID_BLOCK_GROUP = 0xA0, ID_BLOCK = 0xA1;
+    static constexpr long long ID_BLOCK_ADDITIONS = 0x75A1, ID_BLOCK_MORE = 0xA6;
+    static constexpr long long ID_BLOCK_ADD_ID = 0xEE, ID_BLOCK_ADDITIONAL = 0xA5;
+
+    struct Extent {
+        long long pos;
+        long len;
+    };
+
+    /**
+     * @brief Finds the alpha payload of a block, indexing the block's cluster the first time
+     */
+    const Extent* findAddition(const mkvparser::BlockEntry* entry, const mkvparser::Block* block) {
+        if (entry->GetKind() != mkvparser::BlockEntry::kBlockGroup) return nullptr; // SimpleBlocks have no additions
+        if (entry->GetCluster() != m_indexed) indexCluster(entry->GetCluster());
+        auto found = m_additions.find(block->m_start);
+        return (found == m_additions.end()) ? nullptr : &found->second;
+    }
+
+    /**
+     * @brief Records where every BlockGroup of the cluster keeps its alpha frame, by Block payload position
+     */
+    void indexCluster(const mkvparser::Cluster* cluster) {
+        TRACE_SCOPE(DEMUX, "BlockAdditionalReader::indexCluster", 0);
+        m_indexed = cluster;
+        m_additions.clear();
+
+        long long pos = cluster->m_element_start, id, size;
+        long long end = fileEnd();
+        if (!readId(pos, end, id) || !readSize(pos, end, size)) return;
+        if (size >= 0) end = std::min(end, pos + size);
+
+        while (pos < end && readId(pos, end, id) && readSize(pos, end, size)) {
+            if (size < 0) return; // only the cluster itself may have an unknown size
+            if (id == ID_BLOCK_GROUP) {
+                indexBlockGroup(pos, pos + size);
+            } else if (id != ID_CLUSTER_TIMECODE && !isClusterChild(id)) {
+                return; // the next cluster or a top level element of a cluster with unknown size
+            }
+            pos += size;
+        }
+    }
+
+    void indexBlockGroup(long long pos, long long end) {
+        long long blockStart = -1, id, size;
+        Extent alpha = {-1, 0};
+        while (pos < end && readId(pos, end, id) && readSize(pos, end, size) && size >= 0) {
+            if (id == ID_BLOCK) blockStart = pos;
+            else if (id == ID_BLOCK_ADDITIONS) findAlpha(pos, pos + size, alpha);
+            pos += size;
+        }
+        if (blockStart >= 0 && alpha.pos >= 0) m_additions[blockStart] = alpha;
+    }
+
+    void findAlpha(long long pos, long long end, Extent& alpha) {
+        long long id, size;
+        while (pos < end && readId(pos, end, id) && readSize(pos, end, size) && size >= 0) {
+            if (id == ID_BLOCK_MORE) {
+                long long addId = 1; // the spec's default
+                Extent payload = {-1, 0};
+                for (long long child = pos, childId, childSize; child < pos + size &&
+                     readId(child, pos + size, childId) && readSize(child, pos + size, childSize) && childSize >= 0; child += childSize) {
+                    if (childId == ID_BLOCK_ADD_ID) addId = readUInt(child, childSize);
+                    else if (childId == ID_BLOCK_ADDITIONAL) payload = {child, static_cast<long>(childSize)};
+                }
+                if (addId == ALPHA_ADD_ID && payload.pos >= 0) alpha = payload;
+            }
+            pos += size;
+        }
+    }
+
+    static bool isClusterChild(long long id) {
+        switch (id) {
+            case 0xA3: // SimpleBlock
+            case 0xA7: // Position
+            case 0xAB: // PrevSize
+            case 0xAF: // EncryptedBlock
+            case 0xEC: // Void
+            case 0xBF: // CRC-32
+            case 0x5854: // SilentTracks
+                return true;
+        }
+        return false;
+    }
+
+    long long fileEnd() const {
+        long long total = 0, available = 0;
+        if (m_reader->Length(&total, &available) < 0) return 0;
+        return available;
+    }
+
+    /**
+     * @brief Reads an EBML element ID, which keeps its length marker
+     */
+    bool readId(long long& pos, long long end, long long& id) const {
+        return readVint(pos, end, 4, true, id);
+    }
+
+    /**
+     * @brief Reads an EBML element size, -1 when it is unknown
+     */
+    bool readSize(long long& pos, long long end, long long& size) const {
+        return readVint(pos, end, 8, false, size);
+    }
+
+    bool readVint(long long& pos, long long end, int maxLength, bool keepMarker, long long& value) const {
+        unsigned char bytes[8];
+        if (pos >= end || m_reader->Read(pos, 1, bytes) < 0 || bytes[0] == 0) return false;
+
+        int length = 1;
+        while (!(bytes[0] & (0x80 >> (length - 1)))) ++length;
+        if (length > maxLength || pos + length > end) return false;
+        if (length > 1 && m_reader->Read(pos + 1, length - 1, bytes + 1) < 0) return false;
+
+        const unsigned char marker = static_cast<unsigned char>(0x80 >> (length - 1));
+        value = keepMarker ? bytes[0] : (bytes[0] & (marker - 1));
+        bool allOnes = (value == marker - 1);
+        for (int i = 1; i < length; ++i) {
+            value = (value << 8) | bytes[i];
+            allOnes = allOnes && bytes[i] == 0xFF;
+        }
+        if (!keepMarker && allOnes) value = -1;
+        pos += length;
+        return true;
+    }
+
+    long long readUInt(long long pos, long long size) const {
+        unsigned char bytes[8];
+        if (size < 1 || size > 8 || m_reader->Read(pos, static_cast<long>(size), bytes) < 0) return -1;
+        long long value = 0;
+        for (long long i = 0; i < size; ++i) value = (value << 8) | bytes[i];
+        return value;
+    }
+
+    mkvparser::IMkvReader* m_reader;
+    mkvparser::Segment* m_segment = nullptr;
+    const mkvparser::Track* m_track = nullptr;
+    const mkvparser::BlockEntry* m_entry = nullptr; // the next block to match
+    bool m_isOpen = false;
+
+    const mkvparser::Cluster* m_indexed = nullptr;
+    std::unordered_map<long long, Extent> m_additions;
+    long long m_bytesRead = 0;
+};
+
+/**
+ * @brief Decodes a video stream and its alpha stream side by side into premultiplied RGBA
+ * @note The alpha stream is a complete VP8/VP9 stream of its own, so it needs a second decoder. It
+ * decodes on a worker thread while the color frame decodes on the caller's, a frame costs about as
+ * much as the slower of the two instead of their sum. The worker starts with the first alpha frame
+ * and lives as long as the decoder, each frame only wakes it. Only the alpha image's luma plane is used.
+ *
+ * The converted picture is SDL_PIXELFORMAT_RGBA32 with color already multiplied by alpha, blend it
+ * with SRC_COLOR * 1 + DST_COLOR * (1 - SRC_ALPHA). A frame whose alpha is missing or fails to
+ * decode is shown opaque rather than dropped, the alpha decoder recovers at the next keyframe.
+ */
+class AlphaVideoDecoder {
+    public:
+    /**
+     * @param color Decoder for the video track, as used without alpha
+     * @param alpha A second decoder created for the same demuxer
+     */
+    AlphaVideoDecoder(VPXDecoder& color, VPXDecoder& alpha): m_color(color), m_alpha(alpha) { }
+    ~AlphaVideoDecoder() {
+        if (!m_worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        m_worker.join();
+    }
+
+    AlphaVideoDecoder(const AlphaVideoDecoder&) = delete;
+    AlphaVideoDecoder& operator=(const AlphaVideoDecoder&) = delete;
+
+    /**
+     * @brief Decodes a video frame and its alpha frame in parallel
+     * @param color The video frame from WebMDemuxer::readFrame
+     * @param alpha Its alpha frame from BlockAdditionalReader::read, may be empty
+     * @return false only if the color frame failed to decode
+     */
+    bool decode(const WebMFrame& color, const WebMFrame& alpha) {
+        const bool decodeAlpha = alpha.isValid() && m_alpha.isOpen();
+        if (decodeAlpha) {
+            if (!m_worker.joinable()) m_worker = std::thread([this]() { run(); });
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_pending = &alpha;
+                m_alphaDone = false;
+            }
+            m_wake.notify_one();
+        }
+
+        const bool colorDecoded = m_color.decode(color);
+
+        bool alphaDecoded = false;
+        if (decodeAlpha) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this]() { return m_alphaDone; });
+            alphaDecoded = m_alphaDecoded;
+        }
+
+        m_hasAlpha = alphaDecoded;
+        if (alpha.isValid() && !m_hasAlpha && !m_alphaErrorReported) {
+            std::cerr << "Failed to decode the alpha frame at " << alpha.time << " s, showing it opaque" << std::endl;
+            m_alphaErrorReported = true;
+        }
+        return colorDecoded;
+    }
+
+    /**
+     * @brief Takes the next decoded picture and converts it to premultiplied RGBA
+     * @param rgba Receives width * height * 4 bytes, rows are width * 4 bytes apart
+     * @return false once every picture of the last decode was taken
+     */
+    bool getImage(std::vector<uint8_t>& rgba, int& width, int& height) {
+        if (m_color.getImage(m_colorImage) != VPXDecoder::NO_ERROR) return false;
+
+        // the alpha image goes with this picture only if it matches, otherwise the picture is opaque
+        bool hasAlpha = m_hasAlpha && m_alpha.getImage(m_alphaImage) == VPXDecoder::NO_ERROR;
+        hasAlpha = hasAlpha && m_alphaImage.w == m_colorImage.w && m_alphaImage.h == m_colorImage.h;
+        m_hasAlpha = false;
+
+        TRACE_SCOPE(CONVERT, "yuvaToPremultipliedRgba", 0);
+        width = m_colorImage.w;
+        height = m_colorImage.h;
+        rgba.resize(static_cast<size_t>(width) * height * 4);
+        if (!hasAlpha) m_opaque.assign(width, 255);
+
+        const simd::YuvMatrix& matrix = (m_colorImage.cs == VPX_CS_BT_709) ? simd::BT709 : simd::BT601;
+        for (int y = 0; y < height; ++y) {
+            const int chromaRow = y >> m_colorImage.chromaShiftH;
+            simd::yuvaToPremultipliedRgba(m_colorImage.planes[0] + static_cast<size_t>(y) * m_colorImage.linesize[0],
+                                          m_colorImage.planes[1] + static_cast<size_t>(chromaRow) * m_colorImage.linesize[1],
+                                          m_colorImage.planes[2] + static_cast<size_t>(chromaRow) * m_colorImage.linesize[2],
+                                          hasAlpha ? m_alphaImage.planes[0] + static_cast<size_t>(y) * m_alphaImage.linesize[0] : m_opaque.data(),
+                                          rgba.data() + static_cast<size_t>(y) * width * 4,
+                                          width, m_colorImage.chromaShiftW, matrix);
+        }
+        return true;
+    }
+
+    private:
+    /**
+     * @brief The worker thread, decodes each alpha frame decode() hands it
+     */
+    void run() {
+        TRACE_THREAD_NAME("alpha");
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_wake.wait(lock, [this]() { return m_stopping || m_pending; });
+            if (!m_pending) return; // only when stopping
+            const WebMFrame& frame = *m_pending;
+            m_pending = nullptr;
+            lock.unlock();
+
+            bool decoded;
+            {
+                TRACE_SCOPE(DECODE_VIDEO, "VPXDecoder::decode alpha", 0);
+                decoded = m_alpha.decode(frame);
+            }
+
+            lock.lock();
+            m_alphaDecoded = decoded;
+            m_alphaDone = true;
+            m_done.notify_one();
+        }
+    }
+
+    VPXDecoder& m_color;
+    VPXDecoder& m_alpha;
+    VPXDecoder::Image m_colorImage, m_alphaImage;
+    std::vector<uint8_t> m_opaque; // an alpha row of 255 for pictures without alpha
+    bool m_hasAlpha = false;       // the last decode produced an alpha image
+    bool m_alphaErrorReported = false;
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;          // decode() handed the worker a frame, or the decoder is going away
+    std::condition_variable m_done;          // the worker finished the frame
+    const WebMFrame* m_pending = nullptr;    // alpha frame waiting for the worker
+    bool m_alphaDone = false;
+    bool m_alphaDecoded = false;             // the worker's result for the last frame
+    bool m_stopping = false;
+};
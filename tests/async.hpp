@@ -0,0 +1,342 @@
+#pragma once
+
+// The coroutine API needs C++20, configure with ENABLE_COROUTINES=ON. Older standards get nothing
+// from this header and OPENAVMEDIA_ASYNC stays undefined, so callers can keep a blocking path.
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define OPENAVMEDIA_ASYNC 1
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../tests/trace.hpp"
+
+/**
+ * @brief This namespace contains a small C++20 coroutine runtime for media work that must not block its caller
+ * @note Coroutines here are lazy: calling one only creates it, co_await or spawn() starts it. They
+ * move between threads by awaiting a WorkerPool's schedule(), blocking I/O goes to Executors::io and
+ * decoding to Executors::cpu. Errors are reported by value through Status, like everywhere else in
+ * the repo. An exception escaping a coroutine terminates the program.
+ *
+ * Everything a coroutine refers to must outlive it. Coroutines take strings by value for that
+ * reason, and member coroutines need their object to stay put until they finish.
+ */
+namespace async {
+    enum class Status {
+        OK,
+        CANCELLED,
+        FAILED
+    };
+
+    /**
+     * @brief What an asynchronous operation produced, value is only meaningful when status is OK
+     */
+    template <typename T>
+    struct Result {
+        Status status = Status::FAILED;
+        T value{};
+
+        bool ok() const { return status == Status::OK; }
+    };
+
+    /**
+     * @brief Read side of a cancellation flag, a default constructed token is never cancelled
+     * @note Operations check their token between steps, so cancelling stops them at the next thread
+     * hop rather than in the middle of a read or a decode.
+     */
+    class CancellationToken {
+        public:
+        CancellationToken() = default;
+
+        bool isCancelled() const { return m_flag && m_flag->load(std::memory_order_acquire); }
+
+        private:
+        friend class CancellationSource;
+        explicit CancellationToken(std::shared_ptr<const std::atomic<bool>> flag): m_flag(std::move(flag)) { }
+
+        std::shared_ptr<const std::atomic<bool>> m_flag;
+    };
+
+    /**
+     * @brief Owner side of a cancellation flag, hand out tokens and cancel from any thread
+     */
+    class CancellationSource {
+        public:
+        CancellationToken token() const { return CancellationToken(m_flag); }
+        void cancel() { m_flag->store(true, std::memory_order_release); }
+        bool isCancelled() const { return m_flag->load(std::memory_order_acquire); }
+
+        private:
+        std::shared_ptr<std::atomic<bool>> m_flag = std::make_shared<std::atomic<bool>>(false);
+    };
+
+    namespace detail {
+        struct PromiseBase {
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                    return handle.promise().continuation; // resume whoever awaited us, on this thread
+                }
+                void await_resume() noexcept { }
+            };
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    }
+
+    /**
+     * @brief A lazily started coroutine producing a T, co_await it to run it and get the T
+     */
+    template <typename T>
+    class Task {
+        public:
+        struct promise_type: detail::PromiseBase {
+            std::optional<T> value;
+
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            void return_value(T result) { value.emplace(std::move(result)); }
+        };
+
+        Task(Task&& other) noexcept: m_handle(std::exchange(other.m_handle, nullptr)) { }
+        Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+                if (m_handle) m_handle.destroy();
+                m_handle = std::exchange(other.m_handle, nullptr);
+            }
+            return *this;
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task() {
+            if (m_handle) m_handle.destroy();
+        }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            m_handle.promise().continuation = awaiting;
+            return m_handle; // start it right here, without a trip through a queue
+        }
+        T await_resume() { return std::move(*m_handle.promise().value); }
+
+        private:
+        explicit Task(std::coroutine_handle<promise_type> handle): m_handle(handle) { }
+
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    /**
+     * @brief A fixed set of threads that resume coroutines in the order they were scheduled
+     */
+    class WorkerPool {
+        public:
+        /**
+         * @param name Thread name in traces
+         * @param threads Number of threads, at least one
+         */
+        WorkerPool(const char* name, unsigned threads): m_name(name) {
+            for (unsigned i = 0; i < std::max(1u, threads); ++i) {
+                m_threads.emplace_back([this]() { run(); });
+            }
+        }
+
+        /**
+         * @brief Runs what is still queued, then joins the threads
+         */
+        ~WorkerPool() {
+            stop();
+            join();
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        /**
+         * @brief co_await the result to continue on one of this pool's threads
+         * @note A coroutine already running on this pool carries on without a hop.
+         */
+        auto schedule() {
+            struct Awaiter {
+                WorkerPool& pool;
+                bool await_ready() const noexcept { return current() == &pool; }
+                void await_suspend(std::coroutine_handle<> handle) { pool.post(handle); }
+                void await_resume() const noexcept { }
+            };
+            return Awaiter{*this};
+        }
+
+        /**
+         * @brief Queues a suspended coroutine to be resumed by one of the threads
+         */
+        void post(std::coroutine_handle<> handle) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_queue.push_back(handle);
+            }
+            m_wake.notify_one();
+        }
+
+        /**
+         * @brief Lets the threads exit once the queue is empty, does not wait for them
+         */
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_wake.notify_all();
+        }
+
+        /**
+         * @brief Waits for the threads to exit, call stop() first
+         */
+        void join() {
+            for (std::thread& thread : m_threads) {
+                if (thread.joinable()) thread.join();
+            }
+        }
+
+        size_t getThreadCount() const { return m_threads.size(); }
+
+        private:
+        static WorkerPool*& current() {
+            thread_local WorkerPool* pool = nullptr;
+            return pool;
+        }
+
+        void run() {
+            TRACE_THREAD_NAME(m_name);
+            current() = this;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true) {
+                m_wake.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+                if (m_queue.empty()) return; // only when stopping
+                std::coroutine_handle<> handle = m_queue.front();
+                m_queue.pop_front();
+                lock.unlock();
+                handle.resume();
+                lock.lock();
+            }
+        }
+
+        const char* m_name;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<std::coroutine_handle<>> m_queue;
+        bool m_stopping = false;
+        std::vector<std::thread> m_threads;
+    };
+
+    /**
+     * @brief The two pools media work runs on
+     * @note Reads block on the disk, so they get threads of their own and never hold up a decode.
+     * Decoding gets one thread per core but one, which is left to the caller's main loop.
+     */
+    struct Executors {
+        WorkerPool cpu{"async cpu", std::max(1u, std::thread::hardware_concurrency()) - 1};
+        WorkerPool io{"async io", 2};
+
+        /**
+         * @note Work hops between the pools (a read on io continues on cpu and the other way round),
+         * so both are stopped before either is joined and neither is destroyed while the other still runs.
+         */
+        ~Executors() {
+            cpu.stop();
+            io.stop();
+            io.join();
+            cpu.join();
+        }
+    };
+
+    /**
+     * @brief A started coroutine whose result a plain function can poll or wait for
+     */
+    template <typename T>
+    class Pending {
+        public:
+        /**
+         * @brief True once the result is there, never blocks, so a frame loop can call it every frame
+         */
+        bool isReady() const { return m_state->ready.load(std::memory_order_acquire); }
+
+        /**
+         * @brief Blocks until the result is there and takes it, call it once
+         */
+        T get() {
+            std::unique_lock<std::mutex> lock(m_state->mutex);
+            m_state->done.wait(lock, [this]() { return m_state->ready.load(std::memory_order_relaxed); });
+            return std::move(*m_state->value);
+        }
+
+        private:
+        template <typename U>
+        friend Pending<U> spawn(Task<U> task);
+
+        struct State {
+            std::mutex mutex;
+            std::condition_variable done;
+            std::optional<T> value;
+            std::atomic<bool> ready{false};
+        };
+
+        std::shared_ptr<State> m_state = std::make_shared<State>();
+    };
+
+    namespace detail {
+        struct Detached {
+            struct promise_type {
+                Detached get_return_object() noexcept { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept { }
+                void unhandled_exception() noexcept { std::terminate(); }
+            };
+        };
+
+        template <typename T, typename State>
+        Detached complete(Task<T> task, std::shared_ptr<State> state) {
+            T value = co_await task;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->value.emplace(std::move(value));
+                state->ready.store(true, std::memory_order_release);
+            }
+            state->done.notify_all();
+        }
+    }
+
+    /**
+     * @brief Starts a coroutine from plain code, it runs on the calling thread until its first hop
+     * @note Dropping the Pending does not stop the coroutine, cancel it through its token instead.
+     */
+    template <typename T>
+    Pending<T> spawn(Task<T> task) {
+        Pending<T> pending;
+        detail::complete(std::move(task), pending.m_state);
+        return pending;
+    }
+
+    /**
+     * @brief Runs a coroutine to completion from plain code, blocking the calling thread
+     */
+    template <typename T>
+    T syncWait(Task<T> task) {
+        return spawn(std::move(task)).get();
+    }
+}
+
+#endif
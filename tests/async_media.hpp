@@ -0,0 +1,217 @@
+#pragma once
+#include "../tests/async.hpp"
+
+#if defined(OPENAVMEDIA_ASYNC)
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "simplewebm/OpusVorbisDecoder.hpp"
+#include "simplewebm/VPXDecoder.hpp"
+#include "simplewebm/WebMDemuxer.hpp"
+
+#include "../tests/decoder_pool.hpp"
+#include "../tests/resampler.hpp"
+#include "../tests/trace.hpp"
+
+namespace async {
+    /**
+     * @brief Opens a WebM file on the I/O pool, co_await open<MkvReader>(path, executors, token)
+     * @note WebMDemuxer parses the file's clusters in its constructor, this is where opening a large
+     * file spends its time.
+     * @tparam Reader An mkvparser::IMkvReader that can be constructed from a file path
+     */
+    template <typename Reader>
+    Task<Result<std::unique_ptr<WebMDemuxer>>> open(std::string path, Executors& executors, CancellationToken token = {}) {
+        co_await executors.io.schedule();
+        if (token.isCancelled()) co_return {Status::CANCELLED};
+
+        TRACE_SCOPE(DEMUX, "async::open", 0);
+        std::unique_ptr<WebMDemuxer> demuxer = std::make_unique<WebMDemuxer>(new Reader(path.c_str()));
+        if (!demuxer->isOpen()) {
+            std::cerr << "Failed to open " << path << std::endl;
+            co_return {Status::FAILED};
+        }
+        co_return {Status::OK, std::move(demuxer)};
+    }
+}
+
+/**
+ * @brief Plays an opened WebM file, getting it ready to start without blocking the caller
+ * @note co_await preroll() creates the decoders and decodes up to the first picture, reads hop to
+ * the I/O pool and decoding to the CPU pool, one frame at a time. The frame after the first picture
+ * is read but kept for playback, like ClipScheduler's pre-roll. Playback itself is readFrame(), a
+ * plain call made from the caller's frame loop once the pre-roll is done.
+ *
+ * Only one of preroll() and readFrame() may run at a time.
+ */
+class AsyncPlayer {
+    public:
+    /**
+     * @param demuxer The media, from async::open
+     * @param mixerRate Decoded audio is resampled to this rate, at the media's own channel count
+     * @param executors Where the pre-roll runs, they must outlive it
+     * @param pool Where decoders come from and the video decoder goes back to, nullptr creates them
+     * @param videoThreads Threads the VPXDecoder may use
+     */
+    AsyncPlayer(std::unique_ptr<WebMDemuxer> demuxer, int mixerRate, async::Executors& executors, DecoderPool* pool = nullptr, unsigned videoThreads = 8):
+        m_demuxer(std::move(demuxer)), m_mixerRate(mixerRate), m_executors(executors), m_pool(pool), m_videoThreads(videoThreads) { }
+    ~AsyncPlayer() {
+        if (!m_pool || !m_videoDec) return;
+        VPXDecoder::Image image;
+        while (m_videoDec->getImage(image) == VPXDecoder::NO_ERROR) { } // the next user must not see our pictures
+        m_pool->releaseVideo(*m_demuxer, m_videoThreads, std::move(m_videoDec));
+    }
+
+    /**
+     * @brief Creates the decoders and decodes up to the first picture
+     * @return OK once readFrame() can hand out the first picture without waiting
+     */
+    async::Task<async::Status> preroll(async::CancellationToken token = {}) {
+        co_await m_executors.cpu.schedule();
+        if (token.isCancelled()) co_return async::Status::CANCELLED;
+        if (!createDecoders()) co_return async::Status::FAILED;
+
+        while (!m_hasPendingVideo) {
+            co_await m_executors.io.schedule();
+            if (token.isCancelled()) co_return async::Status::CANCELLED;
+            bool hasVideo = false, hasAudio = false;
+            {
+                TRACE_SCOPE(DEMUX, "AsyncPlayer::preroll read", 0);
+                if (!m_demuxer->readFrame(&m_videoFrame, &m_audioFrame)) {
+                    m_ended = true;
+                    break;
+                }
+                hasVideo = m_videoFrame.isValid() && m_videoDec;
+                hasAudio = m_audioFrame.isValid();
+            }
+
+            co_await m_executors.cpu.schedule();
+            if (token.isCancelled()) co_return async::Status::CANCELLED;
+            if (hasAudio && !decodeAudio(m_primedAudio)) co_return async::Status::FAILED;
+            if (hasVideo) {
+                if (m_hasPicture) {
+                    m_hasPendingVideo = true;
+                } else if (!decodeVideo(m_hasPicture)) {
+                    co_return async::Status::FAILED;
+                }
+            }
+            if (!m_videoDec && !m_primedAudio.empty()) break; // audio only, one packet primes it
+        }
+
+        m_prerolled = true;
+        co_return async::Status::OK;
+    }
+
+    /**
+     * @brief Reads and decodes the next frame on the calling thread, the first call hands out the pre-roll
+     * @param hasPicture Set when this step produced a picture, it is then in getImage()
+     * @param audio Decoded audio at the mixer rate is appended to this vector
+     * @return false at the end of the file or on a decoding error
+     */
+    bool readFrame(bool& hasPicture, std::vector<short>& audio) {
+        hasPicture = false;
+        if (m_prerolled) {
+            m_prerolled = false;
+            audio.insert(audio.end(), m_primedAudio.begin(), m_primedAudio.end());
+            m_primedAudio = std::vector<short>();
+            hasPicture = m_hasPicture;
+            return true;
+        }
+
+        bool hasVideo = false;
+        if (m_hasPendingVideo) { // read during the pre-roll, not yet decoded
+            m_hasPendingVideo = false;
+            hasVideo = true;
+        } else if (!m_ended && m_demuxer->readFrame(&m_videoFrame, &m_audioFrame)) {
+            hasVideo = m_videoFrame.isValid();
+            if (m_audioFrame.isValid() && !decodeAudio(audio)) return false;
+        } else if (m_resampler && !m_flushed) { // the end of the file, one last step hands out what the resampler still holds
+            m_ended = true;
+            m_flushed = true;
+            m_resampler->flushS16(audio);
+        } else {
+            return false;
+        }
+
+        if (hasVideo && m_videoDec && !decodeVideo(hasPicture)) return false;
+        return true;
+    }
+
+    const WebMDemuxer& getDemuxer() const { return *m_demuxer; }
+    const VPXDecoder::Image& getImage() const { return m_image; } // the last picture decoded
+    double getVideoTime() const { return m_videoTime; }           // seconds, of the last picture decoded
+
+    private:
+    bool createDecoders() {
+        TRACE_SCOPE(DECODE_VIDEO, "AsyncPlayer::createDecoders", 0);
+        if (m_demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO) {
+            m_videoDec = m_pool ? m_pool->acquireVideo(*m_demuxer, m_videoThreads) : std::make_unique<VPXDecoder>(*m_demuxer, m_videoThreads);
+            if (!m_videoDec->isOpen()) m_videoDec.reset();
+        }
+        if (m_demuxer->getAudioCodec() != WebMDemuxer::NO_AUDIO) {
+            m_audioDec = m_pool ? m_pool->acquireAudio(*m_demuxer) : std::make_unique<OpusVorbisDecoder>(*m_demuxer);
+            if (m_audioDec->isOpen()) {
+                m_pcm.resize(m_audioDec->getBufferSamples() * m_demuxer->getChannels());
+                m_resampler = std::make_unique<PolyphaseResampler>(static_cast<int>(m_demuxer->getSampleRate()), m_mixerRate,
+                                                                   m_demuxer->getChannels(), PolyphaseResampler::BEST);
+            } else {
+                m_audioDec.reset();
+            }
+        }
+        if (!m_videoDec && !m_audioDec) {
+            std::cerr << "No stream of the media could be decoded" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool decodeVideo(bool& hasPicture) {
+        TRACE_SCOPE(DECODE_VIDEO, "AsyncPlayer::decodeVideo", 0);
+        if (!m_videoDec->decode(m_videoFrame)) {
+            std::cerr << "Failed to decode video frame at " << m_videoFrame.time << " s" << std::endl;
+            return false;
+        }
+        while (m_videoDec->getImage(m_image) == VPXDecoder::NO_ERROR) {
+            hasPicture = true;
+            m_videoTime = m_videoFrame.time;
+        }
+        return true;
+    }
+
+    bool decodeAudio(std::vector<short>& out) {
+        if (!m_audioDec) return true; // a codec we cannot decode plays as silence
+
+        TRACE_SCOPE(DECODE_AUDIO, "AsyncPlayer::decodeAudio", 0);
+        int numOutSamples;
+        if (!m_audioDec->getPCMS16(m_audioFrame, m_pcm.data(), numOutSamples)) {
+            std::cerr << "Failed to decode audio frame at " << m_audioFrame.time << " s" << std::endl;
+            return false;
+        }
+        m_resampler->processS16(m_pcm.data(), numOutSamples, out);
+        return true;
+    }
+
+    std::unique_ptr<WebMDemuxer> m_demuxer;
+    int m_mixerRate;
+    async::Executors& m_executors;
+    DecoderPool* m_pool;
+    unsigned m_videoThreads;
+
+    std::unique_ptr<VPXDecoder> m_videoDec;
+    std::unique_ptr<OpusVorbisDecoder> m_audioDec;
+    std::unique_ptr<PolyphaseResampler> m_resampler;
+    std::vector<short> m_pcm; // decoder output at the media's rate
+    WebMFrame m_videoFrame, m_audioFrame;
+
+    VPXDecoder::Image m_image;
+    double m_videoTime = 0.0;
+    bool m_hasPicture = false;      // the pre-roll decoded its picture
+    std::vector<short> m_primedAudio;
+    bool m_hasPendingVideo = false; // m_videoFrame holds a frame that was read but not decoded
+    bool m_prerolled = false;       // the next readFrame() hands out the pre-roll
+    bool m_ended = false;
+    bool m_flushed = false;         // the resampler's last frames were handed out
+};
+#endif
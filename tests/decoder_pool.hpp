@@ -0,0 +1,223 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "soloud/soloud.h"
+
+#include "simplewebm/OpusVorbisDecoder.hpp"
+#include "simplewebm/VPXDecoder.hpp"
+
+/**
+ * @brief Keeps initialized decoders around so starting a clip does not pay for creating them
+ * @note A VPXDecoder only depends on the codec and the thread count it was created with, libvpx
+ * starts over at every keyframe, so a decoder that finished one clip is handed to the next clip of
+ * the same codec, resolution and thread count as is. That skips codec init and spawning its threads.
+ *
+ * Audio decoders carry the end of the previous stream in their overlap buffers, so they are never
+ * reused. Instead prewarm() creates fresh ones ahead of time, keyed by everything the constructor
+ * reads from the demuxer, and acquireAudio() hands those out once each.
+ *
+ * All methods are safe to call from any thread.
+ */
+class DecoderPool {
+    public:
+    /**
+     * @brief Creates decoders for the demuxer's streams ahead of time, call it off the critical path
+     * @param demuxer Any demuxer for media like the clips that will be played
+     * @param threads Thread count for the video decoders
+     * @param count How many decoders of each kind to have ready
+     */
+    void prewarm(const WebMDemuxer& demuxer, unsigned threads, size_t count = 1) {
+        if (demuxer.getVideoCodec() != WebMDemuxer::NO_VIDEO) {
+            const VideoKey key = videoKey(demuxer, threads);
+            while (idleVideo(key) < count) {
+                std::unique_ptr<VPXDecoder> decoder = std::make_unique<VPXDecoder>(demuxer, threads);
+                if (!decoder->isOpen()) break;
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_video[key].push_back(std::move(decoder));
+            }
+        }
+        if (demuxer.getAudioCodec() != WebMDemuxer::NO_AUDIO) {
+            const AudioKey key = audioKey(demuxer);
+            while (idleAudio(key) < count) {
+                std::unique_ptr<OpusVorbisDecoder> decoder = std::make_unique<OpusVorbisDecoder>(demuxer);
+                if (!decoder->isOpen()) break;
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_audio[key].push_back(std::move(decoder));
+            }
+        }
+    }
+
+    /**
+     * @brief Takes a video decoder for the demuxer's video stream, creating one only if none is idle
+     */
+    std::unique_ptr<VPXDecoder> acquireVideo(const WebMDemuxer& demuxer, unsigned threads) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_video.find(videoKey(demuxer, threads));
+            if (found != m_video.end() && !found->second.empty()) {
+                std::unique_ptr<VPXDecoder> decoder = std::move(found->second.back());
+                found->second.pop_back();
+                ++m_hits;
+                return decoder;
+            }
+            ++m_misses;
+        }
+        return std::make_unique<VPXDecoder>(demuxer, threads);
+    }
+
+    /**
+     * @brief Returns a video decoder for the next clip, drain its images before returning it
+     * @param demuxer The demuxer it was acquired for
+     * @param threads The thread count it was acquired with
+     */
+    void releaseVideo(const WebMDemuxer& demuxer, unsigned threads, std::unique_ptr<VPXDecoder> decoder) {
+        if (!decoder || !decoder->isOpen()) return;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_video[videoKey(demuxer, threads)].push_back(std::move(decoder));
+    }
+
+    /**
+     * @brief Takes a fresh audio decoder for the demuxer's audio stream, creating one if none was prewarmed
+     */
+    std::unique_ptr<OpusVorbisDecoder> acquireAudio(const WebMDemuxer& demuxer) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_audio.find(audioKey(demuxer));
+            if (found != m_audio.end() && !found->second.empty()) {
+                std::unique_ptr<OpusVorbisDecoder> decoder = std::move(found->second.back());
+                found->second.pop_back();
+                ++m_hits;
+                return decoder;
+            }
+            ++m_misses;
+        }
+        return std::make_unique<OpusVorbisDecoder>(demuxer);
+    }
+
+    size_t getHits() const { return m_hits.load(std::memory_order_relaxed); }
+    size_t getMisses() const { return m_misses.load(std::memory_order_relaxed); }
+
+    private:
+    typedef std::tuple<int, int, int, unsigned> VideoKey;              // codec, width, height, threads
+    typedef std::tuple<int, int, double, std::string> AudioKey;        // codec, channels, rate, codec private data
+
+    static VideoKey videoKey(const WebMDemuxer& demuxer, unsigned threads) {
+        return VideoKey(demuxer.getVideoCodec(), demuxer.getWidth(), demuxer.getHeight(), threads);
+    }
+
+    static AudioKey audioKey(const WebMDemuxer& demuxer) {
+        size_t size = 0;
+        const unsigned char* extradata = demuxer.getAudioExtradata(size);
+        return AudioKey(demuxer.getAudioCodec(), demuxer.getChannels(), demuxer.getSampleRate(),
+                        extradata ? std::string(reinterpret_cast<const char*>(extradata), size) : std::string());
+    }
+
+    size_t idleVideo(const VideoKey& key) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_video.find(key);
+        return (found != m_video.end()) ? found->second.size() : 0;
+    }
+
+    size_t idleAudio(const AudioKey& key) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_audio.find(key);
+        return (found != m_audio.end()) ? found->second.size() : 0;
+    }
+
+    std::mutex m_mutex;
+    std::map<VideoKey, std::vector<std::unique_ptr<VPXDecoder>>> m_video;
+    std::map<AudioKey, std::vector<std::unique_ptr<OpusVorbisDecoder>>> m_audio;
+    std::atomic<size_t> m_hits{0};
+    std::atomic<size_t> m_misses{0};
+};
+
+/**
+ * @brief One SoLoud engine for the whole process, so playing a clip never waits for the audio device
+ * @note The engine runs at the global mixer rate (MIXER_SAMPLE_RATE in test5), sources of any rate
+ * and channel count play through it. Call shutdown() before SDL_Quit().
+ */
+class SharedAudioEngine {
+    public:
+    /**
+     * @brief The engine, initialized by the first call
+     * @param sampleRate Output rate, only used by the first call
+     * @param bufferSize Frames per mixer period, small ones lower the latency, AUTO lets the backend choose. Only used by the first call
+     */
+    static SoLoud::Soloud& get(unsigned int sampleRate = 48000, unsigned int bufferSize = SoLoud::Soloud::AUTO) {
+        SharedAudioEngine& engine = instance();
+        std::lock_guard<std::mutex> lock(engine.m_mutex);
+        if (!engine.m_initialized) {
+            engine.m_soloud.init(SoLoud::Soloud::CLIP_ROUNDOFF, SoLoud::Soloud::AUTO, sampleRate, bufferSize, 2);
+            engine.m_initialized = true;
+        }
+        return engine.m_soloud;
+    }
+
+    static void shutdown() {
+        SharedAudioEngine& engine = instance();
+        std::lock_guard<std::mutex> lock(engine.m_mutex);
+        if (engine.m_initialized) {
+            engine.m_soloud.deinit();
+            engine.m_initialized = false;
+        }
+    }
+
+    private:
+    static SharedAudioEngine& instance() {
+        static SharedAudioEngine engine;
+        return engine;
+    }
+
+    std::mutex m_mutex;
+    SoLoud::Soloud m_soloud;
+    bool m_initialized = false;
+};
+
+/**
+ * @brief Measures how long a clip takes from being asked for to its first frame and first audio sample
+ * @note The first sample is marked from the audio thread, so both marks are atomic and only the
+ * first call of each counts.
+ */
+class StartupMetrics {
+    public:
+    void start() {
+        m_start = std::chrono::steady_clock::now();
+        m_firstFrame.store(-1, std::memory_order_relaxed);
+        m_firstSample.store(-1, std::memory_order_relaxed);
+    }
+
+    void markFirstFrame() { mark(m_firstFrame); }
+    void markFirstSample() { mark(m_firstSample); }
+
+    /**
+     * @return Microseconds from start() to the first frame, or -1 if there was none yet
+     */
+    int64_t getTimeToFirstFrame() const { return m_firstFrame.load(std::memory_order_relaxed); }
+    int64_t getTimeToFirstSample() const { return m_firstSample.load(std::memory_order_relaxed); }
+
+    void print(std::ostream& out) const {
+        out << "Time to first frame:  " << getTimeToFirstFrame() / 1000.0 << " ms\n"
+            << "Time to first sample: " << getTimeToFirstSample() / 1000.0 << " ms" << std::endl;
+    }
+
+    private:
+    void mark(std::atomic<int64_t>& target) {
+        if (target.load(std::memory_order_relaxed) >= 0) return;
+        const int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+        int64_t expected = -1;
+        target.compare_exchange_strong(expected, elapsed, std::memory_order_relaxed);
+    }
+
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    std::atomic<int64_t> m_firstFrame{-1};
+    std::atomic<int64_t> m_firstSample{-1};
+};
@@ -0,0 +1,487 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+#include "../tests/simd.hpp"
+
+/**
+ * @brief A parameter that game code sets at any time and the audio thread glides towards
+ * @note The audio thread reads the target once per block and moves the current value part of the
+ * way there, so changes never step abruptly (no zipper noise) no matter how often they are made.
+ */
+class SmoothedParameter {
+    public:
+    SmoothedParameter(float value, float smoothingMs = 30.0f): m_target(value), m_current(value), m_smoothingMs(smoothingMs) { }
+
+    void set(float value) { m_target.store(value, std::memory_order_relaxed); }
+    float get() const { return m_target.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Advances the value across one block, only called from the audio thread
+     * @return The value at the start and at the end of the block
+     */
+    std::pair<float, float> advance(size_t frames, int sampleRate) {
+        const float from = m_current;
+        const float target = m_target.load(std::memory_order_relaxed);
+        const float coefficient = 1.0f - std::exp(-static_cast<float>(frames) / (m_smoothingMs * 0.001f * sampleRate));
+        m_current += (target - m_current) * coefficient;
+        if (std::abs(target - m_current) < 1e-5f) m_current = target; // settle instead of creeping forever
+        return {from, m_current};
+    }
+
+    void snap() { m_current = m_target.load(std::memory_order_relaxed); }
+
+    private:
+    std::atomic<float> m_target;
+    float m_current;
+    float m_smoothingMs;
+};
+
+/**
+ * @brief Base class of every effect in an EffectChain
+ * @note Effects work on planar float audio, one array per channel, and keep track of how much CPU
+ * time they have used so expensive ones can be spotted.
+ */
+class AudioEffect {
+    public:
+    static const int MAX_CHANNELS = 8;
+
+    virtual ~AudioEffect() { }
+
+    /**
+     * @brief Processes one block in place and adds the time it took to the cost counter
+     */
+    void run(float* const* channels, int numChannels, size_t frames, int sampleRate) {
+        const auto start = std::chrono::steady_clock::now();
+        process(channels, numChannels, frames, sampleRate);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        m_nanoseconds.fetch_add(static_cast<uint64_t>(elapsed), std::memory_order_relaxed);
+        m_frames.fetch_add(frames, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Allocates whatever depends on the sample rate, called from EffectChain::prepare() or SubmixGraph::start() so the audio thread never allocates
+     */
+    virtual void prepare([[maybe_unused]] int sampleRate) { }
+
+    /**
+     * @brief Clears internal state (filter memory, delay lines), called when a channel's voice ends or a SubmixGraph stops
+     */
+    virtual void reset() { }
+
+    virtual const char* getName() const = 0;
+
+    uint64_t getProcessNanoseconds() const { return m_nanoseconds.load(std::memory_order_relaxed); }
+    uint64_t getProcessedFrames() const { return m_frames.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Fraction of real time spent in this effect, 0.01 means 1% of one core
+     */
+    double getCpuLoad(int sampleRate) const {
+        const uint64_t frames = getProcessedFrames();
+        if (frames == 0) return 0.0;
+        return (getProcessNanoseconds() / 1e9) / (static_cast<double>(frames) / sampleRate);
+    }
+
+    protected:
+    virtual void process(float* const* channels, int numChannels, size_t frames, int sampleRate) = 0;
+
+    private:
+    std::atomic<uint64_t> m_nanoseconds{0};
+    std::atomic<uint64_t> m_frames{0};
+};
+
+/**
+ * @brief Second order low-pass or high-pass filter (RBJ cookbook biquad)
+ * @note A low-pass with a falling cutoff is the cheapest way to push a sound into the distance.
+ */
+class BiquadFilter: public AudioEffect {
+    public:
+    enum Type { LOW_PASS, HIGH_PASS };
+
+    BiquadFilter(Type type, float cutoffHz, float q = 0.7071f): m_type(type), m_cutoff(cutoffHz), m_q(q) { }
+
+    void setCutoff(float hz) { m_cutoff.set(hz); }
+    const char* getName() const override { return (m_type == LOW_PASS) ? "low-pass" : "high-pass"; }
+    void reset() override {
+        for (auto& state : m_state) state = {0.0f, 0.0f};
+    }
+
+    protected:
+    void process(float* const* channels, int numChannels, size_t frames, int sampleRate) override {
+        // glide the cutoff across the block, refreshing the coefficients every SUB_BLOCK frames
+        const auto [from, to] = m_cutoff.advance(frames, sampleRate);
+        for (size_t offset = 0; offset < frames; offset += SUB_BLOCK) {
+            const size_t count = std::min(SUB_BLOCK, frames - offset);
+            updateCoefficients(from + (to - from) * (static_cast<float>(offset) / frames), sampleRate);
+
+            for (int c = 0; c < numChannels && c < MAX_CHANNELS; ++c) {
+                float* data = channels[c] + offset;
+                State& s = m_state[c];
+                for (size_t i = 0; i < count; ++i) { // transposed direct form II
+                    const float x = data[i];
+                    const float y = m_b0 * x + s.z1;
+                    s.z1 = m_b1 * x - m_a1 * y + s.z2;
+                    s.z2 = m_b2 * x - m_a2 * y;
+                    data[i] = y;
+                }
+            }
+        }
+    }
+
+    private:
+    static constexpr size_t SUB_BLOCK = 32;
+
+    void updateCoefficients(float cutoffHz, int sampleRate) {
+        if (cutoffHz == m_lastCutoff && sampleRate == m_lastRate) return;
+        m_lastCutoff = cutoffHz;
+        m_lastRate = sampleRate;
+
+        const float omega = 2.0f * 3.14159265f * std::clamp(cutoffHz, 10.0f, 0.49f * sampleRate) / sampleRate;
+        const float alpha = std::sin(omega) / (2.0f * m_q);
+        const float cosine = std::cos(omega);
+        const float a0 = 1.0f + alpha;
+
+        if (m_type == LOW_PASS) {
+            m_b0 = (1.0f - cosine) * 0.5f / a0;
+            m_b1 = (1.0f - cosine) / a0;
+        } else {
+            m_b0 = (1.0f + cosine) * 0.5f / a0;
+            m_b1 = -(1.0f + cosine) / a0;
+        }
+        m_b2 = m_b0;
+        m_a1 = -2.0f * cosine / a0;
+        m_a2 = (1.0f - alpha) / a0;
+    }
+
+    struct State { float z1, z2; };
+
+    Type m_type;
+    SmoothedParameter m_cutoff;
+    float m_q;
+    float m_b0 = 1.0f, m_b1 = 0.0f, m_b2 = 0.0f, m_a1 = 0.0f, m_a2 = 0.0f;
+    float m_lastCutoff = -1.0f;
+    int m_lastRate = 0;
+    State m_state[MAX_CHANNELS] = {};
+};
+
+/**
+ * @brief Feedback delay network reverb with four delay lines
+ * @note The four lines are processed together in one SIMD register and mixed through a Hadamard
+ * matrix each sample. Each line has a one-pole low-pass in its feedback path so highs die first.
+ */
+class FdnReverb: public AudioEffect {
+    public:
+    FdnReverb(float decaySeconds = 1.5f, float wet = 0.3f, float damping = 0.3f)
+        : m_decay(decaySeconds), m_wet(wet), m_damping(damping) { }
+
+    void setDecay(float seconds) { m_decay.set(seconds); }
+    void setWet(float wet) { m_wet.set(wet); }
+    const char* getName() const override { return "fdn reverb"; }
+    void prepare(int sampleRate) override {
+        static const int LENGTHS_AT_44100[4] = {1557, 1617, 1491, 1422}; // mutually prime, roughly 32-37 ms
+        for (int l = 0; l < 4; ++l) {
+            m_lines[l].assign(static_cast<size_t>(LENGTHS_AT_44100[l] * (sampleRate / 44100.0)) + 1, 0.0f);
+            m_cursor[l] = 0;
+        }
+        m_rate = sampleRate;
+    }
+    void reset() override {
+        for (auto& line : m_lines) std::fill(line.begin(), line.end(), 0.0f);
+        m_lowpass = simd::float4();
+    }
+
+    protected:
+    void process(float* const* channels, int numChannels, size_t frames, int sampleRate) override {
+        if (sampleRate != m_rate) return; // not prepared for this rate, pass the dry signal through
+
+        const float decay = m_decay.advance(frames, sampleRate).second;
+        const auto [wetFrom, wetTo] = m_wet.advance(frames, sampleRate);
+
+        // per-line feedback gain that makes every line fall 60 dB in the decay time
+        float gains[4];
+        for (int l = 0; l < 4; ++l) {
+            gains[l] = std::pow(10.0f, -3.0f * m_lines[l].size() / (std::max(decay, 0.05f) * sampleRate));
+        }
+        const simd::float4 feedback(gains[0], gains[1], gains[2], gains[3]);
+        const simd::float4 damping(m_damping);
+        const simd::float4 inputGain(0.5f);
+
+        for (size_t offset = 0; offset < frames; offset += SCRATCH_FRAMES) {
+            const size_t count = std::min(SCRATCH_FRAMES, frames - offset);
+
+            for (size_t i = 0; i < count; ++i) {
+                // mono send into the network
+                float in = 0.0f;
+                for (int c = 0; c < numChannels; ++c) in += channels[c][offset + i];
+                in /= numChannels;
+
+                // read the four line outputs, damp them, and scatter them back through the matrix
+                simd::float4 out(m_lines[0][m_cursor[0]], m_lines[1][m_cursor[1]], m_lines[2][m_cursor[2]], m_lines[3][m_cursor[3]]);
+                m_lowpass = m_lowpass + (out - m_lowpass) * (simd::float4(1.0f) - damping);
+                const simd::float4 next = simd::hadamard4(m_lowpass) * feedback + simd::float4(in) * inputGain;
+
+                float written[4], taps[4];
+                next.store(written);
+                out.store(taps);
+                for (int l = 0; l < 4; ++l) {
+                    m_lines[l][m_cursor[l]] = written[l];
+                    m_cursor[l] = (m_cursor[l] + 1 == m_lines[l].size()) ? 0 : m_cursor[l] + 1;
+                }
+
+                m_wetLeft[i] = 0.5f * (taps[0] + taps[2]);
+                m_wetRight[i] = 0.5f * (taps[1] + taps[3]);
+            }
+
+            // add the wet signal onto the dry one, gliding the wet level across the block
+            const float from = wetFrom + (wetTo - wetFrom) * (static_cast<float>(offset) / frames);
+            const float to = wetFrom + (wetTo - wetFrom) * (static_cast<float>(offset + count) / frames);
+            for (int c = 0; c < numChannels; ++c) {
+                simd::accumulate(channels[c] + offset, (c % 2 == 0) ? m_wetLeft : m_wetRight, count, from, to);
+            }
+        }
+    }
+
+    private:
+    static constexpr size_t SCRATCH_FRAMES = 256;
+
+    SmoothedParameter m_decay;
+    SmoothedParameter m_wet;
+    float m_damping;
+    std::vector<float> m_lines[4];
+    size_t m_cursor[4] = {0, 0, 0, 0};
+    simd::float4 m_lowpass;
+    int m_rate = 0;
+    float m_wetLeft[SCRATCH_FRAMES];
+    float m_wetRight[SCRATCH_FRAMES];
+};
+
+/**
+ * @brief Level of a sidechain signal, written by an EnvelopeFollower and read by a DuckingEffect
+ */
+struct SidechainKey {
+    std::atomic<float> level{0.0f};
+};
+
+/**
+ * @brief Measures the level of a channel for other effects to react to, the audio passes through unchanged
+ */
+class EnvelopeFollower: public AudioEffect {
+    public:
+    EnvelopeFollower(SidechainKey& key, float releaseMs = 250.0f): m_key(key), m_releaseMs(releaseMs) { }
+
+    const char* getName() const override { return "envelope follower"; }
+    void reset() override {
+        m_envelope = 0.0f;
+        m_key.level.store(0.0f, std::memory_order_relaxed);
+    }
+
+    protected:
+    void process(float* const* channels, int numChannels, size_t frames, int sampleRate) override {
+        float peak = 0.0f;
+        for (int c = 0; c < numChannels; ++c) peak = std::max(peak, simd::peak(channels[c], frames));
+
+        // instant attack, exponential release
+        const float release = std::exp(-static_cast<float>(frames) / (m_releaseMs * 0.001f * sampleRate));
+        m_envelope = std::max(peak, m_envelope * release);
+        m_key.level.store(m_envelope, std::memory_order_relaxed);
+    }
+
+    private:
+    SidechainKey& m_key;
+    float m_releaseMs;
+    float m_envelope = 0.0f;
+};
+
+/**
+ * @brief Turns a channel down while any of its sidechain keys is loud (ex: ambience under thunder or dialogue)
+ */
+class DuckingEffect: public AudioEffect {
+    public:
+    DuckingEffect(std::vector<const SidechainKey*> keys, float threshold = 0.1f, float duckedGain = 0.3f, float smoothingMs = 80.0f)
+        : m_keys(std::move(keys)), m_threshold(threshold), m_duckedGain(duckedGain), m_gain(1.0f, smoothingMs) { }
+
+    const char* getName() const override { return "ducking"; }
+    void reset() override { m_gain.set(1.0f); m_gain.snap(); }
+
+    protected:
+    void process(float* const* channels, int numChannels, size_t frames, int sampleRate) override {
+        float key = 0.0f;
+        for (const SidechainKey* k : m_keys) key = std::max(key, k->level.load(std::memory_order_relaxed));
+
+        m_gain.set((key > m_threshold) ? m_duckedGain : 1.0f);
+        const auto [from, to] = m_gain.advance(frames, sampleRate);
+        for (int c = 0; c < numChannels; ++c) simd::ramp(channels[c], frames, from, to);
+    }
+
+    private:
+    std::vector<const SidechainKey*> m_keys;
+    float m_threshold;
+    float m_duckedGain;
+    SmoothedParameter m_gain;
+};
+
+/**
+ * @brief Peak limiter with an optional make-up gain
+ * @note Make-up gain makes a single voice as loud as several layered copies of it, while the
+ * limiter keeps the result from clipping.
+ */
+class Limiter: public AudioEffect {
+    public:
+    Limiter(float threshold = 0.95f, float makeupGain = 1.0f, float releaseMs = 120.0f)
+        : m_threshold(threshold), m_makeup(makeupGain), m_releaseMs(releaseMs) { }
+
+    void setMakeupGain(float gain) { m_makeup.set(gain); }
+    const char* getName() const override { return "limiter"; }
+    void reset() override { m_gain = 1.0f; m_makeup.snap(); }
+
+    protected:
+    void process(float* const* channels, int numChannels, size_t frames, int sampleRate) override {
+        const auto [makeupFrom, makeupTo] = m_makeup.advance(frames, sampleRate);
+        const float release = std::exp(-static_cast<float>(SUB_BLOCK) / (m_releaseMs * 0.001f * sampleRate));
+
+        for (size_t offset = 0; offset < frames; offset += SUB_BLOCK) {
+            const size_t count = std::min(SUB_BLOCK, frames - offset);
+            const float makeupStart = makeupFrom + (makeupTo - makeupFrom) * (static_cast<float>(offset) / frames);
+            const float makeupEnd = makeupFrom + (makeupTo - makeupFrom) * (static_cast<float>(offset + count) / frames);
+
+            // the gain this sub-block needs to stay under the threshold
+            float peak = 0.0f;
+            for (int c = 0; c < numChannels; ++c) peak = std::max(peak, simd::peak(channels[c] + offset, count));
+            peak *= std::max(makeupStart, makeupEnd);
+            const float needed = (peak > m_threshold) ? m_threshold / peak : 1.0f;
+
+            // clamp down at once, recover slowly
+            const float previous = m_gain;
+            m_gain = (needed < m_gain) ? needed : std::min(needed, 1.0f - (1.0f - m_gain) * release);
+            const float from = (m_gain < previous) ? m_gain : previous;
+
+            for (int c = 0; c < numChannels; ++c) {
+                simd::ramp(channels[c] + offset, count, from * makeupStart, m_gain * makeupEnd);
+            }
+        }
+    }
+
+    private:
+    static constexpr size_t SUB_BLOCK = 32;
+
+    float m_threshold;
+    SmoothedParameter m_makeup;
+    float m_releaseMs;
+    float m_gain = 1.0f;
+};
+
+/**
+ * @brief An ordered list of effects that SDL_mixer runs on a channel or on the final mix
+ * @note Attach one chain per channel, since effects keep per-voice state. SDL_mixer removes a
+ * channel's effects when its voice ends, so chains attached through MixerFrontEnd::setChannelEffect()
+ * are re-attached for each new voice. Attach to MIX_CHANNEL_POST for the master bus.
+ */
+class EffectChain {
+    public:
+    static const size_t MAX_BLOCK_FRAMES = 1024;
+
+    template <typename Effect, typename... Args>
+    Effect* add(Args&&... args) {
+        m_effects.push_back(std::make_unique<Effect>(std::forward<Args>(args)...));
+        return static_cast<Effect*>(m_effects.back().get());
+    }
+
+    /**
+     * @brief Registers the chain on a channel, call with the mixer open
+     * @return false if SDL_mixer refused the effect
+     */
+    bool attach(int channel) {
+        if (m_channels == 0 && !prepare()) return false;
+        return Mix_RegisterEffect(channel, &EffectChain::effectCallback, &EffectChain::doneCallback, this) != 0;
+    }
+
+    void detach(int channel) {
+        Mix_UnregisterEffect(channel, &EffectChain::effectCallback);
+    }
+
+    /**
+     * @brief Reads the mixer's format and lets every effect allocate for its sample rate
+     * @note Call with the mixer open, after adding the effects and before the chain first runs.
+     * @return false if the mixer is not open
+     */
+    bool prepare() {
+        int frequency, channels;
+        Uint16 format;
+        if (Mix_QuerySpec(&frequency, &format, &channels) == 0) return false;
+
+        m_sampleRate = frequency;
+        m_format = format;
+        m_channels = std::min(channels, AudioEffect::MAX_CHANNELS);
+        for (auto& effect : m_effects) effect->prepare(m_sampleRate);
+        return true;
+    }
+
+    const std::vector<std::unique_ptr<AudioEffect>>& getEffects() const { return m_effects; }
+    int getSampleRate() const { return m_sampleRate; }
+
+    static void effectCallback([[maybe_unused]] int chan, void* stream, int len, void* udata) {
+        static_cast<EffectChain*>(udata)->processStream(stream, len);
+    }
+
+    static void doneCallback([[maybe_unused]] int chan, void* udata) {
+        for (auto& effect : static_cast<EffectChain*>(udata)->m_effects) effect->reset();
+    }
+
+    private:
+    void processStream(void* stream, int len) {
+        const bool isFloat = SDL_AUDIO_ISFLOAT(m_format) && SDL_AUDIO_BITSIZE(m_format) == 32;
+        const bool isS16 = !SDL_AUDIO_ISFLOAT(m_format) && SDL_AUDIO_BITSIZE(m_format) == 16;
+        if ((!isFloat && !isS16) || m_channels == 0) return; // other device formats pass through untouched
+
+        const size_t sampleBytes = isFloat ? sizeof(float) : sizeof(int16_t);
+        const size_t totalFrames = len / (sampleBytes * m_channels);
+        float* planar[AudioEffect::MAX_CHANNELS];
+        for (int c = 0; c < m_channels; ++c) planar[c] = m_planar[c];
+
+        for (size_t offset = 0; offset < totalFrames; offset += MAX_BLOCK_FRAMES) {
+            const size_t frames = std::min(MAX_BLOCK_FRAMES, totalFrames - offset);
+            const size_t samples = frames * m_channels;
+
+            // to float...
+            float* interleaved;
+            if (isS16) {
+                simd::s16ToFloat(static_cast<int16_t*>(stream) + offset * m_channels, m_interleaved, samples);
+                interleaved = m_interleaved;
+            } else {
+                interleaved = static_cast<float*>(stream) + offset * m_channels;
+            }
+
+            // ...to one array per channel...
+            for (size_t i = 0; i < frames; ++i) {
+                for (int c = 0; c < m_channels; ++c) planar[c][i] = interleaved[i * m_channels + c];
+            }
+
+            // ...through every effect...
+            for (auto& effect : m_effects) effect->run(planar, m_channels, frames, m_sampleRate);
+
+            // ...and back
+            for (size_t i = 0; i < frames; ++i) {
+                for (int c = 0; c < m_channels; ++c) interleaved[i * m_channels + c] = planar[c][i];
+            }
+            if (isS16) simd::floatToS16(m_interleaved, static_cast<int16_t*>(stream) + offset * m_channels, samples);
+        }
+    }
+
+    std::vector<std::unique_ptr<AudioEffect>> m_effects;
+    int m_sampleRate = 44100;
+    Uint16 m_format = 0;
+    int m_channels = 0;
+    float m_interleaved[MAX_BLOCK_FRAMES * AudioEffect::MAX_CHANNELS];
+    float m_planar[AudioEffect::MAX_CHANNELS][MAX_BLOCK_FRAMES];
+};
@@ -0,0 +1,588 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+#include "FLAC/stream_decoder.h"
+
+#include "../tests/resampler.hpp"
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Minimal MD5, only used to check decoded FLAC audio against the signature in STREAMINFO
+ */
+class Md5 {
+    public:
+    Md5() { reset(); }
+
+    void reset() {
+        m_state[0] = 0x67452301; m_state[1] = 0xefcdab89; m_state[2] = 0x98badcfe; m_state[3] = 0x10325476;
+        m_length = 0;
+        m_pending = 0;
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        m_length += size;
+        if (m_pending) {
+            const size_t take = std::min(size, sizeof(m_block) - m_pending);
+            memcpy(m_block + m_pending, data, take);
+            m_pending += take;
+            data += take;
+            size -= take;
+            if (m_pending < sizeof(m_block)) return;
+            transform(m_block);
+            m_pending = 0;
+        }
+        for (; size >= sizeof(m_block); data += sizeof(m_block), size -= sizeof(m_block)) transform(data);
+        memcpy(m_block, data, size);
+        m_pending = size;
+    }
+
+    void finish(uint8_t digest[16]) {
+        const uint64_t bits = m_length * 8;
+        const uint8_t pad = 0x80;
+        const uint8_t zero = 0;
+        update(&pad, 1);
+        while (m_pending != 56) update(&zero, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i) length[i] = static_cast<uint8_t>(bits >> (8 * i));
+        update(length, 8);
+        for (int i = 0; i < 16; ++i) digest[i] = static_cast<uint8_t>(m_state[i / 4] >> (8 * (i % 4)));
+    }
+
+    private:
+    static uint32_t rotate(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void transform(const uint8_t* block) {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+        };
+        static const int SHIFTS[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+        uint32_t words[16];
+        for (int i = 0; i < 16; ++i) {
+            words[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+        }
+
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f;
+            int g;
+            switch (i / 16) {
+                case 0:  f = (b & c) | (~b & d); g = i; break;
+                case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+                case 2:  f = b ^ c ^ d;          g = (3 * i + 5) % 16; break;
+                default: f = c ^ (b | ~d);       g = (7 * i) % 16; break;
+            }
+            const uint32_t next = d;
+            d = c;
+            c = b;
+            b += rotate(a + f + K[i] + words[g], SHIFTS[(i / 16) * 4 + i % 4]);
+            a = next;
+        }
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    }
+
+    uint32_t m_state[4];
+    uint64_t m_length;
+    uint8_t m_block[64];
+    size_t m_pending;
+};
+
+/**
+ * @brief Loads FLAC files by decoding ranges of frames on several threads at once
+ * @note FLAC frames decode independently of each other once their start is known. The loader
+ * reads the whole file, splits the audio into one byte range per thread, moves every split point
+ * to the next frame header (a SEEKTABLE point when there is one, else a scan for the sync code
+ * whose header CRC-8 checks out) and decodes each range with its own libFLAC decoder straight
+ * into its part of one preallocated PCM buffer.
+ *
+ * Each decoder is fed a stream made of the STREAMINFO block followed by its range, so it numbers
+ * samples exactly like a decoder that read the file from the start. A false split point (a sync
+ * code inside audio data that passes the CRC-8) shows up as a decode error or a gap between the
+ * ranges, as does a bad MD5, in which case the file is decoded again on one thread.
+ */
+class FlacLoader {
+    public:
+    static const size_t MIN_RANGE_BYTES = 256 * 1024; // smaller ranges cost more in decoder setup than they gain
+
+    /**
+     * @brief Decoded audio at the file's own rate and bit depth
+     */
+    struct Pcm {
+        std::vector<int32_t> samples; // interleaved, frames * channels of them
+        uint64_t frames = 0;
+        unsigned channels = 0;
+        unsigned sampleRate = 0;
+        unsigned bitsPerSample = 0;
+    };
+
+    /**
+     * @param threads How many ranges to decode at once, 0 uses every core
+     */
+    explicit FlacLoader(unsigned threads = 0)
+        : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) { }
+
+    /**
+     * @brief Reads a whole file into memory
+     * @note Also used by SoundBank, which reads on its I/O pool and decodes on another.
+     * @return false if the file could not be opened, sized or read, or is empty
+     */
+    static bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        bool ok = fseek(file, 0, SEEK_END) == 0;
+        const long size = ok ? ftell(file) : -1;
+        ok = ok && size > 0 && fseek(file, 0, SEEK_SET) == 0;
+        if (ok) {
+            data.resize(static_cast<size_t>(size));
+            ok = fread(data.data(), 1, data.size(), file) == data.size();
+        }
+        fclose(file);
+        return ok;
+    }
+
+    /**
+     * @brief Decodes a whole FLAC file
+     * @param verifyMd5 Checks the decoded audio against STREAMINFO's MD5, when the encoder wrote one
+     * @return false if the file could not be read or decoded
+     */
+    bool decode(const std::string& path, Pcm& pcm, bool verifyMd5 = true) {
+        std::vector<uint8_t> data;
+        if (!readFile(path, data)) {
+            std::cerr << "Failed to read FLAC file " << path << std::endl;
+            return false;
+        }
+        return decode(std::move(data), path, pcm, verifyMd5);
+    }
+
+    /**
+     * @brief Decodes a FLAC file that was already read into memory, for callers that read on their own threads
+     * @param data The whole file, the loader takes it over
+     * @param path Names the file in error messages
+     * @param verifyMd5 Checks the decoded audio against STREAMINFO's MD5, when the encoder wrote one
+     * @return false if the file could not be decoded
+     */
+    bool decode(std::vector<uint8_t> data, const std::string& path, Pcm& pcm, bool verifyMd5 = true) {
+        TRACE_SCOPE(DECODE_AUDIO, "loadFlac", 0);
+        Stream stream;
+        stream.data = std::move(data);
+        if (!parseMetadata(stream)) {
+            std::cerr << "Failed to read FLAC file " << path << std::endl;
+            return false;
+        }
+        pcm.channels = stream.channels;
+        pcm.sampleRate = stream.sampleRate;
+        pcm.bitsPerSample = stream.bitsPerSample;
+
+        // the length is unknown without a total sample count, so only one range can append to the buffer
+        std::vector<Range> ranges = (stream.totalFrames > 0) ? split(stream) : std::vector<Range>{Range{stream.audioStart, stream.data.size()}};
+        m_lastRanges = ranges.size();
+        m_lastFellBack = false;
+        if (ranges.size() > 1) {
+            if (decodeRanges(stream, ranges, pcm, true) && (!verifyMd5 || checkMd5(stream, pcm))) return true;
+
+            std::cerr << "Parallel FLAC decode of " << path << " did not verify, decoding it on one thread" << std::endl;
+            ranges.assign(1, Range{stream.audioStart, stream.data.size()});
+            m_lastFellBack = true;
+        }
+
+        // like a plain libFLAC decode, damaged frames are skipped and left silent
+        if (!decodeRanges(stream, ranges, pcm, false)) {
+            std::cerr << "Failed to decode FLAC file " << path << std::endl;
+            return false;
+        }
+        if (ranges[0].errors) std::cerr << path << " has " << ranges[0].errors << " decode error(s)" << std::endl;
+        if (verifyMd5 && !checkMd5(stream, pcm)) std::cerr << "MD5 mismatch in " << path << ", the file is damaged" << std::endl;
+        return true;
+    }
+
+    /**
+     * @brief Decodes a FLAC file into a chunk in SDL_mixer's output format, a drop-in for Mix_LoadWAV
+     * @note Rate conversion goes through the polyphase resampler, channel and sample format
+     * conversion through SDL. Mix_FreeChunk frees the chunk.
+     * @return The chunk, or nullptr on failure
+     */
+    Mix_Chunk* loadChunk(const std::string& path) {
+        Pcm pcm;
+        if (!decode(path, pcm)) return nullptr;
+        return toChunk(pcm, path);
+    }
+
+    /**
+     * @brief Same as loadChunk(path) for a file that was already read into memory
+     * @param data The whole file, the loader takes it over
+     * @param path Names the file in error messages
+     */
+    Mix_Chunk* loadChunk(std::vector<uint8_t> data, const std::string& path) {
+        Pcm pcm;
+        if (!decode(std::move(data), path, pcm)) return nullptr;
+        return toChunk(pcm, path);
+    }
+
+    unsigned getThreads() const { return m_threads; }
+    size_t getLastRangeCount() const { return m_lastRanges; } // ranges the last file was split into
+    bool getLastFellBack() const { return m_lastFellBack; }   // true if the last file had to be decoded again on one thread
+
+    private:
+    static const size_t STREAMINFO_LENGTH = 34;
+
+    /**
+     * @brief Converts decoded audio to SDL_mixer's output format
+     */
+    static Mix_Chunk* toChunk(Pcm& pcm, const std::string& path) {
+        int mixerRate, mixerChannels;
+        Uint16 mixerFormat;
+        if (!Mix_QuerySpec(&mixerRate, &mixerFormat, &mixerChannels)) {
+            std::cerr << "Failed to load " << path << ": the audio device is not open" << std::endl;
+            return nullptr;
+        }
+
+        std::vector<float> converted;
+        {
+            TRACE_SCOPE(DECODE_AUDIO, "resampleFlac", 0);
+            std::vector<float> samples(pcm.samples.size());
+            const float scale = 1.0f / static_cast<float>(1u << (pcm.bitsPerSample - 1));
+            for (size_t i = 0; i < samples.size(); ++i) samples[i] = pcm.samples[i] * scale;
+            pcm.samples = std::vector<int32_t>(); // half of the peak memory
+
+            PolyphaseResampler resampler(static_cast<int>(pcm.sampleRate), mixerRate, static_cast<int>(pcm.channels), PolyphaseResampler::BEST);
+            if (resampler.isPassthrough()) {
+                converted.swap(samples);
+            } else {
+                converted.reserve(static_cast<size_t>(samples.size() * (static_cast<double>(mixerRate) / pcm.sampleRate)) + 1024);
+                resampler.process(samples.data(), static_cast<size_t>(pcm.frames), converted);
+                resampler.flush(converted);
+            }
+        }
+
+        SDL_AudioCVT cvt;
+        if (SDL_BuildAudioCVT(&cvt, AUDIO_F32SYS, static_cast<Uint8>(pcm.channels), mixerRate, mixerFormat, static_cast<Uint8>(mixerChannels), mixerRate) < 0) {
+            std::cerr << "Failed to convert " << path << ": " << SDL_GetError() << std::endl;
+            return nullptr;
+        }
+        cvt.len = static_cast<int>(converted.size() * sizeof(float));
+        cvt.buf = static_cast<Uint8*>(SDL_malloc(static_cast<size_t>(cvt.len) * cvt.len_mult));
+        if (!cvt.buf) return nullptr;
+        memcpy(cvt.buf, converted.data(), cvt.len);
+        if (cvt.needed && SDL_ConvertAudio(&cvt) < 0) {
+            std::cerr << "Failed to convert " << path << ": " << SDL_GetError() << std::endl;
+            SDL_free(cvt.buf);
+            return nullptr;
+        }
+
+        // the same layout Mix_LoadWAV returns, so Mix_FreeChunk releases both allocations
+        Mix_Chunk* chunk = static_cast<Mix_Chunk*>(SDL_malloc(sizeof(Mix_Chunk)));
+        if (!chunk) {
+            SDL_free(cvt.buf);
+            return nullptr;
+        }
+        chunk->allocated = 1;
+        chunk->abuf = cvt.buf;
+        chunk->alen = static_cast<Uint32>(cvt.needed ? cvt.len_cvt : cvt.len);
+        chunk->volume = MIX_MAX_VOLUME;
+        return chunk;
+    }
+
+    struct Stream {
+        std::vector<uint8_t> data;    // the whole file
+        uint8_t header[4 + 4 + STREAMINFO_LENGTH]; // "fLaC" and STREAMINFO as the last metadata block
+        size_t audioStart = 0;        // offset of the first frame
+        std::vector<size_t> seekPoints; // frame offsets from SEEKTABLE
+        unsigned channels = 0;
+        unsigned sampleRate = 0;
+        unsigned bitsPerSample = 0;
+        uint64_t totalFrames = 0;     // 0 when the encoder did not know
+        uint8_t md5[16];
+        bool variableBlocks = false;
+    };
+
+    struct Range {
+        size_t begin;                 // file offset of the range's first frame
+        size_t end;                   // file offset of the next range's first frame
+        uint64_t firstSample = UINT64_MAX;
+        uint64_t endSample = 0;
+        uint64_t written = 0;
+        size_t errors = 0;
+    };
+
+    struct RangeDecode {
+        const Stream* stream;
+        Range* range;
+        Pcm* pcm;
+        size_t position = 0;          // in the header followed by the range
+        bool growable = false;
+    };
+
+    static bool parseMetadata(Stream& stream) {
+        const std::vector<uint8_t>& data = stream.data;
+        size_t position = 0;
+        if (data.size() >= 10 && memcmp(data.data(), "ID3", 3) == 0) { // skip an ID3v2 tag, its size is syncsafe
+            position = 10 + ((data[6] & 0x7F) << 21 | (data[7] & 0x7F) << 14 | (data[8] & 0x7F) << 7 | (data[9] & 0x7F));
+        }
+        if (position + 8 + STREAMINFO_LENGTH > data.size() || memcmp(data.data() + position, "fLaC", 4) != 0) return false;
+        position += 4;
+        if ((data[position] & 0x7F) != 0) return false; // STREAMINFO always comes first
+
+        memcpy(stream.header, "fLaC", 4);
+        memcpy(stream.header + 4, data.data() + position, 4 + STREAMINFO_LENGTH);
+        stream.header[4] |= 0x80; // the decoders see no other metadata
+
+        const uint8_t* info = data.data() + position + 4;
+        stream.variableBlocks = (info[0] << 8 | info[1]) != (info[2] << 8 | info[3]);
+        stream.sampleRate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+        stream.channels = ((info[12] >> 1) & 0x07) + 1;
+        stream.bitsPerSample = ((info[12] & 0x01) << 4 | info[13] >> 4) + 1;
+        stream.totalFrames = static_cast<uint64_t>(info[13] & 0x0F) << 32 | static_cast<uint64_t>(info[14]) << 24 | info[15] << 16 | info[16] << 8 | info[17];
+        memcpy(stream.md5, info + 18, 16);
+        if (stream.sampleRate == 0) return false;
+
+        std::vector<uint64_t> seekOffsets;
+        for (bool last = false; !last;) {
+            if (position + 4 > data.size()) return false;
+            last = (data[position] & 0x80) != 0;
+            const unsigned type = data[position] & 0x7F;
+            const size_t length = data[position + 1] << 16 | data[position + 2] << 8 | data[position + 3];
+            position += 4;
+            if (position + length > data.size()) return false;
+
+            if (type == 3) { // SEEKTABLE, 18 byte points, placeholders have all ones as their sample number
+                for (size_t point = position; point + 18 <= position + length; point += 18) {
+                    if (memcmp(data.data() + point, "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8) == 0) continue;
+                    uint64_t offset = 0;
+                    for (int i = 8; i < 16; ++i) offset = offset << 8 | data[point + i];
+                    seekOffsets.push_back(offset);
+                }
+            }
+            position += length;
+        }
+        stream.audioStart = position;
+        for (uint64_t offset : seekOffsets) { // relative to the first frame
+            if (offset < data.size() - position) stream.seekPoints.push_back(position + static_cast<size_t>(offset));
+        }
+        std::sort(stream.seekPoints.begin(), stream.seekPoints.end());
+        return true;
+    }
+
+    /**
+     * @brief One range per thread, each starting on a frame header
+     */
+    std::vector<Range> split(const Stream& stream) const {
+        const size_t end = stream.data.size();
+        const size_t audioBytes = end - stream.audioStart;
+        const size_t count = std::max<size_t>(1, std::min<size_t>(m_threads, audioBytes / MIN_RANGE_BYTES));
+
+        std::vector<size_t> starts{stream.audioStart};
+        for (size_t i = 1; i < count; ++i) {
+            const size_t target = stream.audioStart + audioBytes / count * i;
+
+            auto seekPoint = std::lower_bound(stream.seekPoints.begin(), stream.seekPoints.end(), target);
+            size_t start = (seekPoint != stream.seekPoints.end() && isFrameHeader(stream, *seekPoint)) ? *seekPoint : findFrame(stream, target);
+            if (start > starts.back() && start < end) starts.push_back(start);
+        }
+
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < starts.size(); ++i) {
+            ranges.push_back(Range{starts[i], (i + 1 < starts.size()) ? starts[i + 1] : end});
+        }
+        return ranges;
+    }
+
+    static size_t findFrame(const Stream& stream, size_t from) {
+        for (size_t i = from; i + 1 < stream.data.size(); ++i) {
+            if (stream.data[i] == 0xFF && (stream.data[i + 1] & 0xFE) == 0xF8 && isFrameHeader(stream, i)) return i;
+        }
+        return stream.data.size();
+    }
+
+    /**
+     * @brief Checks the sync code, the fields the stream fixes and the header's CRC-8
+     */
+    static bool isFrameHeader(const Stream& stream, size_t offset) {
+        const uint8_t* p = stream.data.data() + offset;
+        const size_t available = stream.data.size() - offset;
+        if (available < 6 || p[0] != 0xFF || (p[1] & 0xFE) != 0xF8) return false;
+        if ((p[1] & 0x01) != (stream.variableBlocks ? 1 : 0)) return false;
+
+        const unsigned blockCode = p[2] >> 4;
+        const unsigned rateCode = p[2] & 0x0F;
+        const unsigned assignment = p[3] >> 4;
+        const unsigned sizeCode = (p[3] >> 1) & 0x07;
+        if (blockCode == 0 || rateCode == 15 || assignment > 10 || sizeCode == 3 || (p[3] & 0x01)) return false;
+        if ((assignment < 8 ? assignment + 1 : 2) != stream.channels) return false;
+
+        // the frame or sample number is UTF-8 coded
+        size_t length = 5;
+        const uint8_t lead = p[4];
+        size_t extra;
+        if (lead < 0x80) extra = 0;
+        else if ((lead & 0xE0) == 0xC0) extra = 1;
+        else if ((lead & 0xF0) == 0xE0) extra = 2;
+        else if ((lead & 0xF8) == 0xF0) extra = 3;
+        else if ((lead & 0xFC) == 0xF8) extra = 4;
+        else if ((lead & 0xFE) == 0xFC) extra = 5;
+        else if (lead == 0xFE) extra = 6;
+        else return false;
+        if (available < length + extra) return false;
+        for (size_t i = 0; i < extra; ++i) {
+            if ((p[length + i] & 0xC0) != 0x80) return false;
+        }
+        length += extra;
+
+        if (blockCode == 6) length += 1;
+        else if (blockCode == 7) length += 2;
+        if (rateCode == 12) length += 1;
+        else if (rateCode == 13 || rateCode == 14) length += 2;
+        if (available < length + 1) return false;
+
+        uint8_t crc = 0;
+        for (size_t i = 0; i < length; ++i) {
+            crc ^= p[i];
+            for (int bit = 0; bit < 8; ++bit) crc = static_cast<uint8_t>((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+        return crc == p[length];
+    }
+
+    /**
+     * @brief Decodes every range, each on its own thread
+     * @param strict Fails on any decode error or if the ranges do not tile the stream exactly
+     */
+    static bool decodeRanges(const Stream& stream, std::vector<Range>& ranges, Pcm& pcm, bool strict) {
+        const bool growable = ranges.size() == 1 && stream.totalFrames == 0;
+        pcm.frames = stream.totalFrames;
+        pcm.samples.assign(static_cast<size_t>(pcm.frames) * stream.channels, 0);
+
+        std::vector<std::future<bool>> pending;
+        for (size_t i = 1; i < ranges.size(); ++i) {
+            pending.push_back(std::async(std::launch::async, [&stream, &range = ranges[i], &pcm, i]() {
+                TRACE_THREAD_NAME("flac");
+                TRACE_SCOPE(DECODE_AUDIO, "flacRange", static_cast<int64_t>(i));
+                return decodeRange(stream, range, pcm, false);
+            }));
+        }
+        bool decoded = decodeRange(stream, ranges[0], pcm, growable); // the first range on this thread
+        for (std::future<bool>& result : pending) decoded = result.get() && decoded;
+        if (!decoded) return false;
+        if (!strict) return ranges[0].written > 0;
+
+        uint64_t expected = 0;
+        for (const Range& range : ranges) {
+            if (range.errors || range.firstSample != expected || range.written != range.endSample - range.firstSample) return false;
+            expected = range.endSample;
+        }
+        return expected == pcm.frames;
+    }
+
+    static bool decodeRange(const Stream& stream, Range& range, Pcm& pcm, bool growable) {
+        FLAC__StreamDecoder* decoder = FLAC__stream_decoder_new();
+        if (!decoder) return false;
+
+        RangeDecode context{&stream, &range, &pcm, 0, growable};
+        bool ok = FLAC__stream_decoder_init_stream(decoder, read, nullptr, nullptr, nullptr, nullptr, write, nullptr, error, &context)
+                  == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+        ok = ok && FLAC__stream_decoder_process_until_end_of_stream(decoder);
+        if (ok && FLAC__stream_decoder_get_state(decoder) == FLAC__STREAM_DECODER_ABORTED) ok = false;
+        FLAC__stream_decoder_finish(decoder);
+        FLAC__stream_decoder_delete(decoder);
+        return ok;
+    }
+
+    static FLAC__StreamDecoderReadStatus read(const FLAC__StreamDecoder*, FLAC__byte buffer[], size_t* bytes, void* clientData) {
+        RangeDecode& context = *static_cast<RangeDecode*>(clientData);
+        const size_t headerLength = sizeof(context.stream->header);
+        size_t copied = 0;
+
+        if (context.position < headerLength) {
+            copied = std::min(*bytes, headerLength - context.position);
+            memcpy(buffer, context.stream->header + context.position, copied);
+            context.position += copied;
+        }
+        const size_t offset = context.range->begin + (context.position - headerLength);
+        const size_t count = std::min(*bytes - copied, context.range->end - offset);
+        memcpy(buffer + copied, context.stream->data.data() + offset, count);
+        context.position += count;
+        copied += count;
+
+        *bytes = copied;
+        return copied ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    static FLAC__StreamDecoderWriteStatus write(const FLAC__StreamDecoder*, const FLAC__Frame* frame, const FLAC__int32* const buffer[], void* clientData) {
+        RangeDecode& context = *static_cast<RangeDecode*>(clientData);
+        Pcm& pcm = *context.pcm;
+        const unsigned channels = frame->header.channels;
+        const uint64_t first = frame->header.number.sample_number;
+        const uint64_t end = first + frame->header.blocksize;
+        if (channels != pcm.channels) return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+        if (end > pcm.frames) {
+            if (!context.growable) return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT; // more audio than STREAMINFO says
+            pcm.frames = end;
+            pcm.samples.resize(static_cast<size_t>(end) * channels);
+        }
+
+        int32_t* out = pcm.samples.data() + first * channels;
+        for (unsigned i = 0; i < frame->header.blocksize; ++i) {
+            for (unsigned c = 0; c < channels; ++c) *out++ = buffer[c][i];
+        }
+
+        Range& range = *context.range;
+        range.firstSample = std::min(range.firstSample, first);
+        range.endSample = std::max(range.endSample, end);
+        range.written += frame->header.blocksize;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    static void error(const FLAC__StreamDecoder*, FLAC__StreamDecoderErrorStatus, void* clientData) {
+        ++static_cast<RangeDecode*>(clientData)->range->errors;
+    }
+
+    /**
+     * @brief FLAC's MD5 covers the samples as little-endian integers of the stream's byte width
+     * @return true if they match or the encoder left the signature empty
+     */
+    static bool checkMd5(const Stream& stream, const Pcm& pcm) {
+        static const uint8_t EMPTY[16] = {0};
+        if (memcmp(stream.md5, EMPTY, sizeof(EMPTY)) == 0) return true;
+        TRACE_SCOPE(DECODE_AUDIO, "flacMd5", 0);
+
+        const size_t width = (stream.bitsPerSample + 7) / 8;
+        Md5 md5;
+        std::vector<uint8_t> bytes;
+        const size_t blockSamples = 4096;
+        for (size_t start = 0; start < pcm.samples.size(); start += blockSamples) {
+            const size_t count = std::min(blockSamples, pcm.samples.size() - start);
+            bytes.resize(count * width);
+            uint8_t* out = bytes.data();
+            for (size_t i = 0; i < count; ++i) {
+                const uint32_t sample = static_cast<uint32_t>(pcm.samples[start + i]);
+                for (size_t b = 0; b < width; ++b) *out++ = static_cast<uint8_t>(sample >> (8 * b));
+            }
+            md5.update(bytes.data(), bytes.size());
+        }
+
+        uint8_t digest[16];
+        md5.finish(digest);
+        return memcmp(digest, stream.md5, sizeof(digest)) == 0;
+    }
+
+    unsigned m_threads;
+    size_t m_lastRanges = 0;
+    bool m_lastFellBack = false;
+};
@@ -0,0 +1,203 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "simplewebm/VPXDecoder.hpp"
+
+#include "../tests/memory_budget.hpp"
+#include "../tests/trace.hpp"
+
+/**
+ * @brief The last few seconds of decoded pictures and their audio, for stepping back and instant replay
+ * @note Every picture the decoder hands out is copied into the history with the audio decoded after
+ * it, so going back never touches the decoder, which could only get there by decoding again from the
+ * previous keyframe. Frames sit in a ring ordered by age, stepping to any of them is O(1).
+ *
+ * Pictures are kept as tightly packed I420 planes, optionally shrunk by a box filter to a half or a
+ * quarter of their size so a longer window fits, see chooseDownscale(). The history holds at most
+ * maxFrames frames and maxBytes bytes, and takes its memory from the VIDEO_FRAMES budget, audio
+ * included. When any of them is short the oldest frames go first, their storage is reused for the
+ * new picture.
+ */
+class FrameHistory {
+    public:
+    struct Frame {
+        double time = 0.0;          // seconds, of the picture in the media
+        int width[3] = {0, 0, 0};   // of each stored plane, after downscaling
+        int height[3] = {0, 0, 0};
+        std::vector<uint8_t> planes; // Y, U and V one after the other, each row width[p] bytes
+        std::vector<short> audio;    // interleaved samples decoded after the picture, at the mixer rate
+        size_t bytes = 0;            // taken from the budget for this frame
+
+        const uint8_t* getPlane(int plane) const {
+            const size_t offset = (plane > 0 ? static_cast<size_t>(width[0]) * height[0] : 0) +
+                                  (plane > 1 ? static_cast<size_t>(width[1]) * height[1] : 0);
+            return planes.data() + offset;
+        }
+    };
+
+    /**
+     * @param budget Holds the VIDEO_FRAMES category
+     * @param maxFrames Most frames the history keeps, at least one
+     * @param maxBytes Most bytes the history keeps, pictures and audio together
+     * @param downscale 1 keeps pictures as decoded, 2 or 4 keeps them at a half or a quarter of the size
+     */
+    FrameHistory(MemoryBudget& budget, size_t maxFrames, size_t maxBytes, int downscale = 1):
+        m_budget(budget), m_maxFrames(std::max<size_t>(1, maxFrames)), m_maxBytes(maxBytes), m_downscale(std::max(1, downscale)) { }
+    ~FrameHistory() {
+        clear();
+    }
+
+    FrameHistory(const FrameHistory&) = delete;
+    FrameHistory& operator=(const FrameHistory&) = delete;
+
+    /**
+     * @brief The smallest downscale, 1, 2 or 4, at which the given number of pictures fits the bytes
+     */
+    static int chooseDownscale(int width, int height, size_t frames, size_t maxBytes) {
+        for (int downscale = 1; downscale < 4; downscale *= 2) {
+            if (getPictureBytes(width, height, downscale) * frames <= maxBytes) return downscale;
+        }
+        return 4;
+    }
+
+    /**
+     * @brief Copies a decoded picture in as the newest frame
+     * @return false if not even this one picture fits, the history is empty then
+     */
+    bool addPicture(const VPXDecoder::Image& image, double time) {
+        TRACE_SCOPE(CONVERT, "FrameHistory::addPicture", 0);
+        int width[3], height[3];
+        size_t pictureBytes = 0;
+        for (int p = 0; p < 3; ++p) {
+            width[p] = (image.getWidth(p) + m_downscale - 1) / m_downscale;
+            height[p] = (image.getHeight(p) + m_downscale - 1) / m_downscale;
+            pictureBytes += static_cast<size_t>(width[p]) * height[p];
+        }
+
+        // when full, the oldest frame makes way and its storage holds the new picture
+        Frame frame;
+        const bool full = m_frames.size() >= m_maxFrames || m_bytes + pictureBytes > m_maxBytes ||
+                          m_budget.getHeadroom(MemoryBudget::VIDEO_FRAMES) < pictureBytes;
+        if (!m_frames.empty() && full) {
+            frame = std::move(m_frames.front());
+            m_frames.pop_front();
+            frame.audio.clear();
+        }
+        if (!grow(frame, frame.audio.capacity() * sizeof(short) + pictureBytes)) {
+            drop(frame);
+            clear();
+            return false;
+        }
+
+        frame.time = time;
+        frame.planes.resize(pictureBytes);
+        uint8_t* out = frame.planes.data();
+        for (int p = 0; p < 3; ++p) {
+            frame.width[p] = width[p];
+            frame.height[p] = height[p];
+            shrinkPlane(image.planes[p], image.linesize[p], image.getWidth(p), image.getHeight(p), out, frame.width[p], frame.height[p]);
+            out += static_cast<size_t>(frame.width[p]) * frame.height[p];
+        }
+        m_frames.push_back(std::move(frame));
+        return true;
+    }
+
+    /**
+     * @brief Appends audio to the newest frame, audio that does not fit even after dropping older frames is not kept
+     */
+    void addAudio(const std::vector<short>& samples) {
+        if (m_frames.empty() || samples.empty()) return;
+        Frame& newest = m_frames.back();
+        const size_t needed = newest.audio.size() + samples.size();
+        if (needed > newest.audio.capacity()) {
+            const size_t capacity = std::max(needed, newest.audio.capacity() * 2);
+            if (!grow(newest, newest.bytes + (capacity - newest.audio.capacity()) * sizeof(short))) return;
+            newest.audio.reserve(capacity);
+        }
+        newest.audio.insert(newest.audio.end(), samples.begin(), samples.end());
+    }
+
+    /**
+     * @brief A frame by age, 0 is the newest, up to getCount() - 1
+     */
+    const Frame& getFrame(size_t age) const { return m_frames[m_frames.size() - 1 - age]; }
+
+    size_t getCount() const { return m_frames.size(); }
+    size_t getBytes() const { return m_bytes; }
+    int getDownscale() const { return m_downscale; }
+    double getDuration() const { return m_frames.empty() ? 0.0 : m_frames.back().time - m_frames.front().time; }
+
+    void clear() {
+        while (!m_frames.empty()) {
+            drop(m_frames.front());
+            m_frames.pop_front();
+        }
+    }
+
+    private:
+    static size_t getPictureBytes(int width, int height, int downscale) { // 4:2:0, what SDL's IYUV textures take
+        const size_t lumaWidth = (width + downscale - 1) / downscale, lumaHeight = (height + downscale - 1) / downscale;
+        const size_t chromaWidth = ((width + 1) / 2 + downscale - 1) / downscale, chromaHeight = ((height + 1) / 2 + downscale - 1) / downscale;
+        return lumaWidth * lumaHeight + 2 * chromaWidth * chromaHeight;
+    }
+
+    /**
+     * @brief Makes a frame's reservation at least bytes, dropping the oldest frames while the history or the budget is short
+     */
+    bool grow(Frame& frame, size_t bytes) {
+        while (frame.bytes < bytes) {
+            const size_t more = bytes - frame.bytes;
+            if (m_bytes + more <= m_maxBytes && m_budget.tryReserve(MemoryBudget::VIDEO_FRAMES, more)) {
+                frame.bytes = bytes;
+                m_bytes += more;
+                return true;
+            }
+            if (m_frames.empty() || &m_frames.front() == &frame) return false;
+            drop(m_frames.front());
+            m_frames.pop_front();
+        }
+        return true;
+    }
+
+    void drop(Frame& frame) {
+        m_budget.release(MemoryBudget::VIDEO_FRAMES, frame.bytes);
+        m_bytes -= frame.bytes;
+        frame.bytes = 0;
+    }
+
+    /**
+     * @brief Copies a plane, averaging each downscale x downscale block into one sample
+     */
+    void shrinkPlane(const uint8_t* in, int linesize, int width, int height, uint8_t* out, int outWidth, int outHeight) const {
+        if (m_downscale == 1) {
+            for (int y = 0; y < height; ++y) std::memcpy(out + static_cast<size_t>(y) * width, in + static_cast<ptrdiff_t>(y) * linesize, width);
+            return;
+        }
+        for (int y = 0; y < outHeight; ++y) {
+            const int y0 = y * m_downscale, y1 = std::min(height, y0 + m_downscale);
+            for (int x = 0; x < outWidth; ++x) {
+                const int x0 = x * m_downscale, x1 = std::min(width, x0 + m_downscale);
+                unsigned sum = 0;
+                for (int sy = y0; sy < y1; ++sy) {
+                    const uint8_t* row = in + static_cast<ptrdiff_t>(sy) * linesize;
+                    for (int sx = x0; sx < x1; ++sx) sum += row[sx];
+                }
+                const unsigned count = static_cast<unsigned>((y1 - y0) * (x1 - x0));
+                out[static_cast<size_t>(y) * outWidth + x] = static_cast<uint8_t>((sum + count / 2) / count);
+            }
+        }
+    }
+
+    MemoryBudget& m_budget;
+    size_t m_maxFrames;
+    size_t m_maxBytes;
+    int m_downscale;
+    size_t m_bytes = 0;         // reserved by every frame, including one being refilled
+    std::deque<Frame> m_frames; // oldest first
+};
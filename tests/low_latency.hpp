@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+#include <SDL2/SDL.h>
+
+/**
+ * @brief Measures an audio callback from inside it: interval jitter, render time and late callbacks
+ * @note Only the audio thread writes, and only with relaxed atomic stores, so measuring never
+ * allocates, locks or waits. Any thread may read the figures while audio runs.
+ *
+ * SDL does not tell when the device actually ran dry, so an underrun is estimated: SDL keeps one
+ * period queued while the next one is rendered, a callback arriving more than two periods after
+ * the previous one means the device played everything it had.
+ */
+class CallbackTimer {
+    public:
+    static constexpr double UNDERRUN_INTERVAL = 2.0; // in periods
+
+    /**
+     * @brief Starts measuring a new device, call it while the device is closed or paused
+     * @param periodFrames Frames per callback
+     * @param sampleRate The device's rate
+     */
+    void reset(int periodFrames, int sampleRate) {
+        m_periodUs = static_cast<int64_t>(periodFrames) * 1000000 / std::max(1, sampleRate);
+        m_hasLast = false;
+        m_callbacks.store(0, std::memory_order_relaxed);
+        m_underruns.store(0, std::memory_order_relaxed);
+        m_intervalSumUs.store(0, std::memory_order_relaxed);
+        m_deviationSumUs.store(0, std::memory_order_relaxed);
+        m_maxIntervalUs.store(0, std::memory_order_relaxed);
+        m_maxRenderUs.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Forgets the last callback so a pause is not taken for an underrun, only while the callback cannot run
+     */
+    void restart() { m_hasLast = false; }
+
+    /**
+     * @brief Call first thing in the callback
+     */
+    void begin() {
+        const auto now = std::chrono::steady_clock::now();
+        if (m_hasLast) {
+            const int64_t interval = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last).count();
+            add(m_intervalSumUs, interval);
+            add(m_deviationSumUs, std::abs(interval - m_periodUs));
+            raise(m_maxIntervalUs, interval);
+            if (interval > m_periodUs * UNDERRUN_INTERVAL) add(m_underruns, 1);
+        }
+        m_last = now;
+        m_hasLast = true;
+    }
+
+    /**
+     * @brief Call last thing in the callback
+     */
+    void end() {
+        const int64_t render = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_last).count();
+        raise(m_maxRenderUs, render);
+        add(m_callbacks, 1);
+    }
+
+    int64_t getCallbacks() const { return m_callbacks.load(std::memory_order_relaxed); }
+    int64_t getUnderruns() const { return m_underruns.load(std::memory_order_relaxed); }
+    double getPeriodMs() const { return m_periodUs / 1000.0; }
+    double getMaxIntervalMs() const { return m_maxIntervalUs.load(std::memory_order_relaxed) / 1000.0; }
+    double getMaxRenderMs() const { return m_maxRenderUs.load(std::memory_order_relaxed) / 1000.0; }
+
+    double getMeanIntervalMs() const {
+        const int64_t intervals = std::max<int64_t>(1, getCallbacks() - 1);
+        return m_intervalSumUs.load(std::memory_order_relaxed) / 1000.0 / intervals;
+    }
+
+    /**
+     * @brief Mean distance of the callback interval from the nominal period
+     */
+    double getJitterMs() const {
+        const int64_t intervals = std::max<int64_t>(1, getCallbacks() - 1);
+        return m_deviationSumUs.load(std::memory_order_relaxed) / 1000.0 / intervals;
+    }
+
+    void print(std::ostream& out) const {
+        out << "Callbacks:      " << getCallbacks() << "\n"
+            << "Period:         " << getPeriodMs() << " ms\n"
+            << "Mean interval:  " << getMeanIntervalMs() << " ms\n"
+            << "Jitter:         " << getJitterMs() << " ms (max interval " << getMaxIntervalMs() << " ms)\n"
+            << "Max render:     " << getMaxRenderMs() << " ms\n"
+            << "Underruns:      " << getUnderruns() << std::endl;
+    }
+
+    private:
+    // single writer, so a load and a store are enough
+    static void add(std::atomic<int64_t>& target, int64_t value) {
+        target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    static void raise(std::atomic<int64_t>& target, int64_t value) {
+        if (value > target.load(std::memory_order_relaxed)) target.store(value, std::memory_order_relaxed);
+    }
+
+    int64_t m_periodUs = 0;
+    std::chrono::steady_clock::time_point m_last; // audio thread only
+    bool m_hasLast = false;
+
+    std::atomic<int64_t> m_callbacks{0};
+    std::atomic<int64_t> m_underruns{0};
+    std::atomic<int64_t> m_intervalSumUs{0};
+    std::atomic<int64_t> m_deviationSumUs{0};
+    std::atomic<int64_t> m_maxIntervalUs{0};
+    std::atomic<int64_t> m_maxRenderUs{0};
+};
+
+/**
+ * @brief An SDL audio device opened with small periods that backs off to larger ones when it underruns
+ * @note The render callback is a plain SDL callback, it runs on SDL's audio thread exactly as if it
+ * had been passed to SDL_OpenAudioDevice, so it must not allocate or lock either. SDL runs that
+ * thread at SDL_THREAD_PRIORITY_TIME_CRITICAL, the realtime option asks SDL to make that a real
+ * time scheduling class (needs rtkit or the right rlimits on Linux, silently ignored otherwise).
+ *
+ * update() is polled from the main loop. When more than underrunThreshold underruns happen within
+ * one window it reopens the device with twice the period, up to maxPeriodFrames. The render
+ * callback's own state survives the reopen, so playback carries on where it was.
+ */
+class LowLatencyOutput {
+    public:
+    struct Config {
+        int freq = 48000;
+        SDL_AudioFormat format = AUDIO_S16;
+        Uint8 channels = 2;
+        Uint16 periodFrames = 256;      // the first period tried, about 5 ms at 48 kHz
+        Uint16 maxPeriodFrames = 4096;  // the fallback stops here
+        int64_t underrunThreshold = 3;  // underruns within one window that trigger a fallback
+        Uint32 windowMs = 2000;
+        bool realtime = true;
+    };
+
+    LowLatencyOutput(SDL_AudioCallback render, void* userdata, const Config& config)
+        : m_render(render), m_userdata(userdata), m_config(config), m_period(config.periodFrames) {
+        SDL_memset(&m_spec, 0, sizeof(m_spec));
+    }
+    ~LowLatencyOutput() { close(); }
+
+    /**
+     * @brief Opens the device paused, at the configured period
+     * @return false if SDL could not open any device, the error is in SDL_GetError()
+     */
+    bool open() {
+        if (m_config.realtime) SDL_SetHint(SDL_HINT_THREAD_FORCE_REALTIME_TIME_CRITICAL, "1");
+        return openDevice(m_config.periodFrames, m_config.freq, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    }
+
+    void close() {
+        if (m_device) SDL_CloseAudioDevice(m_device);
+        m_device = 0;
+    }
+
+    void pause(bool paused) {
+        const bool wasPaused = m_paused;
+        m_paused = paused;
+        if (!m_device) return;
+        if (wasPaused && !paused) m_timer.restart(); // the device is still paused, its callback is not running
+        SDL_PauseAudioDevice(m_device, paused ? 1 : 0);
+    }
+
+    /**
+     * @brief Checks the underrun count, call it regularly from the main loop
+     * @return true if the device was just reopened with a larger period
+     */
+    bool update() {
+        const Uint32 now = SDL_GetTicks();
+        if (now - m_windowStart < m_config.windowMs) return false;
+
+        const int64_t underruns = m_timer.getUnderruns() - m_windowUnderruns;
+        m_windowStart = now;
+        m_windowUnderruns = m_timer.getUnderruns();
+        if (underruns <= m_config.underrunThreshold || m_period >= m_config.maxPeriodFrames) return false;
+
+        const Uint16 period = static_cast<Uint16>(std::min<int>(m_period * 2, m_config.maxPeriodFrames));
+        std::cerr << underruns << " underruns in " << m_config.windowMs << " ms at " << m_period
+                  << " frames per period, falling back to " << period << std::endl;
+        m_totalUnderruns += m_timer.getUnderruns();
+        close();
+        if (!openDevice(period, m_spec.freq, SDL_AUDIO_ALLOW_SAMPLES_CHANGE)) { // audio was prepared for the rate we have
+            std::cerr << "Failed to reopen the audio device: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        ++m_fallbacks;
+        pause(m_paused);
+        return true;
+    }
+
+    SDL_AudioDeviceID getDevice() const { return m_device; }
+    const SDL_AudioSpec& getSpec() const { return m_spec; }
+    const CallbackTimer& getTimer() const { return m_timer; }
+    size_t getFallbacks() const { return m_fallbacks; }
+    int64_t getTotalUnderruns() const { return m_totalUnderruns + m_timer.getUnderruns(); } // across every reopen
+
+    /**
+     * @brief Estimated time from a sample being rendered to it being heard
+     * @note SDL plays one period while the next is rendered, so two periods. The OS mixer and the
+     * hardware add their own buffering, which SDL does not report.
+     */
+    double getEstimatedLatencyMs() const {
+        return m_spec.freq ? 2000.0 * m_spec.samples / m_spec.freq : 0.0;
+    }
+
+    void printReport(std::ostream& out) const {
+        out << "Output:         " << m_spec.samples << " frames per period at " << m_spec.freq << " Hz, "
+            << m_fallbacks << " fallback(s), " << getTotalUnderruns() << " underrun(s) in total\n"
+            << "Est. latency:   " << getEstimatedLatencyMs() << " ms\n";
+        m_timer.print(out);
+    }
+
+    private:
+    bool openDevice(Uint16 period, int freq, int allowedChanges) {
+        SDL_AudioSpec want;
+        SDL_memset(&want, 0, sizeof(want));
+        want.freq = freq;
+        want.format = m_config.format;
+        want.channels = m_config.channels;
+        want.samples = period;
+        want.callback = callback;
+        want.userdata = this;
+
+        m_device = SDL_OpenAudioDevice(NULL, 0, &want, &m_spec, allowedChanges);
+        if (m_device == 0) return false;
+
+        m_period = std::max(period, m_spec.samples); // the device may insist on a larger period
+        m_timer.reset(m_spec.samples, m_spec.freq);
+        m_windowStart = SDL_GetTicks();
+        m_windowUnderruns = 0;
+        return true;
+    }
+
+    static void SDLCALL callback(void* userdata, Uint8* stream, int len) {
+        LowLatencyOutput& output = *static_cast<LowLatencyOutput*>(userdata);
+        output.m_timer.begin();
+        output.m_render(output.m_userdata, stream, len);
+        output.m_timer.end();
+    }
+
+    SDL_AudioCallback m_render;
+    void* m_userdata;
+    Config m_config;
+
+    SDL_AudioDeviceID m_device = 0;
+    SDL_AudioSpec m_spec;
+    Uint16 m_period;
+    bool m_paused = true;
+    CallbackTimer m_timer;
+
+    Uint32 m_windowStart = 0;
+    int64_t m_windowUnderruns = 0;
+    int64_t m_totalUnderruns = 0;
+    size_t m_fallbacks = 0;
+};
@@ -0,0 +1,287 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Attributes memory to categories and holds each of them under a budget
+ * @note Owners of big buffers ask before they grow: tryReserve() either takes the bytes out of the
+ * category's budget or refuses, and a refused owner shrinks what it keeps instead, it throttles its
+ * decoder, evicts cache entries or drops the request. That is the guarantee: a category with a
+ * limit is never above it because of memory that went through tryReserve().
+ *
+ * Some memory cannot be refused, libsimplewebm grows its frame buffers to the largest frame on its
+ * own. reserve() and track() still account for it, and count an overrun when it takes a category
+ * past its limit, so a budget that is too small shows up in the report instead of going unnoticed.
+ *
+ * Every call is lock-free, the audio thread releases what it consumes without waiting on anyone.
+ */
+class MemoryBudget {
+    public:
+    enum Category {
+        DEMUX,        // compressed frames read by the demuxer
+        VIDEO_FRAMES, // decoded pictures kept after the decoder handed them out
+        PCM,          // decoded audio waiting for the mixer
+        SOUND_CACHE,  // decoded sound effects resident in memory
+        CATEGORY_COUNT
+    };
+
+    static const size_t UNLIMITED = 0;
+
+    static const char* getCategoryName(Category category) {
+        static const char* names[CATEGORY_COUNT] = {"demux", "frames", "pcm", "sound"};
+        return names[category];
+    }
+
+    MemoryBudget() = default;
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    /**
+     * @brief Sets a category's budget, UNLIMITED (0) lifts it
+     * @note Lowering a budget below the current usage refuses new reservations until owners release enough.
+     */
+    void setLimit(Category category, size_t bytes) { m_accounts[category].limit.store(bytes, std::memory_order_relaxed); }
+
+    /**
+     * @brief Sets budgets from a list like "pcm=2M,sound=32M,frames=64M,demux=1M"
+     * @note Sizes are bytes, with an optional K, M or G suffix (powers of 1024). Categories that are
+     * not listed keep their budget. nullptr or an empty string changes nothing.
+     * @return false if an entry could not be parsed, the entries before it are applied
+     */
+    bool configure(const char* spec) {
+        if (!spec) return true;
+        std::string list(spec);
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) end = list.size();
+            const std::string entry = list.substr(start, end - start);
+            start = end + 1;
+            if (entry.empty()) continue;
+
+            const size_t equals = entry.find('=');
+            int category = CATEGORY_COUNT;
+            for (int c = 0; c < CATEGORY_COUNT && equals != std::string::npos; ++c) {
+                if (entry.compare(0, equals, getCategoryName(static_cast<Category>(c))) == 0) category = c;
+            }
+            size_t bytes = 0;
+            if (category == CATEGORY_COUNT || !parseSize(entry.c_str() + equals + 1, bytes)) {
+                std::cerr << "Invalid memory budget \"" << entry << "\", expected <demux|frames|pcm|sound>=<bytes>[K|M|G]" << std::endl;
+                return false;
+            }
+            setLimit(static_cast<Category>(category), bytes);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sets budgets from the OPENAVMEDIA_MEMORY_BUDGET environment variable, see configure()
+     */
+    bool configureFromEnvironment() { return configure(std::getenv("OPENAVMEDIA_MEMORY_BUDGET")); }
+
+    /**
+     * @brief Takes bytes out of a category's budget, unless that would put it over its limit
+     * @return false if the budget has no room, nothing is accounted then
+     */
+    bool tryReserve(Category category, size_t bytes) {
+        Account& account = m_accounts[category];
+        const size_t limit = account.limit.load(std::memory_order_relaxed);
+        size_t usage = account.usage.load(std::memory_order_relaxed);
+        do {
+            if (limit != UNLIMITED && (usage > limit || bytes > limit - usage)) {
+                account.refusals.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!account.usage.compare_exchange_weak(usage, usage + bytes, std::memory_order_relaxed));
+        grew(account, usage + bytes, bytes);
+        return true;
+    }
+
+    /**
+     * @brief Accounts for bytes that are allocated whatever the budget says
+     */
+    void reserve(Category category, size_t bytes) {
+        Account& account = m_accounts[category];
+        const size_t usage = account.usage.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        const size_t limit = account.limit.load(std::memory_order_relaxed);
+        if (limit != UNLIMITED && usage > limit) account.overruns.fetch_add(1, std::memory_order_relaxed);
+        grew(account, usage, bytes);
+    }
+
+    void release(Category category, size_t bytes) {
+        m_accounts[category].usage.fetch_sub(bytes, std::memory_order_relaxed);
+        m_total.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Moves a buffer's accounted size to its new size, like reserve() when it grew
+     * @param accounted What was accounted for the buffer so far, updated to bytes
+     */
+    void track(Category category, size_t& accounted, size_t bytes) {
+        if (bytes > accounted) reserve(category, bytes - accounted);
+        else if (bytes < accounted) release(category, accounted - bytes);
+        accounted = bytes;
+    }
+
+    size_t getLimit(Category category) const { return m_accounts[category].limit.load(std::memory_order_relaxed); }
+    size_t getUsage(Category category) const { return m_accounts[category].usage.load(std::memory_order_relaxed); }
+    size_t getPeak(Category category) const { return m_accounts[category].peak.load(std::memory_order_relaxed); }
+    size_t getRefusals(Category category) const { return m_accounts[category].refusals.load(std::memory_order_relaxed); }
+    size_t getOverruns(Category category) const { return m_accounts[category].overruns.load(std::memory_order_relaxed); }
+    size_t getTotalUsage() const { return m_total.load(std::memory_order_relaxed); }
+    size_t getTotalPeak() const { return m_totalPeak.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Bytes a category can still take, the largest size_t when it has no limit
+     */
+    size_t getHeadroom(Category category) const {
+        const size_t limit = getLimit(category);
+        if (limit == UNLIMITED) return std::numeric_limits<size_t>::max();
+        const size_t usage = getUsage(category);
+        return (usage < limit) ? limit - usage : 0;
+    }
+
+    /**
+     * @brief Prints every category's current and peak usage against its budget
+     */
+    void print(std::ostream& out) const {
+        out << "Memory (current / peak KiB):" << std::endl;
+        for (int c = 0; c < CATEGORY_COUNT; ++c) {
+            const Category category = static_cast<Category>(c);
+            out << "  " << getCategoryName(category) << ": " << toKiB(getUsage(category)) << " / " << toKiB(getPeak(category));
+            if (getLimit(category) == UNLIMITED) out << ", no budget";
+            else out << ", budget " << toKiB(getLimit(category));
+            if (getRefusals(category)) out << ", " << getRefusals(category) << " refused";
+            if (getOverruns(category)) out << ", " << getOverruns(category) << " over budget";
+            out << std::endl;
+        }
+        out << "  total: " << toKiB(getTotalUsage()) << " / " << toKiB(getTotalPeak()) << std::endl;
+    }
+
+    private:
+    struct Account {
+        std::atomic<size_t> usage{0};
+        std::atomic<size_t> peak{0};
+        std::atomic<size_t> limit{UNLIMITED};
+        std::atomic<size_t> refusals{0};
+        std::atomic<size_t> overruns{0};
+    };
+
+    static void raise(std::atomic<size_t>& peak, size_t value) {
+        size_t current = peak.load(std::memory_order_relaxed);
+        while (current < value && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+    }
+
+    void grew(Account& account, size_t usage, size_t bytes) {
+        raise(account.peak, usage);
+        raise(m_totalPeak, m_total.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    }
+
+    static bool parseSize(const char* text, size_t& bytes) {
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(text, &end, 10);
+        if (end == text) return false;
+        unsigned long long scale = 1;
+        if (*end == 'K' || *end == 'k') scale = 1ull << 10;
+        else if (*end == 'M' || *end == 'm') scale = 1ull << 20;
+        else if (*end == 'G' || *end == 'g') scale = 1ull << 30;
+        if (scale != 1) ++end;
+        if (*end != '\0') return false;
+        bytes = static_cast<size_t>(value * scale);
+        return true;
+    }
+
+    static double toKiB(size_t bytes) { return static_cast<double>(bytes) / 1024.0; }
+
+    Account m_accounts[CATEGORY_COUNT];
+    std::atomic<size_t> m_total{0};
+    std::atomic<size_t> m_totalPeak{0};
+};
+
+/**
+ * @brief Fixed-size queue of interleaved samples between a decoder thread and the audio callback
+ * @note Its whole capacity is taken from the PCM budget once, so the queue can never grow past it.
+ * A decoder that finds it full waits for the callback to drain it, which is what throttles decoding
+ * to the playback speed. One thread writes and one thread reads, neither ever blocks.
+ */
+class PcmRing {
+    public:
+    PcmRing() = default;
+    ~PcmRing() {
+        if (m_budget) m_budget->release(MemoryBudget::PCM, m_samples.size() * sizeof(short));
+    }
+    PcmRing(const PcmRing&) = delete;
+    PcmRing& operator=(const PcmRing&) = delete;
+
+    /**
+     * @brief Allocates the queue out of the PCM budget, call it once before anything reads or writes
+     * @return false if the budget cannot hold that many samples
+     */
+    bool allocate(size_t samples, MemoryBudget& budget) {
+        if (!budget.tryReserve(MemoryBudget::PCM, samples * sizeof(short))) return false;
+        m_budget = &budget;
+        m_samples.assign(samples, 0);
+        return true;
+    }
+
+    /**
+     * @brief Allocates the queue outside any budget, for audio that is a copy of memory accounted elsewhere
+     */
+    void allocate(size_t samples) {
+        m_samples.assign(samples, 0);
+    }
+
+    /**
+     * @brief Writer side, copies as many samples as there is room for
+     * @return Samples written
+     */
+    size_t write(const short* samples, size_t count) {
+        const size_t writePos = m_writePos.load(std::memory_order_relaxed);
+        count = std::min(count, m_samples.size() - (writePos - m_readPos.load(std::memory_order_acquire)));
+        for (size_t i = 0; i < count; ++i) m_samples[(writePos + i) % m_samples.size()] = samples[i];
+        m_writePos.store(writePos + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @brief Reader side, copies out as many samples as are queued
+     * @return Samples read
+     */
+    size_t read(short* samples, size_t count) {
+        const size_t readPos = m_readPos.load(std::memory_order_relaxed);
+        count = std::min(count, m_writePos.load(std::memory_order_acquire) - readPos);
+        for (size_t i = 0; i < count; ++i) samples[i] = m_samples[(readPos + i) % m_samples.size()];
+        m_readPos.store(readPos + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @brief Reader side, drops up to count queued samples without copying them
+     * @return Samples dropped
+     */
+    size_t skip(size_t count) {
+        const size_t readPos = m_readPos.load(std::memory_order_relaxed);
+        count = std::min(count, m_writePos.load(std::memory_order_acquire) - readPos);
+        m_readPos.store(readPos + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t getCapacity() const { return m_samples.size(); }
+    size_t getQueued() const {
+        const size_t readPos = m_readPos.load(std::memory_order_acquire); // first, it never passes a later writePos
+        return m_writePos.load(std::memory_order_acquire) - readPos;
+    }
+    size_t getFree() const { return m_samples.size() - getQueued(); }
+
+    private:
+    std::vector<short> m_samples;
+    std::atomic<size_t> m_readPos{0};  // samples read so far, only the reader stores it
+    std::atomic<size_t> m_writePos{0}; // samples written so far, only the writer stores it
+    MemoryBudget* m_budget = nullptr;
+};
@@ -0,0 +1,298 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+/**
+ * @brief Bounded multi-producer single-consumer queue that never locks
+ * @note Each cell carries a sequence number telling producers and the consumer whose turn it is
+ * (Dmitry Vyukov's bounded queue). Producers claim a cell with a single compare-and-swap, the
+ * consumer never writes the shared position and so never contends with them.
+ */
+template <typename T, size_t Capacity>
+class BoundedMPSCQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+    BoundedMPSCQueue(): m_cells(Capacity) {
+        for (size_t i = 0; i < Capacity; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Adds an item, safe to call from any number of threads at once
+     * @return false if the queue is full, the item is not added
+     */
+    bool push(const T& item) {
+        size_t position = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = m_cells[position & (Capacity - 1)];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0) { // the cell is free, try to claim it
+                if (m_enqueuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.item = item;
+                    cell.sequence.store(position + 1, std::memory_order_release); // hand it to the consumer
+                    return true;
+                }
+            } else if (difference < 0) { // the consumer has not emptied this cell yet, so we are full
+                return false;
+            } else { // another producer got here first, reload and try again
+                position = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Removes the oldest item, must only ever be called from one thread
+     * @return false if the queue is empty
+     */
+    bool pop(T& item) {
+        Cell& cell = m_cells[m_dequeuePos & (Capacity - 1)];
+        const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (sequence != m_dequeuePos + 1) return false; // nothing published yet
+
+        item = cell.item;
+        cell.sequence.store(m_dequeuePos + Capacity, std::memory_order_release); // free the cell for the next lap
+        ++m_dequeuePos;
+        return true;
+    }
+
+    private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::vector<Cell> m_cells;
+    alignas(64) std::atomic<size_t> m_enqueuePos{0}; // shared by the producers
+    alignas(64) size_t m_dequeuePos = 0;             // owned by the consumer
+};
+
+/**
+ * @brief One request for SDL_mixer, posted by a game thread and carried out on the audio thread
+ */
+struct MixerCommand {
+    enum Type { PLAY, FADE_IN, HALT, FADE_OUT, VOLUME, PANNING, EFFECT };
+
+    Type type;
+    Mix_Chunk* chunk; // PLAY and FADE_IN only
+    int channel;      // -1 lets PLAY and FADE_IN pick the first free channel
+    int loops;
+    int fadeMs;
+    int volume;       // voice volume for PLAY/FADE_IN, channel volume for VOLUME
+    Uint8 left, right;
+    Uint64 dueFrame;  // the mixer frame at which to run the command
+    Mix_EffectFunc_t effect = nullptr;  // EFFECT only, nullptr removes the channel's effect
+    Mix_EffectDone_t effectDone = nullptr;
+    void* effectData = nullptr;
+};
+
+/**
+ * @brief Thread safe front-end for SDL_mixer
+ * @note SDL_mixer's channel functions are not safe to call from several threads at once. Here any
+ * thread posts commands into a lock-free queue, and the queue is drained in one batch per audio
+ * block from SDL_mixer's post-mix hook, which already runs on the audio thread with the audio lock
+ * held. Posting a command never touches SDL's lock, so gameplay code can fire thousands of them.
+ *
+ * Voice volumes are applied with Mix_Volume on the voice's channel rather than Mix_VolumeChunk, so
+ * two plays of the same chunk at different volumes no longer fight over the shared Mix_Chunk. The
+ * channel volume set through setChannelVolume() scales whatever voice is on that channel, just as
+ * chunk volume and channel volume combined before.
+ *
+ * Delays are counted in mixed sample frames, so they are exact to the audio block.
+ */
+class MixerFrontEnd {
+    public:
+    static const size_t QUEUE_CAPACITY = 4096;
+
+    explicit MixerFrontEnd(int channels)
+        : m_channelVolume(channels, MIX_MAX_VOLUME), m_voiceVolume(channels, MIX_MAX_VOLUME), m_channelEffect(channels) {
+        m_pending.reserve(QUEUE_CAPACITY); // the audio thread must never allocate
+    }
+    ~MixerFrontEnd() {
+        stop();
+    }
+
+    /**
+     * @brief Starts draining commands, call after the mixer has been opened
+     * @return false if the mixer is not open
+     */
+    bool start() {
+        int frequency, channels;
+        Uint16 format;
+        if (Mix_QuerySpec(&frequency, &format, &channels) == 0) return false;
+
+        m_frequency = frequency;
+        m_bytesPerFrame = (SDL_AUDIO_BITSIZE(format) / 8) * channels;
+        Mix_SetPostMix(&MixerFrontEnd::postMix, this);
+        return true;
+    }
+
+    /**
+     * @brief Stops draining commands, anything still queued is discarded
+     */
+    void stop() {
+        if (m_bytesPerFrame != 0) {
+            Mix_SetPostMix(nullptr, nullptr);
+            m_bytesPerFrame = 0;
+        }
+    }
+
+    // These are safe to call from any thread, they return false if the command could not be queued.
+    bool play(Mix_Chunk* chunk, int channel = -1, int loops = 0, int delayMs = 0, int volume = MIX_MAX_VOLUME) {
+        return post({MixerCommand::PLAY, chunk, channel, loops, 0, volume, 0, 0, dueFrame(delayMs)});
+    }
+    bool fadeIn(Mix_Chunk* chunk, int channel = -1, int loops = 0, int delayMs = 0, int fadeMs = 1000, int volume = MIX_MAX_VOLUME) {
+        return post({MixerCommand::FADE_IN, chunk, channel, loops, fadeMs, volume, 0, 0, dueFrame(delayMs)});
+    }
+    bool halt(int channel, int delayMs = 0) {
+        return post({MixerCommand::HALT, nullptr, channel, 0, 0, 0, 0, 0, dueFrame(delayMs)});
+    }
+    bool fadeOut(int channel, int fadeMs, int delayMs = 0) {
+        return post({MixerCommand::FADE_OUT, nullptr, channel, 0, fadeMs, 0, 0, 0, dueFrame(delayMs)});
+    }
+    bool setChannelVolume(int channel, int volume, int delayMs = 0) {
+        return post({MixerCommand::VOLUME, nullptr, channel, 0, 0, volume, 0, 0, dueFrame(delayMs)});
+    }
+    bool setPanning(int channel, Uint8 left, Uint8 right, int delayMs = 0) {
+        return post({MixerCommand::PANNING, nullptr, channel, 0, 0, 0, left, right, dueFrame(delayMs)});
+    }
+
+    /**
+     * @brief Sets an effect that is registered on the channel for every voice started on it
+     * @note SDL_mixer drops a channel's effects when its voice ends, so they must be registered
+     * again each time. Pass nullptr as the effect to remove it.
+     */
+    bool setChannelEffect(int channel, Mix_EffectFunc_t effect, Mix_EffectDone_t done, void* udata) {
+        return post({MixerCommand::EFFECT, nullptr, channel, 0, 0, 0, 0, 0, dueFrame(0), effect, done, udata});
+    }
+
+    size_t getDroppedCount() const { return m_dropped.load(std::memory_order_relaxed); } // queue or pending list was full
+    size_t getFailedCount() const { return m_failed.load(std::memory_order_relaxed); }   // SDL_mixer rejected the command
+
+    private:
+    bool post(const MixerCommand& command) {
+        if (m_commands.push(command)) return true;
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Uint64 dueFrame(int delayMs) const {
+        const Uint64 now = m_mixedFrames.load(std::memory_order_relaxed);
+        return (delayMs > 0) ? now + static_cast<Uint64>(delayMs) * m_frequency / 1000 : now;
+    }
+
+    static void SDLCALL postMix(void* udata, [[maybe_unused]] Uint8* stream, int len) {
+        MixerFrontEnd* self = static_cast<MixerFrontEnd*>(udata);
+        if (self->m_bytesPerFrame == 0) return;
+
+        // the block just mixed moves the clock forward, then everything due by now runs before the next block
+        const Uint64 now = self->m_mixedFrames.load(std::memory_order_relaxed) + len / self->m_bytesPerFrame;
+        self->m_mixedFrames.store(now, std::memory_order_relaxed);
+        self->drain(now);
+    }
+
+    void drain(Uint64 now) {
+        // run delayed commands that are now due, keeping the rest in their posted order
+        size_t kept = 0;
+        for (size_t i = 0; i < m_pending.size(); ++i) {
+            if (m_pending[i].dueFrame <= now) {
+                execute(m_pending[i]);
+            } else {
+                m_pending[kept++] = m_pending[i];
+            }
+        }
+        m_pending.resize(kept);
+
+        // then take this block's new commands in one batch
+        MixerCommand command;
+        while (m_commands.pop(command)) {
+            if (command.dueFrame <= now) {
+                execute(command);
+            } else if (m_pending.size() < m_pending.capacity()) {
+                m_pending.push_back(command);
+            } else {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void execute(const MixerCommand& command) {
+        int channel = command.channel;
+        switch (command.type) {
+            case MixerCommand::PLAY:
+                channel = Mix_PlayChannel(channel, command.chunk, command.loops);
+                break;
+            case MixerCommand::FADE_IN:
+                channel = Mix_FadeInChannel(channel, command.chunk, command.loops, command.fadeMs);
+                break;
+            case MixerCommand::HALT:
+                Mix_HaltChannel(channel);
+                return;
+            case MixerCommand::FADE_OUT:
+                Mix_FadeOutChannel(channel, command.fadeMs);
+                return;
+            case MixerCommand::VOLUME:
+                if (isValidChannel(channel)) {
+                    m_channelVolume[channel] = command.volume;
+                    Mix_Volume(channel, m_voiceVolume[channel] * command.volume / MIX_MAX_VOLUME);
+                } else {
+                    m_failed.fetch_add(1, std::memory_order_relaxed);
+                }
+                return;
+            case MixerCommand::PANNING:
+                if (Mix_SetPanning(channel, command.left, command.right) == 0) {
+                    m_failed.fetch_add(1, std::memory_order_relaxed);
+                }
+                return;
+            case MixerCommand::EFFECT:
+                if (isValidChannel(channel)) {
+                    if (m_channelEffect[channel].effect) Mix_UnregisterEffect(channel, m_channelEffect[channel].effect);
+                    m_channelEffect[channel] = command;
+                    if (command.effect && Mix_Playing(channel)) registerEffect(channel); // the voice already playing gets it too
+                } else {
+                    m_failed.fetch_add(1, std::memory_order_relaxed);
+                }
+                return;
+        }
+
+        // a new voice started, give it its own volume scaled by its channel's volume, and the channel's effect
+        if (isValidChannel(channel)) {
+            m_voiceVolume[channel] = command.volume;
+            Mix_Volume(channel, command.volume * m_channelVolume[channel] / MIX_MAX_VOLUME);
+            if (m_channelEffect[channel].effect) registerEffect(channel);
+            return;
+        }
+
+        m_failed.fetch_add(1, std::memory_order_relaxed); // no std::cerr here, we are on the audio thread
+    }
+
+    void registerEffect(int channel) {
+        const MixerCommand& effect = m_channelEffect[channel];
+        if (Mix_RegisterEffect(channel, effect.effect, effect.effectDone, effect.effectData) == 0) {
+            m_failed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool isValidChannel(int channel) const {
+        return channel >= 0 && static_cast<size_t>(channel) < m_channelVolume.size();
+    }
+
+    BoundedMPSCQueue<MixerCommand, QUEUE_CAPACITY> m_commands;
+    std::vector<MixerCommand> m_pending;    // delayed commands, only touched by the audio thread
+    std::vector<int> m_channelVolume;       // volume set per channel through setChannelVolume()
+    std::vector<int> m_voiceVolume;         // volume of the voice currently on each channel
+    std::vector<MixerCommand> m_channelEffect; // the EFFECT command last set on each channel
+    std::atomic<Uint64> m_mixedFrames{0};   // frames mixed so far, the clock delays are measured against
+    std::atomic<size_t> m_dropped{0};
+    std::atomic<size_t> m_failed{0};
+    int m_frequency = 44100;
+    int m_bytesPerFrame = 0;
+};
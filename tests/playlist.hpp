@@ -0,0 +1,528 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "simplewebm/OpusVorbisDecoder.hpp"
+#include "simplewebm/VPXDecoder.hpp"
+
+#include "../tests/decoder_pool.hpp"
+#include "../tests/resampler.hpp"
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Plays a list of WebM clips back to back with no black frame and no audio gap between them
+ * @note Opening a clip means a new reader, demuxer, both decoders and a keyframe decode, which takes
+ * longer than a frame. The scheduler does all of that for the next clip on a background thread while
+ * the current one plays, pre-rolling it up to its second video frame: the first picture is decoded
+ * and copied, the audio before it is decoded and resampled. The switch then only hands over what is
+ * already there, so the first picture of the new clip replaces the frame the old one would have shown.
+ *
+ * A clip ends either at its end of file, where its audio is simply continued by the next clip's, or
+ * at a branch point, where the audio is cut on the sample that matches the cut video frame and can
+ * be crossfaded into the next clip.
+ *
+ * Call everything from the playback thread, only the pre-roll runs elsewhere.
+ *
+ * @tparam Reader An mkvparser::IMkvReader that can be constructed from a file path
+ */
+template <typename Reader>
+class ClipScheduler {
+    public:
+    static const int DEFAULT_CROSSFADE_MS = 30;
+
+    /**
+     * @brief One step of playback, like one WebMDemuxer::readFrame() plus decoding
+     */
+    struct Frame {
+        bool hasPicture = false;
+        VPXDecoder::Image image; // valid until the next readFrame()
+        double time = 0.0;       // seconds on the playlist's timeline, not the clip's
+        bool switched = false;   // true on the first frame of a new clip
+    };
+
+    /**
+     * @param mixerRate Every clip's audio is resampled to this rate
+     * @param channels Every clip's audio is mapped to this many channels
+     * @param videoThreads Threads each VPXDecoder may use
+     * @param pool Where decoders come from and video decoders go back to, nullptr creates them per clip
+     */
+    ClipScheduler(int mixerRate, int channels, unsigned videoThreads = 8, DecoderPool* pool = nullptr):
+        m_mixerRate(mixerRate), m_channels(channels), m_videoThreads(videoThreads), m_pool(pool) { }
+    ~ClipScheduler() {
+        if (m_preparing.valid()) m_preparing.wait();
+        for (Preload& preload : m_preloads) {
+            if (preload.clip.valid()) preload.clip.wait();
+        }
+        for (auto& clip : m_discarded) clip.wait();
+    }
+
+    /**
+     * @brief Opens and pre-rolls the first clip on the calling thread
+     * @return false if the clip could not be opened
+     */
+    bool open(const std::string& path) {
+        m_current = prepare(path, m_mixerRate, m_channels, m_videoThreads, m_pool);
+        if (!m_current) return false;
+        m_startPending = true; // the first readFrame() hands out the pre-rolled picture and audio
+        pump();
+        return true;
+    }
+
+    /**
+     * @brief Plays a clip after everything already queued
+     */
+    void append(const std::string& path) {
+        m_queue.push_back(path);
+        pump();
+    }
+
+    /**
+     * @brief Leaves the current clip for another one, dropping everything queued
+     * @param path The clip to branch to
+     * @param atSeconds Time in the current clip to cut at, the first video frame at or after it is the
+     * first one not shown. Negative cuts at the next frame.
+     * @param crossfadeMs Length of the audio crossfade, 0 cuts hard
+     */
+    void branch(const std::string& path, double atSeconds = -1.0, int crossfadeMs = DEFAULT_CROSSFADE_MS) {
+        m_queue.clear();
+        if (m_next && m_next->path != path) m_next.reset();    // pre-rolled for a path no longer wanted
+        for (Preload& preload : m_preloads) {
+            if (!m_next && preload.path == path) {
+                if (preload.clip.wait_for(std::chrono::seconds(0)) != std::future_status::ready) ++m_lateSwitches;
+                m_next = preload.clip.get();
+            } else if (preload.clip.valid()) {
+                m_discarded.push_back(std::move(preload.clip)); // let it finish on its own, dropping it here would wait for it
+            }
+        }
+        m_preloads.clear();
+        if (!m_next) m_queue.push_back(path);
+        if (m_preparing.valid()) m_preparingStale = m_preparingPath != path;
+
+        m_branchAt = (atSeconds < 0.0) ? m_lastVideoTime + 1e-6 : atSeconds;
+        m_crossfadeFrames = static_cast<size_t>(crossfadeMs) * m_mixerRate / 1000;
+        pump();
+    }
+
+    /**
+     * @brief Pre-rolls a clip that a later branch() may choose, so branching to it costs no wait either
+     * @note Every choice of an upcoming decision can be preloaded, branch() drops the ones not taken.
+     * The clip queued next is pre-rolled already, and branch() takes that pre-roll over, so preloading
+     * it does nothing.
+     */
+    void preload(const std::string& path) {
+        if (m_next && m_next->path == path) return;
+        if (m_preparing.valid() && !m_preparingStale && m_preparingPath == path) return;
+        for (const Preload& preload : m_preloads) {
+            if (preload.path == path) return;
+        }
+        m_preloads.push_back({path, launch(path)});
+    }
+
+    /**
+     * @brief Loops the last clip of the playlist, seamlessly, until turned off
+     */
+    void setLoop(bool loop) {
+        m_loop = loop;
+        pump();
+    }
+
+    /**
+     * @brief Reads and decodes the next frame, switching clips when the current one is over
+     * @param frame Receives the decoded picture, if this step produced one
+     * @param audio Decoded audio at the mixer rate and channel count is appended to this vector
+     * @return false at the end of the playlist or on a decoding error
+     */
+    bool readFrame(Frame& frame, std::vector<short>& audio) {
+        frame.hasPicture = false;
+        frame.switched = false;
+        pump();
+        if (!m_current) return false;
+
+        if (m_startPending) {
+            m_startPending = false;
+            start(frame, audio);
+            return true;
+        }
+
+        Clip& clip = *m_current;
+        bool hasVideo = false, hasAudio = false;
+        if (clip.hasPendingVideo) { // read during the pre-roll, not yet decoded
+            clip.hasPendingVideo = false;
+            hasVideo = true;
+        } else if (!clip.ended && clip.demuxer->readFrame(&clip.videoFrame, &clip.audioFrame)) {
+            hasVideo = clip.videoFrame.isValid();
+            hasAudio = clip.audioFrame.isValid();
+        } else {
+            return switchClips(frame, audio, flushTail(clip), clip.demuxer->getLength());
+        }
+
+        if (hasAudio) {
+            std::vector<short>& decoded = m_decoded;
+            decoded.clear();
+            if (!decodeAudio(clip, decoded)) return false;
+            emitAudio(clip, decoded.data(), decoded.size() / m_channels, audio);
+        }
+
+        if (hasVideo && clip.videoDec) {
+            if (m_branchAt >= 0.0 && clip.videoFrame.time >= m_branchAt) {
+                return switchClips(frame, audio, cutAt(clip, clip.videoFrame.time, audio), clip.videoFrame.time);
+            }
+
+            if (!clip.videoDec->decode(clip.videoFrame)) {
+                std::cerr << "Failed to decode video frame of " << clip.path << std::endl;
+                return false;
+            }
+            while (clip.videoDec->getImage(frame.image) == VPXDecoder::NO_ERROR) frame.hasPicture = true;
+            frame.time = m_offset + clip.videoFrame.time;
+            m_lastVideoTime = clip.videoFrame.time;
+        }
+
+        return true;
+    }
+
+    int getWidth() const { return m_current ? m_current->demuxer->getWidth() : 0; }
+    int getHeight() const { return m_current ? m_current->demuxer->getHeight() : 0; }
+    const std::string& getCurrentPath() const { return m_current->path; }
+    size_t getSwitchCount() const { return m_switches; }
+    size_t getLateSwitchCount() const { return m_lateSwitches; } // switches that had to wait for their pre-roll
+
+    private:
+    struct Clip;
+    struct Preload {
+        std::string path;
+        std::future<std::unique_ptr<Clip>> clip;
+    };
+
+    struct Clip {
+        ~Clip() {
+            if (!pool || !videoDec) return;
+            VPXDecoder::Image image;
+            while (videoDec->getImage(image) == VPXDecoder::NO_ERROR) { } // the next clip must not see this one's pictures
+            pool->releaseVideo(*demuxer, threads, std::move(videoDec));
+        }
+
+        std::string path;
+        DecoderPool* pool = nullptr;
+        unsigned threads = 0;
+        std::unique_ptr<WebMDemuxer> demuxer;
+        std::unique_ptr<VPXDecoder> videoDec;
+        std::unique_ptr<OpusVorbisDecoder> audioDec;
+        std::unique_ptr<PolyphaseResampler> resampler;
+        std::vector<short> pcm;       // decoder output at the clip's rate and channel count
+        std::vector<short> resampled; // the same at the mixer's rate
+        WebMFrame videoFrame, audioFrame;
+
+        VPXDecoder::Image firstImage;          // planes point into firstPlanes
+        std::vector<unsigned char> firstPlanes[3];
+        double firstTime = 0.0;
+        bool hasFirstImage = false;
+        std::vector<short> primedAudio;        // mixer rate and channel count
+        bool hasPendingVideo = false;          // videoFrame holds a frame that was read but not decoded
+        bool ended = false;
+
+        size_t emittedFrames = 0;              // audio frames handed out, at the mixer rate
+    };
+
+    /**
+     * @brief Opens a clip and pre-rolls it, runs on the background thread for all but the first clip
+     */
+    static std::unique_ptr<Clip> prepare(const std::string& path, int mixerRate, int channels, unsigned videoThreads, DecoderPool* pool) {
+        TRACE_SCOPE(DEMUX, "prerollClip", 0);
+
+        auto clip = std::make_unique<Clip>();
+        clip->path = path;
+        clip->pool = pool;
+        clip->threads = videoThreads;
+        clip->demuxer = std::make_unique<WebMDemuxer>(new Reader(path.c_str()));
+        if (!clip->demuxer->isOpen()) {
+            std::cerr << "Failed to open clip " << path << std::endl;
+            return nullptr;
+        }
+
+        if (clip->demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO) {
+            clip->videoDec = pool ? pool->acquireVideo(*clip->demuxer, videoThreads) : std::make_unique<VPXDecoder>(*clip->demuxer, videoThreads);
+            if (!clip->videoDec->isOpen()) clip->videoDec.reset();
+        }
+        if (clip->demuxer->getAudioCodec() != WebMDemuxer::NO_AUDIO) {
+            clip->audioDec = pool ? pool->acquireAudio(*clip->demuxer) : std::make_unique<OpusVorbisDecoder>(*clip->demuxer);
+            if (clip->audioDec->isOpen()) {
+                clip->pcm.resize(clip->audioDec->getBufferSamples() * clip->demuxer->getChannels());
+                clip->resampler = std::make_unique<PolyphaseResampler>(static_cast<int>(clip->demuxer->getSampleRate()), mixerRate,
+                                                                       clip->demuxer->getChannels(), PolyphaseResampler::BEST);
+            } else {
+                clip->audioDec.reset();
+            }
+        }
+
+        // decode up to the first picture, keep the frame after it for playback to decode
+        while (!clip->hasPendingVideo) {
+            if (!clip->demuxer->readFrame(&clip->videoFrame, &clip->audioFrame)) {
+                clip->ended = true;
+                break;
+            }
+            if (clip->audioFrame.isValid() && !decodeAudio(*clip, clip->primedAudio, channels)) return nullptr;
+            if (clip->videoFrame.isValid() && clip->videoDec) {
+                if (clip->hasFirstImage) {
+                    clip->hasPendingVideo = true;
+                } else if (!clip->videoDec->decode(clip->videoFrame)) {
+                    std::cerr << "Failed to decode the first frame of " << path << std::endl;
+                    return nullptr;
+                } else {
+                    VPXDecoder::Image image;
+                    while (clip->videoDec->getImage(image) == VPXDecoder::NO_ERROR) copyImage(image, *clip);
+                    clip->firstTime = clip->videoFrame.time;
+                }
+            }
+            if (!clip->videoDec && !clip->primedAudio.empty()) break; // audio only, one packet primes it
+        }
+
+        return clip;
+    }
+
+    static void copyImage(const VPXDecoder::Image& image, Clip& clip) {
+        clip.firstImage = image;
+        for (int p = 0; p < 3; ++p) {
+            clip.firstPlanes[p].assign(image.planes[p], image.planes[p] + static_cast<size_t>(image.linesize[p]) * image.getHeight(p));
+            clip.firstImage.planes[p] = clip.firstPlanes[p].data();
+        }
+        clip.hasFirstImage = true;
+    }
+
+    bool decodeAudio(Clip& clip, std::vector<short>& out) {
+        return decodeAudio(clip, out, m_channels);
+    }
+
+    /**
+     * @brief Decodes the clip's current audio frame and appends it at the mixer's rate and channel count
+     */
+    static bool decodeAudio(Clip& clip, std::vector<short>& out, int channels) {
+        if (!clip.audioDec) return true; // a codec we cannot decode plays as silence
+
+        int numOutSamples;
+        if (!clip.audioDec->getPCMS16(clip.audioFrame, clip.pcm.data(), numOutSamples)) {
+            std::cerr << "Failed to decode audio frame of " << clip.path << std::endl;
+            return false;
+        }
+        clip.resampled.clear();
+        clip.resampler->processS16(clip.pcm.data(), numOutSamples, clip.resampled);
+        appendMapped(clip.resampled.data(), clip.resampled.size() / clip.demuxer->getChannels(), clip.demuxer->getChannels(), channels, out);
+        return true;
+    }
+
+    /**
+     * @brief Appends interleaved audio, mono is copied to every channel and extra channels are dropped
+     */
+    static void appendMapped(const short* in, size_t frames, int inChannels, int outChannels, std::vector<short>& out) {
+        if (inChannels == outChannels) {
+            out.insert(out.end(), in, in + frames * inChannels);
+            return;
+        }
+        for (size_t i = 0; i < frames; ++i) {
+            for (int c = 0; c < outChannels; ++c) {
+                out.push_back((c < inChannels) ? in[i * inChannels + c] : (inChannels == 1) ? in[i] : 0);
+            }
+        }
+    }
+
+    /**
+     * @brief Starts the next pre-roll when nothing is being pre-rolled and collects a finished one
+     */
+    void pump() {
+        m_discarded.erase(std::remove_if(m_discarded.begin(), m_discarded.end(), [](const std::future<std::unique_ptr<Clip>>& clip) {
+            return clip.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), m_discarded.end());
+        if (m_preparing.valid() && m_preparing.wait_for(std::chrono::seconds(0)) == std::future_status::ready) collect();
+
+        if (m_loop && m_queue.empty() && !m_next && !m_preparing.valid() && m_current) m_queue.push_back(m_current->path);
+        if (m_preparing.valid() || m_next || m_queue.empty()) return;
+
+        m_preparingPath = m_queue.front();
+        m_preparingStale = false;
+        m_preparing = launch(m_preparingPath);
+    }
+
+    std::future<std::unique_ptr<Clip>> launch(const std::string& path) {
+        return std::async(std::launch::async, [path, rate = m_mixerRate, channels = m_channels, threads = m_videoThreads, pool = m_pool]() {
+            TRACE_THREAD_NAME("preroll");
+            return prepare(path, rate, channels, threads, pool);
+        });
+    }
+
+    void collect() {
+        std::unique_ptr<Clip> clip = m_preparing.get();
+        if (!m_preparingStale && !m_queue.empty() && m_queue.front() == m_preparingPath) {
+            m_next = std::move(clip);
+            m_queue.pop_front();
+            if (!m_next) std::cerr << "Skipping clip " << m_preparingPath << std::endl;
+        }
+    }
+
+    /**
+     * @brief Hands out the current clip's pre-rolled picture and audio
+     */
+    void start(Frame& frame, std::vector<short>& audio) {
+        Clip& clip = *m_current;
+        emitAudio(clip, clip.primedAudio.data(), clip.primedAudio.size() / m_channels, audio);
+        clip.primedAudio = std::vector<short>();
+        if (clip.hasFirstImage) {
+            frame.hasPicture = true;
+            frame.image = clip.firstImage;
+            frame.time = m_offset + clip.firstTime;
+            m_lastVideoTime = clip.firstTime;
+        }
+    }
+
+    /**
+     * @brief Appends audio of the current clip, holding back whatever lies past a pending branch point
+     */
+    void emitAudio(Clip& clip, const short* samples, size_t frames, std::vector<short>& audio) {
+        if (m_branchAt >= 0.0) {
+            const size_t limit = static_cast<size_t>(m_branchAt * m_mixerRate);
+            const size_t allowed = (clip.emittedFrames < limit) ? std::min(frames, limit - clip.emittedFrames) : 0;
+            m_heldBack.insert(m_heldBack.end(), samples + allowed * m_channels, samples + frames * m_channels);
+            frames = allowed;
+        }
+
+        const size_t first = audio.size();
+        audio.insert(audio.end(), samples, samples + frames * m_channels);
+        clip.emittedFrames += frames;
+        mixFadeTail(audio, first);
+    }
+
+    /**
+     * @brief Ends the clip at a video frame: its audio is cut on the matching sample, what follows becomes the crossfade tail
+     * @return The fade tail
+     */
+    std::vector<short> cutAt(Clip& clip, double time, std::vector<short>& audio) {
+        const size_t cut = static_cast<size_t>(time * m_mixerRate);
+        std::vector<short> held;
+        held.swap(m_heldBack);
+        m_branchAt = -1.0;
+
+        // audio held back between the branch point and the frame actually cut at still plays...
+        const size_t playable = (clip.emittedFrames < cut) ? std::min(held.size() / m_channels, cut - clip.emittedFrames) : 0;
+        emitAudio(clip, held.data(), playable, audio);
+        std::vector<short> tail(held.begin() + playable * m_channels, held.end());
+
+        // ...and the crossfade needs a little more of it, video read meanwhile is never shown
+        const size_t wanted = m_crossfadeFrames * m_channels;
+        while (clip.audioDec && tail.size() < wanted && clip.demuxer->readFrame(nullptr, &clip.audioFrame)) {
+            if (clip.audioFrame.isValid() && !decodeAudio(clip, tail)) break;
+        }
+        tail.resize(std::min(tail.size(), wanted));
+        return tail;
+    }
+
+    /**
+     * @brief Ends the clip at its end of file, the resampler's last frames make up the rest of its audio
+     */
+    std::vector<short> flushTail(Clip& clip) {
+        std::vector<short> tail;
+        tail.swap(m_heldBack); // a branch point past the last frame never came
+        if (clip.resampler) {
+            std::vector<short> flushed;
+            clip.resampler->flushS16(flushed);
+            appendMapped(flushed.data(), flushed.size() / clip.demuxer->getChannels(), clip.demuxer->getChannels(), m_channels, tail);
+        }
+        m_branchAt = -1.0;
+        m_gaplessTail = true; // played as is rather than faded out
+        return tail;
+    }
+
+    /**
+     * @brief Replaces the current clip with the pre-rolled next one in the same step
+     * @param tail Audio of the outgoing clip past its cut, faded out under the new clip's audio
+     * @param clipLength Seconds of the outgoing clip that were shown
+     */
+    bool switchClips(Frame& frame, std::vector<short>& audio, std::vector<short> tail, double clipLength) {
+        TRACE_SCOPE(PRESENT, "switchClips", static_cast<int64_t>(m_switches));
+
+        if (m_gaplessTail) { // the end of file: the remaining audio plays before the next clip's
+            audio.insert(audio.end(), tail.begin(), tail.end());
+            tail.clear();
+            m_gaplessTail = false;
+        }
+        m_fadeTail.swap(tail);
+        m_fadePosition = 0;
+
+        if (!m_next) {
+            pump();
+            if (m_preparing.valid()) { // the pre-roll is late, this is the only place playback waits
+                ++m_lateSwitches;
+                m_preparing.wait();
+                collect();
+                pump();
+                if (!m_next && m_preparing.valid()) {
+                    m_preparing.wait();
+                    collect();
+                }
+            }
+        }
+
+        m_offset += clipLength;
+        m_current = std::move(m_next);
+        m_lastVideoTime = 0.0;
+        if (!m_current) {
+            audio.insert(audio.end(), m_fadeTail.begin(), m_fadeTail.end()); // nothing left to fade into
+            return false;
+        }
+
+        ++m_switches;
+        frame.switched = true;
+        start(frame, audio);
+        pump();
+        return true;
+    }
+
+    /**
+     * @brief Crossfades the outgoing clip's tail into audio appended from position first onward
+     */
+    void mixFadeTail(std::vector<short>& audio, size_t first) {
+        const size_t tailFrames = m_fadeTail.size() / m_channels;
+        if (m_fadePosition >= tailFrames) return;
+
+        for (size_t i = first; i + m_channels <= audio.size() && m_fadePosition < tailFrames; i += m_channels, ++m_fadePosition) {
+            const float in = static_cast<float>(m_fadePosition) / tailFrames; // the new clip fades in as the old one fades out
+            for (int c = 0; c < m_channels; ++c) {
+                const float mixed = audio[i + c] * in + m_fadeTail[m_fadePosition * m_channels + c] * (1.0f - in);
+                audio[i + c] = static_cast<short>(std::clamp(mixed, -32768.0f, 32767.0f));
+            }
+        }
+    }
+
+    int m_mixerRate;
+    int m_channels;
+    unsigned m_videoThreads;
+    DecoderPool* m_pool;
+
+    std::unique_ptr<Clip> m_current;
+    std::unique_ptr<Clip> m_next;                   // pre-rolled and waiting for the switch
+    std::future<std::unique_ptr<Clip>> m_preparing; // the pre-roll in progress
+    std::string m_preparingPath;
+    bool m_preparingStale = false;                  // a branch made the pre-roll in progress unwanted
+    std::vector<Preload> m_preloads;                // branch candidates
+    std::vector<std::future<std::unique_ptr<Clip>>> m_discarded; // pre-rolls nobody wants, kept until they finish
+    std::deque<std::string> m_queue;
+    bool m_loop = false;
+    bool m_startPending = false;
+
+    double m_branchAt = -1.0;  // seconds in the current clip, negative when no branch is pending
+    size_t m_crossfadeFrames = 0;
+    std::vector<short> m_heldBack; // current clip audio past the branch point
+    std::vector<short> m_fadeTail; // outgoing clip audio being faded out
+    size_t m_fadePosition = 0;
+    bool m_gaplessTail = false;
+    std::vector<short> m_decoded;
+
+    double m_offset = 0.0;        // playlist time at which the current clip started
+    double m_lastVideoTime = 0.0; // clip time of the last picture handed out
+    size_t m_switches = 0;
+    size_t m_lateSwitches = 0;
+};
@@ -0,0 +1,390 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "webm/mkvparser/mkvparser.h"
+#include "simplewebm/WebMDemuxer.hpp"
+
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Reader for a local file that another process is still writing
+ * @note Length() reports the bytes on disk as available and the total as unknown until the file is
+ * complete, which is what makes mkvparser parse incrementally and return E_BUFFER_NOT_FULL instead of
+ * failing. The file counts as complete only once it reaches the expected size or setComplete() is
+ * called, a writer that pauses is never taken for finished. The size keeps being refreshed, so a write
+ * that resumes after any pause is picked up. With a stall timeout set, isStalled() tells a caller
+ * when the writer has paused for longer than it is willing to wait.
+ *
+ * waitForGrowth() blocks until the file changes, using inotify on Linux and polling elsewhere.
+ */
+class GrowingFileReader: public mkvparser::IMkvReader {
+    public:
+    /**
+     * @param filePath The file being written
+     * @param expectedSize Final size in bytes if known (a download's Content-Length), otherwise -1
+     */
+    GrowingFileReader(const char* filePath, long long expectedSize = -1): m_path(filePath), m_file(fopen(filePath, "rb")), m_expectedSize(expectedSize) {
+#if defined(__linux__)
+        m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotify >= 0 && inotify_add_watch(m_inotify, filePath, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            close(m_inotify);
+            m_inotify = -1;
+        }
+#endif
+        refresh();
+    }
+    virtual ~GrowingFileReader() {
+#if defined(__linux__)
+        if (m_inotify >= 0) close(m_inotify);
+#endif
+        if (m_file) fclose(m_file);
+    }
+
+    int Read(long long pos, long len, unsigned char* buf) {
+        if (pos + len > m_available) refresh(); // mkvparser only asks for what Length() reported, but be safe
+        if (!m_file || pos + len > m_available) return -1;
+
+        clearerr(m_file); // an earlier read may have hit the end of file as it was then
+        fseek(m_file, pos, SEEK_SET);
+        const size_t size = fread(buf, 1, len, m_file);
+        return (size < size_t(len)) ? -1 : 0;
+    }
+
+    int Length(long long* total, long long* available) {
+        refresh(); // a file that does not exist yet is just empty
+        if (total) *total = m_complete ? m_available : -1;
+        if (available) *available = m_available;
+        return 0;
+    }
+
+    /**
+     * @brief Waits until the file grows, is completed or the timeout passes
+     * @return true if there are more bytes than before the call
+     */
+    bool waitForGrowth(int timeoutMs) {
+        const long long before = m_available;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (refresh() == before && !m_complete && std::chrono::steady_clock::now() < deadline) {
+            const int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+#if defined(__linux__)
+            if (m_inotify >= 0) {
+                pollfd descriptor = {m_inotify, POLLIN, 0};
+                if (poll(&descriptor, 1, std::max(0, std::min(remaining, POLL_INTERVAL_MS * 10))) > 0) {
+                    char events[4096];
+                    while (read(m_inotify, events, sizeof(events)) > 0) { } // only the wake up matters
+                }
+                continue;
+            }
+#endif
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::max(0, std::min(remaining, POLL_INTERVAL_MS))));
+        }
+        return m_available > before;
+    }
+
+    /**
+     * @brief Tells the reader the writer is done, for writers that know when they finish
+     */
+    void setComplete() {
+        m_complete = true;
+    }
+    bool isComplete() const { return m_complete; }
+
+    /**
+     * @brief How long the file may stop growing before isStalled() reports it, 0 never does
+     */
+    void setStallTimeout(int ms) { m_stallTimeoutMs = ms; }
+
+    /**
+     * @brief True if the file is incomplete and has not grown for the stall timeout, as of the last refresh
+     */
+    bool isStalled() const {
+        return !m_complete && m_stallTimeoutMs > 0 && std::chrono::steady_clock::now() - m_lastGrowth > std::chrono::milliseconds(m_stallTimeoutMs);
+    }
+
+    long long getAvailable() const { return m_available; }
+
+    private:
+    static const int POLL_INTERVAL_MS = 10;
+
+    long long refresh() {
+        if (!m_file) m_file = fopen(m_path.c_str(), "rb");
+
+        struct stat info;
+        if (stat(m_path.c_str(), &info) == 0) {
+            if (info.st_size != m_available) {
+                m_available = info.st_size;
+                m_lastGrowth = std::chrono::steady_clock::now();
+            }
+            if (m_expectedSize >= 0 && m_available >= m_expectedSize) m_complete = true;
+        }
+        return m_available;
+    }
+
+    std::string m_path;
+    FILE* m_file;
+    long long m_expectedSize;
+    long long m_available = 0;
+    bool m_complete = false;
+    int m_stallTimeoutMs = 0;
+    std::chrono::steady_clock::time_point m_lastGrowth = std::chrono::steady_clock::now();
+#if defined(__linux__)
+    int m_inotify = -1;
+#endif
+};
+
+/**
+ * @brief Shows only the first bytes of another reader, as if the file ended there
+ * @note WebMDemuxer loads every cluster when it opens, which a growing file cannot satisfy. Cut off
+ * at the first cluster it opens on the headers alone, which is all the decoders need from it.
+ */
+class HeaderWindowReader: public mkvparser::IMkvReader {
+    public:
+    HeaderWindowReader(mkvparser::IMkvReader* reader, long long length): m_reader(reader), m_length(length) { }
+    virtual ~HeaderWindowReader() { }
+
+    int Read(long long pos, long len, unsigned char* buf) {
+        return (pos + len > m_length) ? -1 : m_reader->Read(pos, len, buf);
+    }
+
+    int Length(long long* total, long long* available) {
+        if (total) *total = m_length;
+        if (available) *available = m_length;
+        return 0;
+    }
+
+    private:
+    mkvparser::IMkvReader* m_reader;
+    long long m_length;
+};
+
+/**
+ * @brief Demuxer that plays a WebM file while it is still being written
+ * @note Every call picks up where the last one stopped, so running out of bytes is not an error:
+ * readFrame() reports UNDERFLOW and can simply be called again once waitForData() says more arrived.
+ * The decoders are created from getHeaderDemuxer(), a WebMDemuxer opened on the headers only.
+ */
+class ProgressiveDemuxer {
+    public:
+    enum Status {
+        FRAME,         // a frame was read
+        UNDERFLOW,     // the bytes needed have not been written yet
+        END_OF_STREAM,
+        ERROR
+    };
+
+    /**
+     * @param reader The growing file, it must outlive this object
+     */
+    ProgressiveDemuxer(GrowingFileReader* reader): m_reader(reader) { }
+    ~ProgressiveDemuxer() {
+        delete m_segment;
+    }
+
+    /**
+     * @brief Parses the headers, call again after UNDERFLOW until it returns FRAME (opened) or fails
+     */
+    Status open() {
+        if (m_headerDemuxer) return FRAME;
+
+        // libwebm returns a positive value when it needs more bytes than are available
+        if (!m_segment) {
+            mkvparser::EBMLHeader ebmlHeader;
+            long long pos = 0;
+            const long long status = ebmlHeader.Parse(m_reader, pos);
+            if (status != 0) return underflowOr((status > 0) ? mkvparser::E_BUFFER_NOT_FULL : status);
+            const long long created = mkvparser::Segment::CreateInstance(m_reader, pos, m_segment);
+            if (created != 0 || !m_segment) {
+                delete m_segment;
+                m_segment = nullptr;
+                return underflowOr((created >= 0) ? mkvparser::E_BUFFER_NOT_FULL : created);
+            }
+        }
+
+        const long status = m_segment->ParseHeaders();
+        if (status != 0) return underflowOr((status > 0) ? mkvparser::E_BUFFER_NOT_FULL : status);
+
+        // the first cluster's header marks where the headers end
+        if (m_segment->GetCount() == 0) {
+            long long pos;
+            long len;
+            const long loaded = m_segment->LoadCluster(pos, len);
+            if (loaded < 0) return underflowOr(loaded);
+            if (loaded > 0) return ERROR; // no clusters at all
+        }
+        const mkvparser::Cluster* first = m_segment->GetFirst();
+        if (!first || first->EOS()) return ERROR;
+
+        m_headerDemuxer = std::make_unique<WebMDemuxer>(new HeaderWindowReader(m_reader, first->m_element_start));
+        if (!m_headerDemuxer->isOpen()) {
+            std::cerr << "Failed to open the WebM headers." << std::endl;
+            return ERROR;
+        }
+
+        const mkvparser::Tracks* tracks = m_segment->GetTracks();
+        for (unsigned long i = 0; tracks && i < tracks->GetTracksCount(); ++i) {
+            const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+            if (!track) continue;
+            if (!m_videoTrack && track->GetType() == mkvparser::Track::kVideo &&
+                (strcmp(track->GetCodecId(), "V_VP8") == 0 || strcmp(track->GetCodecId(), "V_VP9") == 0)) {
+                m_videoTrack = static_cast<const mkvparser::VideoTrack*>(track);
+            } else if (!m_audioTrack && track->GetType() == mkvparser::Track::kAudio &&
+                       (strcmp(track->GetCodecId(), "A_VORBIS") == 0 || strcmp(track->GetCodecId(), "A_OPUS") == 0)) {
+                m_audioTrack = track;
+            }
+        }
+        m_cluster = first;
+        return FRAME;
+    }
+
+    /**
+     * @brief Headers-only demuxer to create VPXDecoder and OpusVorbisDecoder from, valid after open()
+     */
+    const WebMDemuxer& getHeaderDemuxer() const { return *m_headerDemuxer; }
+
+    double getFrameRate() const {
+        return (m_videoTrack && m_videoTrack->GetDefaultDuration() > 0) ? 1e9 / m_videoTrack->GetDefaultDuration() : 30.0;
+    }
+
+    /**
+     * @brief Reads the next video or audio frame, like WebMDemuxer::readFrame()
+     */
+    Status readFrame(WebMFrame* videoFrame, WebMFrame* audioFrame) {
+        TRACE_SCOPE(DEMUX, "ProgressiveDemuxer::readFrame", 0);
+        if (videoFrame) videoFrame->bufferSize = 0;
+        if (audioFrame) audioFrame->bufferSize = 0;
+        if (!m_headerDemuxer) return ERROR;
+        if (m_eos) return END_OF_STREAM;
+
+        for (;;) {
+            // the next frame of a laced block...
+            if (m_block && m_blockFrameIndex < m_block->GetFrameCount()) {
+                WebMFrame* frame = (m_block->GetTrackNumber() == trackNumber(m_videoTrack)) ? videoFrame : audioFrame;
+                if (!frame) { // the caller does not want this track
+                    m_block = nullptr;
+                    continue;
+                }
+                const mkvparser::Block::Frame& blockFrame = m_block->GetFrame(m_blockFrameIndex);
+                if (blockFrame.pos + blockFrame.len > m_reader->getAvailable()) return underflowOr(mkvparser::E_BUFFER_NOT_FULL);
+                if (!copyFrame(blockFrame, frame)) return ERROR;
+                frame->time = m_block->GetTime(m_cluster) / 1e9;
+                frame->key = m_block->IsKey();
+                ++m_blockFrameIndex;
+                return FRAME;
+            }
+
+            // ...else the next block of a track being played...
+            const mkvparser::BlockEntry* next = nullptr;
+            const long status = m_entry ? m_cluster->GetNext(m_entry, next) : m_cluster->GetFirst(next);
+            if (status < 0) return underflowOr(status);
+            if (next && !next->EOS()) {
+                m_entry = next;
+                m_block = next->GetBlock();
+                m_blockFrameIndex = 0;
+                const long long track = m_block->GetTrackNumber();
+                if (track != trackNumber(m_videoTrack) && track != trackNumber(m_audioTrack)) m_block = nullptr;
+                continue;
+            }
+
+            // ...else the next cluster, loading it once it has been written
+            if (m_segment->GetLast() == m_cluster) {
+                long long pos;
+                long len;
+                const long loaded = m_segment->LoadCluster(pos, len);
+                if (loaded < 0) return underflowOr(loaded);
+                if (loaded > 0) {
+                    m_eos = true;
+                    return END_OF_STREAM;
+                }
+            }
+            const mkvparser::Cluster* cluster = m_segment->GetNext(m_cluster);
+            if (!cluster || cluster->EOS()) {
+                m_eos = true;
+                return END_OF_STREAM;
+            }
+            m_cluster = cluster;
+            m_entry = nullptr;
+            m_block = nullptr;
+        }
+    }
+
+    /**
+     * @brief Media time up to which every frame has been written, infinite once the file or its segment is complete
+     * @note The start of the newest cluster on disk is a safe bound: the clusters before it are whole.
+     */
+    double getBufferedUntil() {
+        if (m_reader->isComplete()) return std::numeric_limits<double>::infinity();
+        if (!m_segment || !m_headerDemuxer) return 0.0;
+
+        long long pos;
+        long len;
+        long loaded;
+        while ((loaded = m_segment->LoadCluster(pos, len)) == 0) { } // only cluster headers are parsed here
+        if (loaded > 0) return std::numeric_limits<double>::infinity(); // every cluster of a sized segment is on disk
+        const mkvparser::Cluster* last = m_segment->GetLast();
+        return (last && !last->EOS()) ? last->GetTime() / 1e9 : 0.0;
+    }
+
+    /**
+     * @brief Blocks until more of the file is written or it is complete
+     * @return false if nothing arrived before the timeout
+     */
+    bool waitForData(int timeoutMs) {
+        return m_reader->waitForGrowth(timeoutMs) || m_reader->isComplete();
+    }
+
+    private:
+    static long long trackNumber(const mkvparser::Track* track) {
+        return track ? track->GetNumber() : -1;
+    }
+
+    /**
+     * @brief Running out of bytes is an underflow while the file grows, and the end once it is complete
+     */
+    Status underflowOr(long long status) {
+        if (status != mkvparser::E_BUFFER_NOT_FULL) return ERROR;
+        if (m_reader->isComplete()) {
+            m_eos = true;
+            return END_OF_STREAM;
+        }
+        return UNDERFLOW;
+    }
+
+    bool copyFrame(const mkvparser::Block::Frame& blockFrame, WebMFrame* frame) {
+        if (blockFrame.len > frame->bufferCapacity) {
+            unsigned char* buffer = static_cast<unsigned char*>(realloc(frame->buffer, blockFrame.len));
+            if (!buffer) return false;
+            frame->buffer = buffer;
+            frame->bufferCapacity = blockFrame.len;
+        }
+        if (blockFrame.Read(m_reader, frame->buffer) < 0) return false;
+        frame->bufferSize = blockFrame.len;
+        return true;
+    }
+
+    GrowingFileReader* m_reader;
+    mkvparser::Segment* m_segment = nullptr;
+    std::unique_ptr<WebMDemuxer> m_headerDemuxer;
+    const mkvparser::VideoTrack* m_videoTrack = nullptr;
+    const mkvparser::Track* m_audioTrack = nullptr;
+
+    const mkvparser::Cluster* m_cluster = nullptr;
+    const mkvparser::BlockEntry* m_entry = nullptr; // nullptr before the cluster's first block
+    const mkvparser::Block* m_block = nullptr;      // nullptr when the current block is not played
+    int m_blockFrameIndex = 0;
+    bool m_eos = false;
+};
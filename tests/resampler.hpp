@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+#include "../tests/simd.hpp"
+
+/**
+ * @brief Polyphase windowed-sinc sample rate converter
+ * @note Converts decoded Opus/Vorbis audio to whatever rate the output device (or mixer) is
+ * running at, so the device never has to be reopened to match a piece of media. Audio is pushed
+ * in blocks of any size; whatever cannot be converted yet is kept internally for the next block.
+ */
+class PolyphaseResampler {
+    public:
+    /**
+     * @brief The quality/CPU trade-off, more taps give a steeper anti-aliasing filter
+     */
+    enum Quality {
+        FAST,   // 8 taps per phase, for voice chatter and UI blips
+        MEDIUM, // 16 taps per phase, good default for game audio
+        BEST    // 32 taps per phase, for music and cutscenes
+    };
+
+    PolyphaseResampler(int input_rate, int output_rate, int channels, Quality quality = MEDIUM)
+        : m_inputRate(input_rate), m_outputRate(output_rate), m_channels(channels) {
+        // reduce the ratio, output frame n lands on input position n * m_step / m_phases
+        const int divisor = std::gcd(input_rate, output_rate);
+        m_phases = output_rate / divisor;
+        m_step = input_rate / divisor;
+
+        switch (quality) {
+            case FAST:   m_taps = 8;  m_beta = 5.0; m_rolloff = 0.85; break;
+            case MEDIUM: m_taps = 16; m_beta = 7.0; m_rolloff = 0.90; break;
+            case BEST:   m_taps = 32; m_beta = 9.0; m_rolloff = 0.94; break;
+        }
+
+        // odd ratios (ex: 44100 -> 48001) would need thousands of phases, so snap to the nearest of MAX_PHASES instead
+        m_tablePhases = std::min(m_phases, MAX_PHASES);
+
+        buildFilterTable();
+        reset();
+    }
+    ~PolyphaseResampler() { };
+
+    /**
+     * @brief Converts a block of interleaved float samples
+     * @param input Interleaved samples, inputFrames * channels of them
+     * @param inputFrames Number of frames (samples per channel) in the block
+     * @param output Converted interleaved samples are appended to this vector
+     * @return The number of frames appended to output
+     */
+    size_t process(const float* input, size_t inputFrames, std::vector<float>& output) {
+        if (isPassthrough()) {
+            output.insert(output.end(), input, input + inputFrames * m_channels);
+            return inputFrames;
+        }
+
+        // deinterleave the new block behind whatever is left over from the previous one
+        for (int c = 0; c < m_channels; ++c) {
+            std::vector<float>& history = m_history[c];
+            const size_t start = history.size();
+            history.resize(start + inputFrames);
+            for (size_t i = 0; i < inputFrames; ++i) {
+                history[start + i] = input[i * m_channels + c];
+            }
+        }
+
+        // produce every output frame whose filter window is fully inside the history
+        const size_t available = m_history[0].size();
+        size_t produced = 0;
+        while (m_position + m_taps <= available) {
+            const float* coefficients = &m_filter[tablePhase(m_phase) * m_taps];
+            for (int c = 0; c < m_channels; ++c) {
+                output.push_back(simd::dot(&m_history[c][m_position], coefficients, m_taps));
+            }
+            ++produced;
+
+            // advance along the input by M/L
+            m_phase += m_step;
+            m_position += m_phase / m_phases;
+            m_phase %= m_phases;
+        }
+
+        // drop the input that no future output frame will need
+        const size_t consumed = std::min(m_position, available);
+        for (int c = 0; c < m_channels; ++c) {
+            m_history[c].erase(m_history[c].begin(), m_history[c].begin() + consumed);
+        }
+        m_position -= consumed;
+
+        return produced;
+    }
+
+    /**
+     * @brief Same as process() but for the signed 16-bit audio libsimplewebm produces
+     */
+    size_t processS16(const short* input, size_t inputFrames, std::vector<short>& output) {
+        m_scratchIn.resize(inputFrames * m_channels);
+        for (size_t i = 0; i < m_scratchIn.size(); ++i) {
+            m_scratchIn[i] = input[i] / 32768.0f;
+        }
+
+        m_scratchOut.clear();
+        const size_t produced = process(m_scratchIn.data(), inputFrames, m_scratchOut);
+        appendS16(output);
+        return produced;
+    }
+
+    /**
+     * @brief Pushes silence through the filter so the last real input frames come out
+     * @param output Converted interleaved samples are appended to this vector
+     * @return The number of frames appended to output
+     */
+    size_t flush(std::vector<float>& output) {
+        if (isPassthrough()) return 0;
+
+        std::vector<float> silence(static_cast<size_t>(m_taps) * m_channels, 0.0f);
+        return process(silence.data(), m_taps, output);
+    }
+
+    /**
+     * @brief Same as flush() but for the signed 16-bit audio libsimplewebm produces
+     */
+    size_t flushS16(std::vector<short>& output) {
+        m_scratchOut.clear();
+        const size_t produced = flush(m_scratchOut);
+        appendS16(output);
+        return produced;
+    }
+
+    /**
+     * @brief Forgets all buffered input, used when seeking or switching media
+     */
+    void reset() {
+        m_history.assign(m_channels, std::vector<float>(m_taps / 2 - 1, 0.0f)); // center the first window on input frame zero
+        m_position = 0;
+        m_phase = 0;
+    }
+
+    /**
+     * @brief Estimates how many output frames a block of input frames will produce
+     * @note Useful for reserving space ahead of time, the exact count depends on the leftover input.
+     */
+    size_t getOutputFrames(size_t inputFrames) const {
+        return static_cast<size_t>(std::ceil(static_cast<double>(inputFrames) * m_outputRate / m_inputRate)) + 1;
+    }
+
+    bool isPassthrough() const { return m_inputRate == m_outputRate; }
+    int getInputRate() const { return m_inputRate; }
+    int getOutputRate() const { return m_outputRate; }
+    int getChannels() const { return m_channels; }
+
+    private:
+    static constexpr int MAX_PHASES = 512;
+    static constexpr double PI = 3.14159265358979323846;
+
+    int tablePhase(int phase) const {
+        if (m_tablePhases == m_phases) return phase;
+        // phases in the last half step would round up to the next input frame's phase 0, the last row is within 1/MAX_PHASES of it
+        const long long snapped = (static_cast<long long>(phase) * m_tablePhases + m_phases / 2) / m_phases;
+        return static_cast<int>(std::min<long long>(snapped, m_tablePhases - 1));
+    }
+
+    /**
+     * @brief Converts m_scratchOut back to 16-bit and appends it
+     */
+    void appendS16(std::vector<short>& output) const {
+        output.reserve(output.size() + m_scratchOut.size());
+        for (float sample : m_scratchOut) {
+            const float scaled = std::round(sample * 32768.0f);
+            output.push_back(static_cast<short>(std::clamp(scaled, -32768.0f, 32767.0f))); // the filter can overshoot a full scale input slightly
+        }
+    }
+
+    static double besselI0(double x) {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 32; ++k) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    void buildFilterTable() {
+        // cutoff relative to the input rate, lowered when downsampling so nothing aliases
+        const double cutoff = 0.5 * std::min(1.0, static_cast<double>(m_outputRate) / m_inputRate) * m_rolloff;
+        const double center = m_taps / 2 - 1;
+        const double halfWidth = m_taps / 2.0;
+
+        m_filter.assign(static_cast<size_t>(m_tablePhases) * m_taps, 0.0f);
+        for (int p = 0; p < m_tablePhases; ++p) {
+            const double fraction = static_cast<double>(p) / m_tablePhases;
+            double sum = 0.0;
+
+            // windowed sinc for this phase...
+            std::vector<double> phase(m_taps);
+            for (int k = 0; k < m_taps; ++k) {
+                const double x = k - center - fraction;
+                const double arg = 2.0 * cutoff * x;
+                const double sinc = (std::abs(arg) < 1e-9) ? 1.0 : std::sin(PI * arg) / (PI * arg);
+                const double ratio = x / halfWidth;
+                const double window = (std::abs(ratio) < 1.0) ? besselI0(m_beta * std::sqrt(1.0 - ratio * ratio)) / besselI0(m_beta) : 0.0;
+                phase[k] = sinc * window;
+                sum += phase[k];
+            }
+
+            // ...normalized to unity gain so every phase passes DC unchanged
+            for (int k = 0; k < m_taps; ++k) {
+                m_filter[p * m_taps + k] = static_cast<float>(phase[k] / sum);
+            }
+        }
+    }
+
+    int m_inputRate;      // sample rate of the audio being fed in
+    int m_outputRate;     // sample rate of the audio being produced
+    int m_channels;       // interleaved channel count
+    int m_taps = 16;      // filter length per phase, always a multiple of 4 so the SIMD dot product has no tail
+    double m_beta = 7.0;  // Kaiser window shape
+    double m_rolloff = 0.9; // fraction of the Nyquist frequency that is kept
+    int m_phases;         // L, the reduced output rate
+    int m_step;           // M, the reduced input rate
+    int m_tablePhases;    // number of phases actually stored in the filter table
+
+    std::vector<float> m_filter;               // m_tablePhases rows of m_taps coefficients
+    std::vector<std::vector<float>> m_history; // planar input waiting to be filtered, one vector per channel
+    size_t m_position = 0;                     // index into m_history of the next output frame's window
+    int m_phase = 0;                           // fractional position of the next output frame, in units of 1/m_phases
+
+    std::vector<float> m_scratchIn;  // reused by processS16() and flushS16() to avoid allocating per block
+    std::vector<float> m_scratchOut;
+};
@@ -0,0 +1,397 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OPENAVMEDIA_SIMD_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define OPENAVMEDIA_SIMD_NEON 1
+#endif
+
+/**
+ * @brief This namespace contains small vectorized kernels shared by the audio and video processing code.
+ * @note SSE is used on x86, NEON on ARM, and a plain loop everywhere else. Every kernel handles
+ * lengths that are not a multiple of its vector width by finishing the tail with scalar code.
+ */
+namespace simd {
+    /**
+     * @brief Computes the dot product of two float arrays
+     * @param a First array
+     * @param b Second array
+     * @param n Number of elements in each array
+     * @return The sum of a[i] * b[i]
+     */
+    inline float dot(const float* a, const float* b, size_t n) {
+        size_t i = 0;
+        float sum = 0.0f;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        __m128 acc = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        float32x4_t acc = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4) {
+            acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+        }
+        float lanes[4];
+        vst1q_f32(lanes, acc);
+        sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+        for (; i < n; ++i) { // scalar tail (or the whole array when no SIMD is available)
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    /**
+     * @brief Multiplies an array by a gain that moves linearly from one value to another
+     * @note Used to smooth parameter changes across a block. Pass from == to for a constant gain.
+     * @param data Array to scale in place
+     * @param n Number of elements
+     * @param from Gain applied to the first element
+     * @param to Gain the ramp reaches one element past the end
+     */
+    inline void ramp(float* data, size_t n, float from, float to) {
+        const float step = (n > 0) ? (to - from) / n : 0.0f;
+        size_t i = 0;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        __m128 gain = _mm_setr_ps(from, from + step, from + 2 * step, from + 3 * step);
+        const __m128 advance = _mm_set1_ps(4 * step);
+        for (; i + 4 <= n; i += 4) {
+            _mm_storeu_ps(data + i, _mm_mul_ps(_mm_loadu_ps(data + i), gain));
+            gain = _mm_add_ps(gain, advance);
+        }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        const float start[4] = {from, from + step, from + 2 * step, from + 3 * step};
+        float32x4_t gain = vld1q_f32(start);
+        const float32x4_t advance = vdupq_n_f32(4 * step);
+        for (; i + 4 <= n; i += 4) {
+            vst1q_f32(data + i, vmulq_f32(vld1q_f32(data + i), gain));
+            gain = vaddq_f32(gain, advance);
+        }
+#endif
+
+        for (; i < n; ++i) {
+            data[i] *= from + step * i;
+        }
+    }
+
+    /**
+     * @brief Adds an array, scaled by a linearly moving gain, onto another array
+     * @param dst Array to accumulate into
+     * @param src Array to add
+     * @param n Number of elements
+     * @param from Gain applied to the first element
+     * @param to Gain the ramp reaches one element past the end
+     */
+    inline void accumulate(float* dst, const float* src, size_t n, float from, float to) {
+        const float step = (n > 0) ? (to - from) / n : 0.0f;
+        size_t i = 0;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        __m128 gain = _mm_setr_ps(from, from + step, from + 2 * step, from + 3 * step);
+        const __m128 advance = _mm_set1_ps(4 * step);
+        for (; i + 4 <= n; i += 4) {
+            _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), gain)));
+            gain = _mm_add_ps(gain, advance);
+        }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        const float start[4] = {from, from + step, from + 2 * step, from + 3 * step};
+        float32x4_t gain = vld1q_f32(start);
+        const float32x4_t advance = vdupq_n_f32(4 * step);
+        for (; i + 4 <= n; i += 4) {
+            vst1q_f32(dst + i, vmlaq_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gain));
+            gain = vaddq_f32(gain, advance);
+        }
+#endif
+
+        for (; i < n; ++i) {
+            dst[i] += src[i] * (from + step * i);
+        }
+    }
+
+    /**
+     * @brief Finds the largest absolute value in an array
+     */
+    inline float peak(const float* data, size_t n) {
+        size_t i = 0;
+        float result = 0.0f;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        __m128 acc = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) {
+            acc = _mm_max_ps(acc, _mm_andnot_ps(signMask, _mm_loadu_ps(data + i)));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        result = lanes[0];
+        for (int l = 1; l < 4; ++l) result = (lanes[l] > result) ? lanes[l] : result;
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        float32x4_t acc = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4) {
+            acc = vmaxq_f32(acc, vabsq_f32(vld1q_f32(data + i)));
+        }
+        float lanes[4];
+        vst1q_f32(lanes, acc);
+        result = lanes[0];
+        for (int l = 1; l < 4; ++l) result = (lanes[l] > result) ? lanes[l] : result;
+#endif
+
+        for (; i < n; ++i) {
+            const float magnitude = (data[i] < 0.0f) ? -data[i] : data[i];
+            result = (magnitude > result) ? magnitude : result;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Converts signed 16-bit samples to floats in the range -1.0 to 1.0
+     */
+    inline void s16ToFloat(const int16_t* in, float* out, size_t n) {
+        size_t i = 0;
+        const float scale = 1.0f / 32768.0f;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        const __m128 vscale = _mm_set1_ps(scale);
+        for (; i + 8 <= n; i += 8) {
+            const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16); // sign extend
+            const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), vscale));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), vscale));
+        }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        for (; i + 8 <= n; i += 8) {
+            const int16x8_t packed = vld1q_s16(in + i);
+            vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(packed))), scale));
+            vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(packed))), scale));
+        }
+#endif
+
+        for (; i < n; ++i) {
+            out[i] = in[i] * scale;
+        }
+    }
+
+    /**
+     * @brief Converts floats back to signed 16-bit samples, clipping anything outside -1.0 to 1.0
+     */
+    inline void floatToS16(const float* in, int16_t* out, size_t n) {
+        size_t i = 0;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        const __m128 vscale = _mm_set1_ps(32768.0f);
+        for (; i + 8 <= n; i += 8) {
+            const __m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), vscale));
+            const __m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vscale));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(low, high)); // packs saturates
+        }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        for (; i + 8 <= n; i += 8) {
+            const int32x4_t low = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), 32768.0f));
+            const int32x4_t high = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i + 4), 32768.0f));
+            vst1q_s16(out + i, vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+        }
+#endif
+
+        for (; i < n; ++i) {
+            float scaled = in[i] * 32768.0f;
+            scaled = (scaled > 32767.0f) ? 32767.0f : ((scaled < -32768.0f) ? -32768.0f : scaled);
+            out[i] = static_cast<int16_t>(scaled + ((scaled < 0.0f) ? -0.5f : 0.5f));
+        }
+    }
+
+    /**
+     * @brief Four floats processed together, used where an algorithm naturally works on four lanes
+     */
+    struct float4 {
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        __m128 v;
+        float4() : v(_mm_setzero_ps()) { }
+        explicit float4(__m128 value) : v(value) { }
+        explicit float4(float value) : v(_mm_set1_ps(value)) { }
+        float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) { }
+        void store(float* out) const { _mm_storeu_ps(out, v); }
+        friend float4 operator+(float4 a, float4 b) { return float4(_mm_add_ps(a.v, b.v)); }
+        friend float4 operator-(float4 a, float4 b) { return float4(_mm_sub_ps(a.v, b.v)); }
+        friend float4 operator*(float4 a, float4 b) { return float4(_mm_mul_ps(a.v, b.v)); }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        float32x4_t v;
+        float4() : v(vdupq_n_f32(0.0f)) { }
+        explicit float4(float32x4_t value) : v(value) { }
+        explicit float4(float value) : v(vdupq_n_f32(value)) { }
+        float4(float a, float b, float c, float d) { const float lanes[4] = {a, b, c, d}; v = vld1q_f32(lanes); }
+        void store(float* out) const { vst1q_f32(out, v); }
+        friend float4 operator+(float4 a, float4 b) { return float4(vaddq_f32(a.v, b.v)); }
+        friend float4 operator-(float4 a, float4 b) { return float4(vsubq_f32(a.v, b.v)); }
+        friend float4 operator*(float4 a, float4 b) { return float4(vmulq_f32(a.v, b.v)); }
+#else
+        float v[4];
+        float4() : v{0.0f, 0.0f, 0.0f, 0.0f} { }
+        explicit float4(float value) : v{value, value, value, value} { }
+        float4(float a, float b, float c, float d) : v{a, b, c, d} { }
+        void store(float* out) const { for (int i = 0; i < 4; ++i) out[i] = v[i]; }
+        friend float4 operator+(float4 a, float4 b) { return float4(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]); }
+        friend float4 operator-(float4 a, float4 b) { return float4(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]); }
+        friend float4 operator*(float4 a, float4 b) { return float4(a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]); }
+#endif
+    };
+
+    /**
+     * @brief Mixes four lanes with a 4x4 Hadamard matrix scaled by 1/2, which keeps the energy unchanged
+     */
+    inline float4 hadamard4(float4 x) {
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        // butterfly lanes (0,1) and (2,3), then (0,2) and (1,3)
+        const __m128 swapPairs = _mm_shuffle_ps(x.v, x.v, _MM_SHUFFLE(2, 3, 0, 1));
+        const __m128 u = _mm_add_ps(swapPairs, _mm_mul_ps(x.v, _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f)));
+        const __m128 swapHalves = _mm_shuffle_ps(u, u, _MM_SHUFFLE(1, 0, 3, 2));
+        const __m128 w = _mm_add_ps(swapHalves, _mm_mul_ps(u, _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f)));
+        return float4(_mm_mul_ps(w, _mm_set1_ps(0.5f)));
+#else
+        float lanes[4];
+        x.store(lanes);
+        const float u0 = lanes[0] + lanes[1], u1 = lanes[0] - lanes[1], u2 = lanes[2] + lanes[3], u3 = lanes[2] - lanes[3];
+        return float4(0.5f * (u0 + u2), 0.5f * (u1 + u3), 0.5f * (u0 - u2), 0.5f * (u1 - u3));
+#endif
+    }
+
+    /**
+     * @brief Limited range YUV to RGB matrix, R = y(Y-16) + rv(V-128) and so on, coefficients in Q15
+     * @note Products are kept in 16 bit lanes with 6 fractional bits. A coefficient is applied as its
+     * whole part plus a 15 bit fraction, so the result stays within about half a level of the exact
+     * matrix. Sums past the 16 bit range saturate, which only happens far outside 0..255.
+     */
+    struct YuvMatrix {
+        int32_t y, rv, gu, gv, bu;
+    };
+    constexpr YuvMatrix BT601 = {38155, 52299, 12837, 26639, 66101};
+    constexpr YuvMatrix BT709 = {38155, 58745, 6988, 17462, 69219};
+
+    /**
+     * @brief Converts one row of planar YUV plus an alpha plane to premultiplied RGBA bytes
+     * @note The SIMD paths and the scalar tail compute the exact same integers, so a row converts
+     * identically whatever its width. Premultiplying divides by 255 with rounding, so an opaque
+     * pixel keeps its color and a transparent one becomes 0,0,0,0.
+     * @param y Luma row, width samples
+     * @param u Cb row, width >> chromaShift samples (rounded up)
+     * @param v Cr row, same length as u
+     * @param a Alpha row, width samples
+     * @param rgba Output row, width * 4 bytes in R, G, B, A order (SDL_PIXELFORMAT_RGBA32)
+     * @param width Number of pixels
+     * @param chromaShift 1 when chroma is horizontally subsampled (4:2:0, 4:2:2), 0 for 4:4:4
+     * @param m The color matrix
+     */
+    inline void yuvaToPremultipliedRgba(const uint8_t* y, const uint8_t* u, const uint8_t* v, const uint8_t* a,
+                                        uint8_t* rgba, size_t width, int chromaShift, const YuvMatrix& m) {
+        size_t i = 0;
+
+#if defined(OPENAVMEDIA_SIMD_SSE)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i yOffset = _mm_set1_epi16(16), cOffset = _mm_set1_epi16(128);
+        const __m128i round6 = _mm_set1_epi16(32), round8 = _mm_set1_epi16(128);
+        auto load8 = [&](const uint8_t* p) { return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), zero); };
+        auto loadChroma = [&](const uint8_t* p, size_t x) {
+            if (!chromaShift) return load8(p + x);
+            int32_t packed; // 4 samples cover 8 pixels, each one is used twice
+            std::memcpy(&packed, p + (x >> 1), sizeof(packed));
+            const __m128i c = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+            return _mm_unpacklo_epi16(c, c);
+        };
+        auto term = [](__m128i x, int32_t k) { // x * k in Q6: whole part, then (x << 7) * fraction >> 16
+            const __m128i whole = _mm_mullo_epi16(x, _mm_set1_epi16(static_cast<int16_t>((k >> 15) << 6)));
+            return _mm_add_epi16(whole, _mm_mulhi_epi16(_mm_slli_epi16(x, 7), _mm_set1_epi16(static_cast<int16_t>(k & 0x7FFF))));
+        };
+        auto channel = [&](__m128i sum) { // round, shift, clamp to 0..255 (still 16 bit lanes)
+            const __m128i c = _mm_srai_epi16(_mm_adds_epi16(sum, round6), 6);
+            return _mm_unpacklo_epi8(_mm_packus_epi16(c, c), zero);
+        };
+        auto premultiply = [&](__m128i c, __m128i alpha) { // (c*a + 128 + ((c*a + 128) >> 8)) >> 8, unsigned 16 bit
+            const __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, alpha), round8);
+            return _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8), zero);
+        };
+        for (; i + 8 <= width; i += 8) {
+            const __m128i yy = term(_mm_sub_epi16(load8(y + i), yOffset), m.y);
+            const __m128i uu = _mm_sub_epi16(loadChroma(u, i), cOffset);
+            const __m128i vv = _mm_sub_epi16(loadChroma(v, i), cOffset);
+            const __m128i alpha = load8(a + i);
+
+            const __m128i r = channel(_mm_adds_epi16(yy, term(vv, m.rv)));
+            const __m128i g = channel(_mm_subs_epi16(_mm_subs_epi16(yy, term(uu, m.gu)), term(vv, m.gv)));
+            const __m128i b = channel(_mm_adds_epi16(yy, term(uu, m.bu)));
+
+            const __m128i rg = _mm_unpacklo_epi8(premultiply(r, alpha), premultiply(g, alpha));
+            const __m128i ba = _mm_unpacklo_epi8(premultiply(b, alpha), _mm_packus_epi16(alpha, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4), _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+        }
+#elif defined(OPENAVMEDIA_SIMD_NEON)
+        const int16x8_t yOffset = vdupq_n_s16(16), cOffset = vdupq_n_s16(128);
+        auto load8 = [](const uint8_t* p) { return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p))); };
+        auto loadChroma = [&](const uint8_t* p, size_t x) {
+            if (!chromaShift) return load8(p + x);
+            uint8_t samples[8] = {0}; // 4 samples cover 8 pixels, each one is used twice
+            std::memcpy(samples, p + (x >> 1), 4);
+            const uint8x8_t c = vld1_u8(samples);
+            return vreinterpretq_s16_u16(vmovl_u8(vzip_u8(c, c).val[0]));
+        };
+        auto term = [](int16x8_t x, int32_t k) { // x * k in Q6: whole part, then (x << 6) * fraction * 2 >> 16
+            const int16x8_t whole = vmulq_n_s16(x, static_cast<int16_t>((k >> 15) << 6));
+            return vaddq_s16(whole, vqdmulhq_n_s16(vshlq_n_s16(x, 6), static_cast<int16_t>(k & 0x7FFF)));
+        };
+        auto channel = [](int16x8_t sum) { // round, shift, clamp to 0..255
+            return vqmovun_s16(vshrq_n_s16(vqaddq_s16(sum, vdupq_n_s16(32)), 6));
+        };
+        auto premultiply = [](uint8x8_t c, uint8x8_t alpha) { // (c*a + 128 + ((c*a + 128) >> 8)) >> 8
+            const uint16x8_t t = vaddq_u16(vmull_u8(c, alpha), vdupq_n_u16(128));
+            return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+        };
+        for (; i + 8 <= width; i += 8) {
+            const int16x8_t yy = term(vsubq_s16(load8(y + i), yOffset), m.y);
+            const int16x8_t uu = vsubq_s16(loadChroma(u, i), cOffset);
+            const int16x8_t vv = vsubq_s16(loadChroma(v, i), cOffset);
+            const uint8x8_t alpha = vld1_u8(a + i);
+
+            uint8x8x4_t out;
+            out.val[0] = premultiply(channel(vqaddq_s16(yy, term(vv, m.rv))), alpha);
+            out.val[1] = premultiply(channel(vqsubq_s16(vqsubq_s16(yy, term(uu, m.gu)), term(vv, m.gv))), alpha);
+            out.val[2] = premultiply(channel(vqaddq_s16(yy, term(uu, m.bu))), alpha);
+            out.val[3] = alpha;
+            vst4_u8(rgba + i * 4, out);
+        }
+#endif
+
+        // scalar tail (or the whole row when no SIMD is available), saturating like the 16 bit lanes
+        auto saturate16 = [](int x) { return x < -32768 ? -32768 : (x > 32767 ? 32767 : x); };
+        auto scalarTerm = [](int x, int32_t k) { return x * ((k >> 15) << 6) + ((x * 128 * (k & 0x7FFF)) >> 16); };
+        auto clampChannel = [&](int sum) {
+            const int c = saturate16(saturate16(sum) + 32) >> 6;
+            return c < 0 ? 0 : (c > 255 ? 255 : c);
+        };
+        for (; i < width; ++i) {
+            const size_t c = i >> chromaShift;
+            const int yy = scalarTerm(y[i] - 16, m.y), uu = u[c] - 128, vv = v[c] - 128, alpha = a[i];
+            const int rgb[3] = {
+                clampChannel(yy + scalarTerm(vv, m.rv)),
+                clampChannel(saturate16(yy - scalarTerm(uu, m.gu)) - scalarTerm(vv, m.gv)),
+                clampChannel(yy + scalarTerm(uu, m.bu))
+            };
+            for (int k = 0; k < 3; ++k) {
+                const int t = rgb[k] * alpha + 128;
+                rgba[i * 4 + k] = static_cast<uint8_t>((t + (t >> 8)) >> 8);
+            }
+            rgba[i * 4 + 3] = static_cast<uint8_t>(alpha);
+        }
+    }
+}
@@ -0,0 +1,337 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "soloud/soloud.h"
+
+#include "../tests/test5.hpp"
+
+/**
+ * @brief Where playback gets the time from and how it waits
+ * @note The player paces itself through this interface only, so the same pacing code runs against
+ * the wall clock when playing and against a VirtualClock when simulating.
+ */
+class PlaybackClock {
+    public:
+    virtual ~PlaybackClock() { }
+    virtual int64_t nowMicroseconds() = 0;
+    virtual void sleepFor(int64_t microseconds) = 0;
+
+    static PlaybackClock& wall();
+};
+
+class WallClock: public PlaybackClock {
+    public:
+    int64_t nowMicroseconds() override {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    void sleepFor(int64_t microseconds) override {
+        std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+    }
+};
+
+inline PlaybackClock& PlaybackClock::wall() {
+    static WallClock clock;
+    return clock;
+}
+
+/**
+ * @brief An audio device that consumes a CustomAudioSource in virtual time
+ * @note Every period it asks the source's instance for one period of audio, exactly like SoLoud's
+ * mixer would, and counts an underrun when the source holds less than that while playing. The
+ * heard position lags the consumed one by the device latency (two periods, like SDL).
+ */
+class SimulatedAudioDevice {
+    public:
+    SimulatedAudioDevice(CustomAudioSource& source, unsigned sampleRate, unsigned periodFrames)
+        : m_source(source), m_sampleRate(sampleRate), m_periodFrames(periodFrames),
+          m_buffer(static_cast<size_t>(periodFrames) * 2) { }
+
+    /**
+     * @brief Starts consuming at the next period boundary, like SoLoud::Soloud::play
+     */
+    void play(int64_t nowMicroseconds) {
+        if (m_instance) return;
+        m_instance.reset(m_source.createInstance());
+        m_nextPeriod = nowMicroseconds;
+    }
+    bool isPlaying() const { return m_instance != nullptr; }
+
+    /**
+     * @brief No more audio will be pushed, running dry from now on is the end and not an underrun
+     */
+    void setEndOfStream() { m_endOfStream = true; }
+
+    /**
+     * @brief Runs every period that starts at or before the given time
+     */
+    void runUntil(int64_t nowMicroseconds) {
+        if (!m_instance) return;
+        const int64_t periodUs = static_cast<int64_t>(m_periodFrames) * 1000000 / m_sampleRate;
+        while (m_nextPeriod <= nowMicroseconds) {
+            const size_t available = m_source.getBufferedSamples() / std::max(1u, m_source.mChannels);
+            if (available < m_periodFrames && !m_endOfStream) ++m_underruns;
+            m_framesPlayed += std::min<size_t>(available, m_periodFrames);
+
+            m_instance->getAudio(m_buffer.data(), m_periodFrames, m_periodFrames);
+            m_nextPeriod += periodUs;
+        }
+    }
+
+    /**
+     * @brief Media time being heard, silence inserted by underruns does not advance it
+     */
+    double getHeardSeconds() const {
+        const double latency = 2.0 * m_periodFrames / m_sampleRate;
+        return std::max(0.0, static_cast<double>(m_framesPlayed) / m_sampleRate - latency);
+    }
+    size_t getUnderruns() const { return m_underruns; }
+
+    private:
+    CustomAudioSource& m_source;
+    unsigned m_sampleRate;
+    unsigned m_periodFrames;
+    std::vector<float> m_buffer;
+    std::unique_ptr<SoLoud::AudioSourceInstance> m_instance;
+    int64_t m_nextPeriod = 0;
+    uint64_t m_framesPlayed = 0;
+    size_t m_underruns = 0;
+    bool m_endOfStream = false;
+};
+
+/**
+ * @brief Time that only moves when the player works or sleeps, so a run is the same every time
+ */
+class VirtualClock: public PlaybackClock {
+    public:
+    int64_t nowMicroseconds() override { return m_now; }
+    void sleepFor(int64_t microseconds) override { advance(microseconds); }
+
+    /**
+     * @brief Moves time forward, for work as well as sleep, the attached device plays along
+     */
+    void advance(int64_t microseconds) {
+        m_now += std::max<int64_t>(0, microseconds);
+        if (m_device) m_device->runUntil(m_now);
+    }
+    void advanceMs(double milliseconds) { advance(static_cast<int64_t>(std::llround(milliseconds * 1000.0))); }
+
+    void attach(SimulatedAudioDevice* device) { m_device = device; }
+
+    private:
+    int64_t m_now = 0;
+    SimulatedAudioDevice* m_device = nullptr;
+};
+
+/**
+ * @brief What a simulated run costs, what goes wrong during it and what it must achieve to pass
+ */
+struct SimulationConfig {
+    enum StallStage { DECODE, IO };
+
+    /**
+     * @brief Extra time spent once, on the first frame at or after a media time
+     */
+    struct Stall {
+        StallStage stage;
+        double atSeconds;
+        double milliseconds;
+        bool fired;
+    };
+
+    // per frame compute costs in milliseconds
+    double demuxMs = 0.2;
+    double decodeVideoMs = 4.0;
+    double decodeAudioMs = 0.5;
+    double convertMs = 0.1;
+    double uploadMs = 1.0;
+    double presentMs = 0.5;
+
+    unsigned periodFrames = 1024; // simulated device period
+    double refreshHz = 0.0;       // display refresh, 0 refreshes at the video frame rate
+    std::vector<Stall> stalls;
+    std::string csvPath;          // A/V offset over time, written when set
+
+    // release gates
+    double maxOffsetMs = 45.0;
+    size_t maxDropped = 0;
+    size_t maxDuplicated = 0;
+    size_t maxUnderruns = 0;
+
+    /**
+     * @brief Parses one option: video=, audio=, demux=, convert=, upload=, present= (ms per frame),
+     * period=, refresh=, decode@<s>=<ms>, io@<s>=<ms>, csv=<path>, max-offset=, max-dropped=,
+     * max-duplicated=, max-underruns=
+     * @return false if the option is not understood
+     */
+    bool parse(const char* option) {
+        double at = 0.0, value = 0.0;
+        if (sscanf(option, "decode@%lf=%lf", &at, &value) == 2) return addStall(DECODE, at, value);
+        if (sscanf(option, "io@%lf=%lf", &at, &value) == 2) return addStall(IO, at, value);
+        if (strncmp(option, "csv=", 4) == 0) {
+            csvPath = option + 4;
+            return !csvPath.empty();
+        }
+
+        const char* equals = strchr(option, '=');
+        if (!equals) return false;
+        const std::string key(option, equals - option);
+        char* end = nullptr;
+        value = std::strtod(equals + 1, &end);
+        if (end == equals + 1 || *end != '\0' || value < 0.0) return false;
+
+        if (key == "video") decodeVideoMs = value;
+        else if (key == "audio") decodeAudioMs = value;
+        else if (key == "demux") demuxMs = value;
+        else if (key == "convert") convertMs = value;
+        else if (key == "upload") uploadMs = value;
+        else if (key == "present") presentMs = value;
+        else if (key == "period" && value >= 1.0) periodFrames = static_cast<unsigned>(value);
+        else if (key == "refresh") refreshHz = value;
+        else if (key == "max-offset") maxOffsetMs = value;
+        else if (key == "max-dropped") maxDropped = static_cast<size_t>(value);
+        else if (key == "max-duplicated") maxDuplicated = static_cast<size_t>(value);
+        else if (key == "max-underruns") maxUnderruns = static_cast<size_t>(value);
+        else return false;
+        return true;
+    }
+
+    /**
+     * @brief Extra milliseconds for a stage at a media time, each stall fires once
+     */
+    double takeStall(StallStage stage, double mediaSeconds) {
+        double extra = 0.0;
+        for (Stall& stall : stalls) {
+            if (stall.stage == stage && !stall.fired && mediaSeconds >= stall.atSeconds) {
+                stall.fired = true;
+                extra += stall.milliseconds;
+            }
+        }
+        return extra;
+    }
+
+    private:
+    bool addStall(StallStage stage, double at, double milliseconds) {
+        if (at < 0.0 || milliseconds < 0.0) return false;
+        stalls.push_back({stage, at, milliseconds, false});
+        return true;
+    }
+};
+
+/**
+ * @brief Collects what a simulated run presented and heard, and judges it against the config's gates
+ */
+class PacingReport {
+    public:
+    /**
+     * @brief Records a new picture being presented
+     * @param heardSeconds Media time the audio device is playing at that moment, negative before audio starts
+     */
+    void presented(int64_t nowMicroseconds, double pictureSeconds, double heardSeconds) {
+        m_presents.push_back({nowMicroseconds, pictureSeconds});
+        if (heardSeconds >= 0.0) m_offsets.push_back({nowMicroseconds, (pictureSeconds - heardSeconds) * 1000.0});
+    }
+
+    /**
+     * @brief Replays the presents against a display refreshing at a fixed rate
+     * @note A picture replaced before any refresh showed it is dropped, a refresh that shows the
+     * same picture as the one before is a duplicate.
+     */
+    void finish(int64_t endMicroseconds, double refreshHz, size_t underruns) {
+        m_underruns = underruns;
+        m_end = endMicroseconds;
+        if (m_presents.empty() || refreshHz <= 0.0) return;
+
+        const double refreshUs = 1000000.0 / refreshHz;
+        std::vector<bool> shown(m_presents.size(), false);
+        long previous = -1;
+        size_t next = 0;
+        for (double tick = static_cast<double>(m_presents.front().time); tick <= endMicroseconds; tick += refreshUs) {
+            while (next < m_presents.size() && m_presents[next].time <= tick) ++next;
+            const long current = static_cast<long>(next) - 1;
+            if (current == previous) {
+                if (next < m_presents.size()) ++m_duplicated; // holding the last picture after the end is not a duplicate
+            } else {
+                shown[current] = true;
+            }
+            previous = current;
+        }
+        m_dropped = std::count(shown.begin(), shown.end(), false);
+    }
+
+    size_t getPresented() const { return m_presents.size(); }
+    size_t getDropped() const { return m_dropped; }
+    size_t getDuplicated() const { return m_duplicated; }
+    size_t getUnderruns() const { return m_underruns; }
+
+    double getMaxOffsetMs() const {
+        double worst = 0.0;
+        for (const Offset& offset : m_offsets) worst = std::max(worst, std::abs(offset.milliseconds));
+        return worst;
+    }
+    double getMeanOffsetMs() const {
+        double sum = 0.0;
+        for (const Offset& offset : m_offsets) sum += offset.milliseconds;
+        return m_offsets.empty() ? 0.0 : sum / m_offsets.size();
+    }
+
+    bool passes(const SimulationConfig& config) const {
+        return getMaxOffsetMs() <= config.maxOffsetMs && m_dropped <= config.maxDropped &&
+               m_duplicated <= config.maxDuplicated && m_underruns <= config.maxUnderruns;
+    }
+
+    /**
+     * @brief Prints the summary and the A/V offset once per simulated second
+     */
+    void print(std::ostream& out, const SimulationConfig& config) const {
+        out << "Simulated:      " << m_end / 1e6 << " s\n"
+            << "Frames:         " << m_presents.size() << " presented, " << m_dropped << " dropped, " << m_duplicated << " duplicated\n"
+            << "Underruns:      " << m_underruns << "\n"
+            << "A/V offset:     mean " << getMeanOffsetMs() << " ms, max " << getMaxOffsetMs() << " ms (video ahead is positive)\n";
+
+        int64_t nextSecond = 0;
+        for (const Offset& offset : m_offsets) {
+            if (offset.time < nextSecond) continue;
+            out << "  t=" << offset.time / 1000000 << " s  offset " << offset.milliseconds << " ms\n";
+            nextSecond = (offset.time / 1000000 + 1) * 1000000;
+        }
+
+        out << "Result:         " << (passes(config) ? "PASS" : "FAIL") << " (max offset " << config.maxOffsetMs << " ms, dropped "
+            << config.maxDropped << ", duplicated " << config.maxDuplicated << ", underruns " << config.maxUnderruns << ")" << std::endl;
+    }
+
+    bool writeCsv(const std::string& path) const {
+        std::ofstream file(path);
+        if (!file) return false;
+        file << "time_s,offset_ms\n";
+        for (const Offset& offset : m_offsets) file << offset.time / 1e6 << "," << offset.milliseconds << "\n";
+        return static_cast<bool>(file);
+    }
+
+    private:
+    struct Present {
+        int64_t time;
+        double picture;
+    };
+    struct Offset {
+        int64_t time;
+        double milliseconds;
+    };
+
+    std::vector<Present> m_presents;
+    std::vector<Offset> m_offsets;
+    size_t m_dropped = 0;
+    size_t m_duplicated = 0;
+    size_t m_underruns = 0;
+    int64_t m_end = 0;
+};
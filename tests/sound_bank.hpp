@@ -0,0 +1,79 @@
+#pragma once
+#include "../tests/async.hpp"
+
+#if defined(OPENAVMEDIA_ASYNC)
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+#include "../tests/flac_loader.hpp"
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Sound effects by id, loaded without blocking the caller, co_await bank.load(id)
+ * @note A load reads the file on the I/O pool, then decodes it from memory on the CPU pool, with
+ * Mix_LoadWAV_RW or, for FLAC, with a single-threaded FlacLoader: the pool already runs a load per
+ * core, splitting each file over more threads would only oversubscribe it. Every load has decoders
+ * of its own, so any number of them can run at once.
+ *
+ * Like Mix_LoadWAV, the chunks belong to the caller, free them with Mix_FreeChunk. The audio device
+ * must be open, chunks are converted to its format.
+ */
+class SoundBank {
+    public:
+    /**
+     * @param executors Where loads run, they must outlive every load
+     */
+    explicit SoundBank(async::Executors& executors): m_executors(executors) { }
+
+    /**
+     * @brief Registers a file under an id, call it before any load
+     */
+    void add(int id, const std::string& path) { m_paths[id] = path; }
+
+    const std::map<int, std::string>& getPaths() const { return m_paths; }
+
+    /**
+     * @brief Loads the sound registered under the id
+     * @return The chunk when OK, nullptr otherwise
+     */
+    async::Task<async::Result<Mix_Chunk*>> load(int id, async::CancellationToken token = {}) {
+        auto found = m_paths.find(id);
+        if (found == m_paths.end()) {
+            std::cerr << "No sound registered with ID " << id << std::endl;
+            co_return {async::Status::FAILED, nullptr};
+        }
+        const std::string path = found->second;
+
+        std::vector<Uint8> data;
+        co_await m_executors.io.schedule();
+        if (token.isCancelled()) co_return {async::Status::CANCELLED, nullptr};
+        if (!FlacLoader::readFile(path, data)) {
+            std::cerr << "Failed to read " << path << std::endl;
+            co_return {async::Status::FAILED, nullptr};
+        }
+
+        co_await m_executors.cpu.schedule();
+        if (token.isCancelled()) co_return {async::Status::CANCELLED, nullptr};
+
+        TRACE_SCOPE(DECODE_AUDIO, "SoundBank::load", id);
+        const bool isFlac = path.size() > 5 && path.compare(path.size() - 5, 5, ".flac") == 0;
+        Mix_Chunk* chunk = isFlac ? FlacLoader(1).loadChunk(std::move(data), path)
+                                  : Mix_LoadWAV_RW(SDL_RWFromConstMem(data.data(), static_cast<int>(data.size())), 1);
+        if (!chunk) {
+            std::cerr << "Failed to load " << path << ": " << Mix_GetError() << std::endl;
+            co_return {async::Status::FAILED, nullptr};
+        }
+        co_return {async::Status::OK, chunk};
+    }
+
+    private:
+    async::Executors& m_executors;
+    std::map<int, std::string> m_paths;
+};
+#endif
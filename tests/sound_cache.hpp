@@ -0,0 +1,176 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+#include "../tests/memory_budget.hpp"
+#include "../tests/submix.hpp"
+
+/**
+ * @brief Decoded sounds by id, kept resident within the SOUND_CACHE budget
+ * @note play() loads a sound that is not resident. To make room, the cache evicts the sounds played
+ * longest ago among those no voice is using, the graph counts the voices of every chunk it plays
+ * from here. When the sounds still playing leave no room, the new sound is freed again and play()
+ * fails, the budget is never exceeded. An evicted sound loads again the next time it plays.
+ *
+ * A sound's size is only known once it is decoded, so the first load of a sound decodes it before
+ * the cache knows whether it fits. Later loads make room for the size seen before they decode.
+ *
+ * Only call it from one thread, the one that posts to the graph.
+ */
+class SoundCache {
+    public:
+    typedef std::function<Mix_Chunk*(const std::string&)> Loader;
+
+    /**
+     * @param graph Where the sounds play, it must be stopped before the cache frees its chunks
+     * @param budget Holds the SOUND_CACHE category
+     * @param loader Decodes a file, returns nullptr on failure
+     */
+    SoundCache(SubmixGraph& graph, MemoryBudget& budget, Loader loader): m_graph(graph), m_budget(budget), m_loader(std::move(loader)) { }
+    ~SoundCache() {
+        clear();
+    }
+
+    SoundCache(const SoundCache&) = delete;
+    SoundCache& operator=(const SoundCache&) = delete;
+
+    /**
+     * @brief Registers a file under an id
+     */
+    void add(int id, const std::string& path) { m_entries[id].path = path; }
+
+    /**
+     * @brief Loads a sound ahead of its first play
+     * @return false if the file could not be loaded, a sound that does not fit is left for play() to retry
+     */
+    bool preload(int id) {
+        auto found = m_entries.find(id);
+        if (found == m_entries.end()) return false;
+        if (found->second.chunk) return true;
+        Mix_Chunk* chunk = load(found->second);
+        if (!chunk) return false;
+        adopt(id, found->second, chunk);
+        return true;
+    }
+
+    /**
+     * @brief Takes over a chunk loaded elsewhere, like SoundBank::load(), freeing it if it does not fit
+     */
+    void insert(int id, Mix_Chunk* chunk) {
+        Entry& entry = m_entries[id];
+        if (entry.chunk && entry.uses.load(std::memory_order_acquire) == 0) evict(entry);
+        if (entry.chunk) {
+            Mix_FreeChunk(chunk); // the resident copy is playing, keep it
+            return;
+        }
+        adopt(id, entry, chunk);
+    }
+
+    /**
+     * @brief Plays a sound through the graph, loading it first if it is not resident
+     * @param effects Optional chain for this voice alone, see SubmixGraph::play()
+     * @return The voice, or INVALID_VOICE if the sound could not be loaded, does not fit the budget or the graph's queue is full
+     */
+    SubmixGraph::VoiceHandle play(int id, int bus, float gain = 1.0f, float pan = 0.0f, int loops = 0, int delayMs = 0, int fadeInMs = 0, EffectChain* effects = nullptr) {
+        auto found = m_entries.find(id);
+        if (found == m_entries.end()) {
+            std::cerr << "No sound registered with ID " << id << std::endl;
+            return SubmixGraph::INVALID_VOICE;
+        }
+        Entry& entry = found->second;
+        if (entry.chunk) {
+            ++m_hits;
+        } else {
+            ++m_misses;
+            Mix_Chunk* chunk = load(entry);
+            if (!chunk || !adopt(id, entry, chunk)) return SubmixGraph::INVALID_VOICE;
+        }
+        entry.lastPlayed = ++m_clock;
+        return m_graph.play(entry.chunk, bus, gain, pan, loops, delayMs, fadeInMs, &entry.uses, effects);
+    }
+
+    /**
+     * @brief Frees every chunk, call it once the graph is stopped
+     */
+    void clear() {
+        for (auto& [_, entry] : m_entries) {
+            if (entry.chunk) evict(entry);
+        }
+    }
+
+    bool isResident(int id) const {
+        auto found = m_entries.find(id);
+        return found != m_entries.end() && found->second.chunk;
+    }
+
+    size_t getHits() const { return m_hits; }           // plays of a resident sound
+    size_t getMisses() const { return m_misses; }       // plays that had to load first
+    size_t getEvictions() const { return m_evictions; }
+
+    private:
+    struct Entry {
+        std::string path;
+        Mix_Chunk* chunk = nullptr;
+        size_t bytes = 0;          // accounted while resident, remembered after an eviction
+        Uint64 lastPlayed = 0;
+        std::atomic<int> uses{0};  // voices queued or playing, decremented by the audio thread
+    };
+
+    static size_t getChunkBytes(const Mix_Chunk* chunk) { return sizeof(Mix_Chunk) + chunk->alen; }
+
+    Mix_Chunk* load(Entry& entry) {
+        if (entry.bytes) {
+            while (m_budget.getHeadroom(MemoryBudget::SOUND_CACHE) < entry.bytes && evictOldest(&entry)) { }
+        }
+        return m_loader(entry.path);
+    }
+
+    bool adopt(int id, Entry& entry, Mix_Chunk* chunk) {
+        const size_t bytes = getChunkBytes(chunk);
+        while (!m_budget.tryReserve(MemoryBudget::SOUND_CACHE, bytes)) {
+            if (!evictOldest(&entry)) {
+                std::cerr << "Sound " << id << " (" << bytes << " bytes) does not fit the sound cache budget" << std::endl;
+                Mix_FreeChunk(chunk);
+                entry.bytes = bytes;
+                return false;
+            }
+        }
+        entry.chunk = chunk;
+        entry.bytes = bytes;
+        return true;
+    }
+
+    bool evictOldest(const Entry* keep) {
+        Entry* oldest = nullptr;
+        for (auto& [_, entry] : m_entries) {
+            if (&entry == keep || !entry.chunk || entry.uses.load(std::memory_order_acquire) != 0) continue;
+            if (!oldest || entry.lastPlayed < oldest->lastPlayed) oldest = &entry;
+        }
+        if (!oldest) return false;
+        evict(*oldest);
+        ++m_evictions;
+        return true;
+    }
+
+    void evict(Entry& entry) {
+        Mix_FreeChunk(entry.chunk);
+        entry.chunk = nullptr;
+        m_budget.release(MemoryBudget::SOUND_CACHE, entry.bytes);
+    }
+
+    SubmixGraph& m_graph;
+    MemoryBudget& m_budget;
+    Loader m_loader;
+    std::map<int, Entry> m_entries; // map nodes never move, the graph holds pointers to their counters
+    Uint64 m_clock = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    size_t m_evictions = 0;
+};
@@ -0,0 +1,444 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <SDL_mixer/SDL_mixer.h>
+
+#include "../tests/simd.hpp"
+#include "../tests/effects.hpp"
+#include "../tests/mixer_commands.hpp"
+
+/**
+ * @brief Submix graph: voices mix into category buses, buses mix into their parent and finally the master
+ * @note The graph renders itself through SDL_mixer's music hook, so plain SDL_mixer channels keep
+ * working on top of it. Each voice carries its own gain and pan and only ever reads its Mix_Chunk,
+ * so any number of voices can play the same chunk at different volumes. Buses carry a gain and a
+ * list of AudioEffects (see effects.hpp), which is where ducking, filtering and limiting happen.
+ * A single voice can also run through its own EffectChain before it reaches its bus.
+ *
+ * Every block is rendered in one pass: each voice is accumulated into its bus with a gain ramp
+ * (simd::accumulate), then each bus is processed and accumulated into its parent the same way.
+ * Game threads control the graph through the same lock-free queue MixerFrontEnd uses.
+ */
+class SubmixGraph {
+    public:
+    typedef uint32_t VoiceHandle;
+
+    static const int MASTER = 0;
+    static const int MAX_BUSES = 16;
+    static const int MAX_VOICES = 64;
+    static const size_t MAX_BLOCK_FRAMES = 1024;
+    static const VoiceHandle INVALID_VOICE = 0;
+
+    SubmixGraph() {
+        m_buses.push_back(std::make_unique<Bus>("master", -1));
+        m_pending.reserve(QUEUE_CAPACITY);
+    }
+    ~SubmixGraph() {
+        stop();
+    }
+
+    /**
+     * @brief Adds a bus, only call before start()
+     * @param name Shown in diagnostics
+     * @param parent The bus this one mixes into, it must already exist
+     * @return The new bus' index, or -1 if there are too many buses
+     */
+    int addBus(const char* name, int parent = MASTER) {
+        if (m_buses.size() >= MAX_BUSES || parent < 0 || parent >= static_cast<int>(m_buses.size())) return -1;
+        m_buses.push_back(std::make_unique<Bus>(name, parent));
+        return static_cast<int>(m_buses.size()) - 1;
+    }
+
+    /**
+     * @brief Adds an effect to the end of a bus' effect list, only call before start()
+     */
+    template <typename Effect, typename... Args>
+    Effect* addBusEffect(int bus, Args&&... args) {
+        m_buses[bus]->effects.push_back(std::make_unique<Effect>(std::forward<Args>(args)...));
+        return static_cast<Effect*>(m_buses[bus]->effects.back().get());
+    }
+
+    /**
+     * @brief Starts rendering through SDL_mixer's music hook, call with the mixer open
+     * @return false if the mixer is not open or uses a format the graph cannot write
+     */
+    bool start() {
+        int frequency, channels;
+        Uint16 format;
+        if (Mix_QuerySpec(&frequency, &format, &channels) == 0) return false;
+
+        m_isFloat = SDL_AUDIO_ISFLOAT(format) && SDL_AUDIO_BITSIZE(format) == 32;
+        const bool isS16 = !SDL_AUDIO_ISFLOAT(format) && SDL_AUDIO_BITSIZE(format) == 16;
+        if ((!m_isFloat && !isS16) || channels < 1 || channels > AudioEffect::MAX_CHANNELS) return false;
+
+        m_sampleRate = frequency;
+        m_channels = channels;
+        m_sampleBytes = m_isFloat ? sizeof(float) : sizeof(int16_t);
+        for (auto& bus : m_buses) {
+            for (auto& effect : bus->effects) effect->prepare(m_sampleRate);
+        }
+
+        Mix_HookMusic(&SubmixGraph::render, this);
+        m_started = true;
+        return true;
+    }
+
+    void stop() {
+        if (m_started) {
+            Mix_HookMusic(nullptr, nullptr);
+            m_started = false;
+            for (auto& bus : m_buses) {
+                for (auto& effect : bus->effects) effect->reset();
+            }
+        }
+    }
+
+    // These are safe to call from any thread.
+
+    /**
+     * @brief Starts a voice on a bus
+     * @param chunk Loaded sound, it is only read so it may be shared by many voices
+     * @param bus Index returned by addBus()
+     * @param gain Linear voice gain, 1.0 plays the chunk as loaded
+     * @param pan -1.0 is hard left, 0.0 centered, 1.0 hard right
+     * @param loops Extra times to play, -1 loops forever
+     * @param delayMs Delay before the voice starts
+     * @param fadeInMs Length of a fade in from silence, 0 starts at full gain
+     * @param chunkUses When set, counts this voice from now until it ends or is dropped, so a cache
+     * knows the chunk may only be freed once the counter is back to zero
+     * @param effects When set, the voice runs through this chain before its bus. The chain keeps
+     * per-voice state, so give it to one voice at a time and prepare() it first. Its effects are
+     * reset when the voice ends.
+     * @return Handle for later changes, or INVALID_VOICE if the command queue is full
+     */
+    VoiceHandle play(Mix_Chunk* chunk, int bus, float gain = 1.0f, float pan = 0.0f, int loops = 0, int delayMs = 0, int fadeInMs = 0, std::atomic<int>* chunkUses = nullptr, EffectChain* effects = nullptr) {
+        const VoiceHandle handle = m_nextHandle.fetch_add(1, std::memory_order_relaxed);
+        GraphCommand command = {GraphCommand::PLAY, handle, chunk, bus, gain, pan, loops, msToFrames(fadeInMs), dueFrame(delayMs), chunkUses, effects};
+        if (chunkUses) chunkUses->fetch_add(1, std::memory_order_relaxed);
+        if (post(command)) return handle;
+        if (chunkUses) chunkUses->fetch_sub(1, std::memory_order_release);
+        return INVALID_VOICE;
+    }
+    bool stopVoice(VoiceHandle voice, int fadeOutMs = 0, int delayMs = 0) {
+        return post({GraphCommand::STOP, voice, nullptr, 0, 0.0f, 0.0f, 0, msToFrames(fadeOutMs), dueFrame(delayMs), nullptr});
+    }
+    bool setVoiceGain(VoiceHandle voice, float gain, int delayMs = 0) {
+        return post({GraphCommand::GAIN, voice, nullptr, 0, gain, 0.0f, 0, 0, dueFrame(delayMs), nullptr});
+    }
+    bool setVoicePan(VoiceHandle voice, float pan, int delayMs = 0) {
+        return post({GraphCommand::PAN, voice, nullptr, 0, 0.0f, pan, 0, 0, dueFrame(delayMs), nullptr});
+    }
+
+    /**
+     * @brief Sets a bus' gain, it glides to the new value over the next blocks
+     */
+    void setBusGain(int bus, float gain) {
+        if (bus >= 0 && bus < static_cast<int>(m_buses.size())) m_buses[bus]->gain.set(gain);
+    }
+    float getBusGain(int bus) const { return m_buses[bus]->gain.get(); }
+
+    const char* getBusName(int bus) const { return m_buses[bus]->name.c_str(); }
+    int getBusCount() const { return static_cast<int>(m_buses.size()); }
+    const std::vector<std::unique_ptr<AudioEffect>>& getBusEffects(int bus) const { return m_buses[bus]->effects; }
+    int getSampleRate() const { return m_sampleRate; }
+    int getActiveVoiceCount() const { return m_activeVoices.load(std::memory_order_relaxed); }
+    size_t getDroppedCount() const { return m_dropped.load(std::memory_order_relaxed); } // queue, pending list or voice pool was full
+
+    private:
+    static const size_t QUEUE_CAPACITY = 4096;
+
+    struct GraphCommand {
+        enum Type { PLAY, STOP, GAIN, PAN };
+
+        Type type;
+        VoiceHandle voice;
+        Mix_Chunk* chunk;
+        int bus;
+        float gain;
+        float pan;
+        int loops;
+        Uint64 fadeFrames; // fade in for PLAY, fade out for STOP
+        Uint64 dueFrame;
+        std::atomic<int>* chunkUses; // PLAY only, see play()
+        EffectChain* effects = nullptr; // PLAY only
+    };
+
+    struct Voice {
+        VoiceHandle handle = INVALID_VOICE; // INVALID_VOICE marks a free slot
+        Mix_Chunk* chunk = nullptr;
+        std::atomic<int>* chunkUses = nullptr;
+        EffectChain* effects = nullptr; // run on the voice alone, before it is mixed into its bus
+        int bus = MASTER;
+        Uint64 position = 0;  // next frame to read from the chunk
+        int loops = 0;
+        float gain = 1.0f, targetGain = 1.0f;
+        float pan = 0.0f;
+        float fade = 1.0f;    // fade envelope, multiplied into the gain
+        float fadeStep = 0.0f; // change in fade per frame, negative when fading out
+        bool stopAtSilence = false;
+    };
+
+    struct Bus {
+        Bus(const char* busName, int busParent): name(busName), parent(busParent), gain(1.0f) { }
+
+        std::string name;
+        int parent;
+        SmoothedParameter gain;
+        std::vector<std::unique_ptr<AudioEffect>> effects;
+        float buffer[AudioEffect::MAX_CHANNELS][MAX_BLOCK_FRAMES];
+    };
+
+    bool post(const GraphCommand& command) {
+        if (m_commands.push(command)) return true;
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Uint64 msToFrames(int ms) const {
+        return (ms > 0) ? static_cast<Uint64>(ms) * m_sampleRate / 1000 : 0;
+    }
+
+    Uint64 dueFrame(int delayMs) const {
+        return m_renderedFrames.load(std::memory_order_relaxed) + msToFrames(delayMs);
+    }
+
+    static void SDLCALL render(void* udata, Uint8* stream, int len) {
+        SubmixGraph* self = static_cast<SubmixGraph*>(udata);
+        const size_t totalFrames = len / (self->m_sampleBytes * self->m_channels);
+
+        for (size_t offset = 0; offset < totalFrames; offset += MAX_BLOCK_FRAMES) {
+            const size_t frames = std::min(MAX_BLOCK_FRAMES, totalFrames - offset);
+            self->drain(self->m_renderedFrames.load(std::memory_order_relaxed));
+            self->renderBlock(stream + offset * self->m_channels * self->m_sampleBytes, frames);
+            self->m_renderedFrames.fetch_add(frames, std::memory_order_relaxed);
+        }
+    }
+
+    void drain(Uint64 now) {
+        // delayed commands that are now due, in their posted order
+        size_t kept = 0;
+        for (size_t i = 0; i < m_pending.size(); ++i) {
+            if (m_pending[i].dueFrame <= now) {
+                execute(m_pending[i]);
+            } else {
+                m_pending[kept++] = m_pending[i];
+            }
+        }
+        m_pending.resize(kept);
+
+        // then this block's new commands in one batch
+        GraphCommand command;
+        while (m_commands.pop(command)) {
+            if (command.dueFrame <= now) {
+                execute(command);
+            } else if (m_pending.size() < m_pending.capacity()) {
+                m_pending.push_back(command);
+            } else {
+                drop(command);
+            }
+        }
+    }
+
+    void execute(const GraphCommand& command) {
+        if (command.type == GraphCommand::PLAY) {
+            Voice* voice = findVoice(INVALID_VOICE); // a free slot
+            if (!voice || !command.chunk || command.bus < 0 || command.bus >= static_cast<int>(m_buses.size())) {
+                drop(command);
+                return;
+            }
+
+            *voice = Voice();
+            voice->handle = command.voice;
+            voice->chunk = command.chunk;
+            voice->chunkUses = command.chunkUses;
+            voice->effects = command.effects;
+            voice->bus = command.bus;
+            voice->loops = command.loops;
+            voice->gain = voice->targetGain = command.gain;
+            voice->pan = command.pan;
+            voice->fade = (command.fadeFrames > 0) ? 0.0f : 1.0f;
+            voice->fadeStep = (command.fadeFrames > 0) ? 1.0f / command.fadeFrames : 0.0f;
+            m_activeVoices.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        Voice* voice = findVoice(command.voice);
+        if (!voice) return; // it already finished
+
+        switch (command.type) {
+            case GraphCommand::STOP:
+                if (command.fadeFrames == 0) {
+                    EffectChain* effects = voice->effects;
+                    release(*voice);
+                    resetEffects(effects);
+                } else {
+                    voice->fadeStep = -voice->fade / command.fadeFrames;
+                    voice->stopAtSilence = true;
+                }
+                break;
+            case GraphCommand::GAIN:
+                voice->targetGain = command.gain; // glides over the next block
+                break;
+            case GraphCommand::PAN:
+                voice->pan = std::clamp(command.pan, -1.0f, 1.0f);
+                break;
+            default:
+                break;
+        }
+    }
+
+    Voice* findVoice(VoiceHandle handle) {
+        for (Voice& voice : m_voices) {
+            if (voice.handle == handle) return &voice;
+        }
+        return nullptr;
+    }
+
+    void drop(const GraphCommand& command) {
+        if (command.chunkUses) command.chunkUses->fetch_sub(1, std::memory_order_release);
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(Voice& voice) {
+        voice.handle = INVALID_VOICE;
+        voice.chunk = nullptr;
+        if (voice.chunkUses) voice.chunkUses->fetch_sub(1, std::memory_order_release); // after the last read of the chunk
+        voice.chunkUses = nullptr;
+        voice.effects = nullptr; // the caller resets them once they have run for the last time
+        m_activeVoices.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static void resetEffects(EffectChain* effects) {
+        if (!effects) return;
+        for (auto& effect : effects->getEffects()) effect->reset(); // the next voice on the chain starts silent
+    }
+
+    void renderBlock(Uint8* out, size_t frames) {
+        for (auto& bus : m_buses) {
+            for (int c = 0; c < m_channels; ++c) std::memset(bus->buffer[c], 0, frames * sizeof(float));
+        }
+
+        // every voice into its bus...
+        for (Voice& voice : m_voices) {
+            if (voice.handle != INVALID_VOICE) renderVoice(voice, frames);
+        }
+
+        // ...every bus through its effects and into its parent, children always come after their parent...
+        for (int b = static_cast<int>(m_buses.size()) - 1; b > MASTER; --b) {
+            Bus& bus = *m_buses[b];
+            float* channels[AudioEffect::MAX_CHANNELS];
+            for (int c = 0; c < m_channels; ++c) channels[c] = bus.buffer[c];
+            for (auto& effect : bus.effects) effect->run(channels, m_channels, frames, m_sampleRate);
+
+            const auto [from, to] = bus.gain.advance(frames, m_sampleRate);
+            for (int c = 0; c < m_channels; ++c) simd::accumulate(m_buses[bus.parent]->buffer[c], bus.buffer[c], frames, from, to);
+        }
+
+        // ...then the master bus into the device's format
+        Bus& master = *m_buses[MASTER];
+        float* channels[AudioEffect::MAX_CHANNELS];
+        for (int c = 0; c < m_channels; ++c) channels[c] = master.buffer[c];
+        for (auto& effect : master.effects) effect->run(channels, m_channels, frames, m_sampleRate);
+        const auto [from, to] = master.gain.advance(frames, m_sampleRate);
+
+        float* interleaved = m_isFloat ? reinterpret_cast<float*>(out) : m_scratch;
+        for (int c = 0; c < m_channels; ++c) {
+            simd::ramp(master.buffer[c], frames, from, to);
+            for (size_t i = 0; i < frames; ++i) interleaved[i * m_channels + c] = master.buffer[c][i];
+        }
+        if (!m_isFloat) simd::floatToS16(m_scratch, reinterpret_cast<int16_t*>(out), frames * m_channels);
+    }
+
+    void renderVoice(Voice& voice, size_t frames) {
+        const Uint64 chunkFrames = voice.chunk->alen / (m_sampleBytes * m_channels);
+        Bus& bus = *m_buses[voice.bus];
+        EffectChain* effects = voice.effects; // release() clears it when the voice ends mid block
+
+        // a voice with its own effects is gathered on its own first, the rest go straight into the bus
+        float* target[AudioEffect::MAX_CHANNELS];
+        for (int c = 0; c < m_channels; ++c) {
+            target[c] = effects ? m_voiceBuffer[c] : bus.buffer[c];
+            if (effects) std::memset(m_voiceBuffer[c], 0, frames * sizeof(float));
+        }
+
+        // constant power pan, only meaningful for stereo output
+        const float angle = (voice.pan + 1.0f) * 0.25f * 3.14159265f;
+        const float panGain[2] = {(m_channels >= 2) ? std::cos(angle) * 1.41421356f : 1.0f, (m_channels >= 2) ? std::sin(angle) * 1.41421356f : 1.0f};
+
+        size_t done = 0;
+        while (done < frames && voice.handle != INVALID_VOICE) {
+            if (voice.position >= chunkFrames) { // end of the chunk, loop or finish
+                if (voice.loops == 0 || chunkFrames == 0) {
+                    release(voice);
+                    break;
+                }
+                if (voice.loops > 0) --voice.loops;
+                voice.position = 0;
+            }
+
+            const size_t count = static_cast<size_t>(std::min<Uint64>(frames - done, chunkFrames - voice.position));
+            const size_t samples = count * m_channels;
+
+            // read the chunk into floats without touching it
+            const Uint8* source = voice.chunk->abuf + voice.position * m_sampleBytes * m_channels;
+            if (m_isFloat) {
+                std::memcpy(m_scratch, source, samples * sizeof(float));
+            } else {
+                simd::s16ToFloat(reinterpret_cast<const int16_t*>(source), m_scratch, samples);
+            }
+
+            // gain ramp for this segment: voice gain gliding to its target, times the fade envelope
+            const float fadeEnd = std::clamp(voice.fade + voice.fadeStep * count, 0.0f, 1.0f);
+            const float gainEnd = voice.gain + (voice.targetGain - voice.gain) * (static_cast<float>(count) / frames);
+            for (int c = 0; c < m_channels; ++c) {
+                for (size_t i = 0; i < count; ++i) m_voice[i] = m_scratch[i * m_channels + c];
+                const float pan = panGain[c < 2 ? c : 1];
+                simd::accumulate(target[c] + done, m_voice, count, voice.gain * voice.fade * pan, gainEnd * fadeEnd * pan);
+            }
+
+            voice.gain = gainEnd;
+            voice.fade = fadeEnd;
+            voice.position += count;
+            done += count;
+
+            if (voice.stopAtSilence && voice.fade <= 0.0f) release(voice);
+            else if (voice.fade >= 1.0f && voice.fadeStep > 0.0f) voice.fadeStep = 0.0f; // fade in finished
+        }
+
+        if (voice.handle != INVALID_VOICE) voice.gain = voice.targetGain;
+
+        if (effects) {
+            for (auto& effect : effects->getEffects()) effect->run(target, m_channels, frames, m_sampleRate);
+            for (int c = 0; c < m_channels; ++c) simd::accumulate(bus.buffer[c], m_voiceBuffer[c], frames, 1.0f, 1.0f);
+            if (voice.handle == INVALID_VOICE) resetEffects(effects);
+        }
+    }
+
+    BoundedMPSCQueue<GraphCommand, QUEUE_CAPACITY> m_commands;
+    std::vector<GraphCommand> m_pending; // delayed commands, only touched by the audio thread
+    std::vector<std::unique_ptr<Bus>> m_buses; // only added to before start()
+    Voice m_voices[MAX_VOICES];
+
+    std::atomic<VoiceHandle> m_nextHandle{1};
+    std::atomic<Uint64> m_renderedFrames{0};
+    std::atomic<int> m_activeVoices{0};
+    std::atomic<size_t> m_dropped{0};
+
+    int m_sampleRate = 44100;
+    int m_channels = 2;
+    size_t m_sampleBytes = sizeof(int16_t);
+    bool m_isFloat = false;
+    bool m_started = false;
+    float m_scratch[MAX_BLOCK_FRAMES * AudioEffect::MAX_CHANNELS];
+    float m_voice[MAX_BLOCK_FRAMES];
+    float m_voiceBuffer[AudioEffect::MAX_CHANNELS][MAX_BLOCK_FRAMES]; // one voice before its own effects
+};
@@ -1,3 +1,4 @@
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <fstream>
@@ -9,6 +10,12 @@
 #include "simplewebm/OpusVorbisDecoder.hpp"
 #include "simplewebm/VPXDecoder.hpp"
 
+#include "../tests/resampler.hpp"
+#include "../tests/low_latency.hpp"
+#include "../tests/memory_budget.hpp"
+
+const int MIXER_SAMPLE_RATE = 48000; // one global mixer rate, media is resampled to it instead of reopening the device
+
 /**
  * @brief Matroska parser class inherited from WebM library
  * @note WebM containers are a derivative of Matroska
@@ -95,11 +102,51 @@ void SDLCALL audio_callback([[maybe_unused]] void *userdata, Uint8 *stream, int
     //DEBUG: std::cout << "Callback #" << callbackCount << " - Position: " << (void*)audio_playback_pos << " - Remaining: " << audio_remaining_len << std::endl;
 }
 
+// STREAMING CALLBACK, used instead when a PCM budget is set
+void SDLCALL ring_callback(void *userdata, Uint8 *stream, int len) {
+    PcmRing* ring = static_cast<PcmRing*>(userdata);
+    const size_t bytes = ring->read(reinterpret_cast<short*>(stream), len / sizeof(short)) * sizeof(short);
+    SDL_memset(stream + bytes, '\0', len - bytes); // silence where the decoder has not caught up
+}
+
+/**
+ * @brief Decodes audio into the ring until the ring is full or the file ends
+ * @param resampled Decoded samples at the device's rate, the ones from pendingOffset on did not fit
+ * into the ring yet and are written first. Its capacity must hold one decoded packet.
+ * @param flushed Set once the file has ended and the resampler's last frames were pushed out
+ * @return false on a decoding error
+ */
+bool fill_ring(PcmRing& ring, WebMDemuxer& demuxer, WebMFrame& audioFrame, OpusVorbisDecoder& decoder, PolyphaseResampler& resampler,
+               short* pcm, std::vector<short>& resampled, size_t& pendingOffset, bool& flushed) {
+    while (true) {
+        pendingOffset += ring.write(resampled.data() + pendingOffset, resampled.size() - pendingOffset);
+        if (pendingOffset < resampled.size()) return true; // full, the callback has to play some first
+
+        resampled.clear();
+        pendingOffset = 0;
+        if (!demuxer.readFrame(NULL, &audioFrame)) { // the end of the file
+            if (flushed) return true;
+            flushed = true;
+            if (decoder.isOpen()) resampler.flushS16(resampled); // the filter still holds the last few frames
+            continue;
+        }
+        if (!decoder.isOpen() || !audioFrame.isValid()) continue;
+
+        int numOutSamples;
+        if (!decoder.getPCMS16(audioFrame, pcm, numOutSamples)) {
+            std::cerr << "Failed to decode audio frame." << std::endl;
+            return false;
+        }
+        resampler.processS16(pcm, numOutSamples, resampled);
+    }
+}
+
 // MAIN
 int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     // sanity check
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <file_path>.webm" << std::endl;
+    const bool low_latency = (argc == 3) && strcmp(argv[2], "--low-latency") == 0;
+    if (argc != 2 && !low_latency) {
+        std::cerr << "Usage: " << argv[0] << " <file_path>.webm [--low-latency]" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -117,30 +164,52 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    // make audio device with the specification we want and we WILL get
+    // a PCM budget, e.g. OPENAVMEDIA_MEMORY_BUDGET=pcm=256K, streams the track through a queue that
+    // fits it instead of decoding the whole track up front
+    MemoryBudget budget;
+    if (!budget.configureFromEnvironment()) {
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
+    const bool streaming = budget.getLimit(MemoryBudget::PCM) != MemoryBudget::UNLIMITED;
+    PcmRing ring;
+
+    // make audio device with the specification we want, the frequency may change to whatever the device prefers
     std::vector<short> audioBuffer;
-    SDL_AudioSpec want;
+    SDL_AudioSpec want, have;
     SDL_memset(&want, 0, sizeof(want));
 
-    want.freq = demuxer.getSampleRate();   // match media's sample rate
+    want.freq = MIXER_SAMPLE_RATE;         // the global mixer rate, NOT the media's sample rate
     want.format = AUDIO_S16;               // libsimplewebm always returns signed 16-bit audio
     want.channels = demuxer.getChannels(); // match media's channel count
     want.samples = 4096;                   // 4096 is a good size for most standard applications 
-    want.callback = audio_callback;        // function for consuming audio data
-    want.userdata = &audioBuffer;          // audio data to consume
-
-    SDL_AudioDeviceID audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);// zero in 4th param makes the spec mandatory
-    if (audioDevice == 0) {
+    want.callback = streaming ? ring_callback : audio_callback; // function for consuming audio data
+    want.userdata = streaming ? static_cast<void*>(&ring) : static_cast<void*>(&audioBuffer); // audio data to consume
+
+    // low latency mode: small periods, measured, backing off to larger periods if the device underruns
+    LowLatencyOutput::Config lowLatencyConfig;
+    lowLatencyConfig.freq = want.freq;
+    lowLatencyConfig.format = want.format;
+    lowLatencyConfig.channels = want.channels;
+    LowLatencyOutput lowLatencyOutput(want.callback, want.userdata, lowLatencyConfig);
+
+    SDL_AudioDeviceID audioDevice = 0;
+    if (low_latency) {
+        if (lowLatencyOutput.open()) have = lowLatencyOutput.getSpec();
+    } else {
+        audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE); // only the frequency may differ
+    }
+    if (audioDevice == 0 && !lowLatencyOutput.getDevice()) {
         std::cerr << "SDL audio bootstrapping failed: " << SDL_GetError() << std::endl;
         SDL_Quit();
         return EXIT_FAILURE;
     }
 
     // After opening the audio device, check what specifications we actually got
-    std::cout << "format:    " << want.format << std::endl;
-    std::cout << "frequency: " << want.freq << std::endl;
-    std::cout << "channels:  " << static_cast<int>(want.channels) << std::endl;
-    std::cout << "samples:   " << want.samples << std::endl;
+    std::cout << "format:    " << have.format << std::endl;
+    std::cout << "frequency: " << have.freq << " (media: " << demuxer.getSampleRate() << ")" << std::endl;
+    std::cout << "channels:  " << static_cast<int>(have.channels) << std::endl;
+    std::cout << "samples:   " << have.samples << std::endl;
 
 // ------------------------------------------------------------------------------------------------
 
@@ -148,29 +217,60 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     // all initialization is done, now we must decode the audio from the webm file
     OpusVorbisDecoder preAudioDec(demuxer);
     WebMFrame audioFrame;
+    PolyphaseResampler resampler(static_cast<int>(demuxer.getSampleRate()), have.freq, demuxer.getChannels(), PolyphaseResampler::BEST);
 
     short *pcm = new short[preAudioDec.getBufferSamples() * demuxer.getChannels()];
-    
-    while (demuxer.readFrame(NULL, &audioFrame)) {
+    std::vector<short> resampled;
+    size_t pendingOffset = 0;
+    bool flushed = false;
+
+    if (streaming) {
+        // one decoded packet waits in resampled until it fits, the queue gets the rest of the budget
+        const size_t packetSamples = (static_cast<size_t>(preAudioDec.getBufferSamples()) * have.freq / static_cast<size_t>(demuxer.getSampleRate()) + 16) * demuxer.getChannels();
+        const size_t ringSamples = (budget.getLimit(MemoryBudget::PCM) / sizeof(short) - std::min(packetSamples, budget.getLimit(MemoryBudget::PCM) / sizeof(short))) / demuxer.getChannels() * demuxer.getChannels();
+        // the low latency fallback can double the period up to maxPeriodFrames, every one of them must fit in the queue
+        const size_t periodFrames = low_latency ? std::max<size_t>(have.samples, lowLatencyConfig.maxPeriodFrames) : have.samples;
+        if (!budget.tryReserve(MemoryBudget::PCM, packetSamples * sizeof(short)) || ringSamples < periodFrames * demuxer.getChannels() || !ring.allocate(ringSamples, budget)) {
+            std::cerr << "The PCM budget must hold one decoded packet and the largest device period, at least "
+                      << (packetSamples + periodFrames * demuxer.getChannels()) * sizeof(short) << " bytes" << std::endl;
+            delete[] pcm;
+            SDL_CloseAudioDevice(audioDevice);
+            lowLatencyOutput.close();
+            SDL_Quit();
+            return EXIT_FAILURE;
+        }
+        resampled.reserve(packetSamples);
+
+        if (!fill_ring(ring, demuxer, audioFrame, preAudioDec, resampler, pcm, resampled, pendingOffset, flushed)) {
+            delete[] pcm;
+            SDL_CloseAudioDevice(audioDevice);
+            lowLatencyOutput.close();
+            SDL_Quit();
+            return EXIT_FAILURE;
+        }
+        std::cout << "Streaming through a " << ringSamples * sizeof(short) << " byte queue ("
+                  << 1000.0 * ringSamples / demuxer.getChannels() / have.freq << " ms)" << std::endl;
+    }
+
+    while (!streaming && demuxer.readFrame(NULL, &audioFrame)) {
         if (preAudioDec.isOpen() && audioFrame.isValid()) {
             // suck up all the audio data
             int numOutSamples;
             if (!preAudioDec.getPCMS16(audioFrame, pcm, numOutSamples)) {
                 std::cerr << "Failed to decode audio frame." << std::endl;
                 SDL_CloseAudioDevice(audioDevice);
+                lowLatencyOutput.close();
                 SDL_Quit();
                 return EXIT_FAILURE;
             }
 
-            // and put it in the audioBuffer vector
-            for (int i = 0; i < (numOutSamples * demuxer.getChannels()); i++) {
-                audioBuffer.push_back(pcm[i]);
-            }
+            // and put it in the audioBuffer vector at the device's rate
+            resampler.processS16(pcm, numOutSamples, audioBuffer);
         }
     }
+    if (!streaming) resampler.flushS16(audioBuffer); // the filter still holds the last few frames
+    if (!streaming) budget.reserve(MemoryBudget::PCM, audioBuffer.capacity() * sizeof(short)); // the whole track, accounted for the report
 
-    delete[] pcm;
-    
     /*
     // DEBUG: print out the audiobuffer so it can be checked/loaded in Audacity
     std::ofstream outFile("output_audio.raw", std::ios::binary);
@@ -184,22 +284,28 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     */
 
     // setup global playback parameters
-    audio_playback_pos = (Uint8*)(audioBuffer.data());        // playback will start from the beginning of the buffer
-    audio_remaining_len = audioBuffer.size() * sizeof(short); // remaining bytes to play
+    if (!streaming) {
+        audio_playback_pos = (Uint8*)(audioBuffer.data());        // playback will start from the beginning of the buffer
+        audio_remaining_len = audioBuffer.size() * sizeof(short); // remaining bytes to play
 
-    std::cout << "Playback starting from:  " << static_cast<void*>(audio_playback_pos) << std::endl;
-    std::cout << "Uncompressed audio size: " << audio_remaining_len << " bytes" << std::endl;
-    
-    // Calculate and print the duration
-    double duration = calculateDuration(audioBuffer, demuxer.getSampleRate(), demuxer.getChannels());
-    std::cout << "Expected audio duration: " << duration << " seconds" << std::endl;
+        std::cout << "Playback starting from:  " << static_cast<void*>(audio_playback_pos) << std::endl;
+        std::cout << "Uncompressed audio size: " << audio_remaining_len << " bytes" << std::endl;
+
+        // Calculate and print the duration
+        double duration = calculateDuration(audioBuffer, have.freq, demuxer.getChannels());
+        std::cout << "Expected audio duration: " << duration << " seconds" << std::endl;
+    }
 
 
 // ------------------------------------------------------------------------------------------------
 
 
     // start playing
-    SDL_PauseAudioDevice(audioDevice, 0);
+    if (low_latency) {
+        lowLatencyOutput.pause(false);
+    } else {
+        SDL_PauseAudioDevice(audioDevice, 0);
+    }
 
     // main loop
     bool is_user_quitting = false;
@@ -212,11 +318,23 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
             }
         }
 
-        SDL_Delay(100);  // simulates work
+        if (low_latency) lowLatencyOutput.update(); // falls back to larger periods if it keeps underrunning
+
+        // top the queue up, it only holds what the budget allows
+        if (streaming && !fill_ring(ring, demuxer, audioFrame, preAudioDec, resampler, pcm, resampled, pendingOffset, flushed)) break;
+
+        SDL_Delay(streaming ? 10 : 100);  // simulates work
     }
 
     // clean up
-    SDL_CloseAudioDevice(audioDevice);
+    budget.print(std::cout);
+    delete[] pcm;
+    if (low_latency) {
+        lowLatencyOutput.printReport(std::cout);
+        lowLatencyOutput.close();
+    } else {
+        SDL_CloseAudioDevice(audioDevice);
+    }
     SDL_Quit();
 
     return EXIT_SUCCESS;
@@ -19,6 +19,15 @@
 #include "simplewebm/VPXDecoder.hpp"
 
 #include "../tests/test5.hpp"
+#include "../tests/resampler.hpp"
+#include "../tests/trace.hpp"
+#include "../tests/trick_play.hpp"
+#include "../tests/playlist.hpp"
+#include "../tests/progressive.hpp"
+#include "../tests/simulator.hpp"
+#include "../tests/alpha_video.hpp"
+#include "../tests/async_media.hpp"
+#include "../tests/frame_history.hpp"
 
 /**
  * @brief This namespace contains a few SDL specific functions that are custom made for handling graphics.
@@ -60,6 +69,45 @@ namespace sdl {
         return 0;
     }
 
+    /**
+     * @brief Replaces the YUV texture with one of another size, for a clip whose video is not the size of the one before
+     */
+    Uint32 resize_yuv_texture(Uint32 width, Uint32 height, SDL_Renderer*& renderer, SDL_Texture*& texture) {
+        SDL_DestroyTexture(texture);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (texture == nullptr) {
+            std::cerr << "Failed to create texture: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Replaces the YUV texture with an RGBA one for video with an alpha channel
+     * @note The pixels are premultiplied, so the texture blends as color + background * (1 - alpha).
+     * Renderers without custom blend modes fall back to plain blending, which darkens soft edges.
+     */
+    Uint32 use_premultiplied_rgba_texture(Uint32 width, Uint32 height, SDL_Renderer*& renderer, SDL_Texture*& texture) {
+        SDL_DestroyTexture(texture);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (texture == nullptr) {
+            std::cerr << "Failed to create RGBA texture: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+
+        const SDL_BlendMode premultiplied = SDL_ComposeCustomBlendMode(
+            SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+            SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+        if (SDL_SetTextureBlendMode(texture, premultiplied) != 0) {
+            std::cerr << "Premultiplied blending is not supported, using plain alpha blending: " << SDL_GetError() << std::endl;
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        }
+
+        // a grey background makes the transparent parts visible
+        SDL_SetRenderDrawColor(renderer, 64, 64, 64, 255);
+        return 0;
+    }
+
     Uint32 shutdown_sdl_window(SDL_Window*& window, SDL_Renderer*& renderer, SDL_Texture*& texture) {
         SDL_DestroyTexture(texture);
         SDL_DestroyRenderer(renderer);
@@ -179,6 +227,19 @@ int32_t update_frames_per_second(float time_delta) {
     return -1; // A negative 1 is returned until ready to provide a frame count update
 }
 
+/**
+ * @brief Reads the next video and audio frames, recorded as the demux stage when tracing
+ * @param demuxer The demultiplexer to read from
+ * @param videoFrame Receives the next video frame
+ * @param audioFrame Receives the next audio frame
+ * @param frameIndex Index of the loop iteration, used to tie trace events to a frame
+ * @return false once the end of the file is reached
+ */
+bool read_frames(WebMDemuxer& demuxer, WebMFrame* videoFrame, WebMFrame* audioFrame, [[maybe_unused]] int64_t frameIndex) {
+    TRACE_SCOPE(DEMUX, "readFrame", frameIndex);
+    return demuxer.readFrame(videoFrame, audioFrame);
+}
+
 /**
  * @brief Gets the frame count that the webm file was encoded with
  * @param filePath The file path of the webm file
@@ -243,13 +304,18 @@ uint32_t webm_frame_rate(const char* filePath, double& rate) {
 }
 
 const int MILLISECONDS_IN_A_SECOND = 1000;
+const unsigned int MIXER_SAMPLE_RATE = 48000; // one global mixer rate for every stream, media is resampled to it
+const double HISTORY_SECONDS = 5.0;           // played frames kept decoded for stepping back and instant replay
+const size_t HISTORY_BYTES = 128u << 20;      // pictures are kept at a lower resolution when the seconds do not fit
+const double PCM_QUEUE_SECONDS = 2.0;         // audio decoded ahead of the mixer when there is no PCM budget
+const unsigned int LOW_LATENCY_BUFFER_FRAMES = 256; // SoLoud's mixer period with --low-latency, about 5 ms at the mixer rate
 
 /**
  * @brief The purpose of this class is to ensure that a loop iterates a target number of times.
  */
 class FrameRegulator {
     public:
-    FrameRegulator(int target_fps) {
+    FrameRegulator(int target_fps, PlaybackClock& clock = PlaybackClock::wall()): m_clock(clock) {
         targetFPS(target_fps);
 
         m_targetFrameDuration = std::round(MILLISECONDS_IN_A_SECOND / target_fps);
@@ -257,31 +323,1012 @@ class FrameRegulator {
     ~FrameRegulator() { };
 
     void start() {
-        m_frameStart = std::chrono::steady_clock::now();
+        m_frameStart = m_clock.nowMicroseconds();
+        ++m_frameIndex;
     }
     void stop() {
-        m_frameTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_frameStart).count();
+        m_frameTime = (m_clock.nowMicroseconds() - m_frameStart) / 1000;
     }
     void delay() {
         //DEBUG: std::cout << "Waiting..." << (m_targetFrameDuration - m_frameTime) << " ms because " << m_frameTime << " ms have passed" << std::endl;
         if (m_frameTime < m_targetFrameDuration) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(m_targetFrameDuration - m_frameTime));
+            m_clock.sleepFor((m_targetFrameDuration - m_frameTime) * 1000);
         } else {
-            std::cerr << "Warning: Running a little slow. No waiting was required this frame/iteration." << std::endl;
+            TRACE_INSTANT(PACING, "running slow", m_frameIndex);
+            TRACE_COUNTER(PACING, "slow frame ms", m_frameTime);
+            if (m_warnings) std::cerr << "Warning: Running a little slow. No waiting was required this frame/iteration." << std::endl;
         }
     }
 
+    void setWarnings(bool warnings) {
+        m_warnings = warnings;
+    }
+
     void targetFPS(int target_fps) {
         m_targetFPS = target_fps;
     }
 
     private:
-    std::chrono::_V2::steady_clock::time_point m_frameStart; // start time of the frame
-    std::chrono::milliseconds::rep m_frameTime;              // elapsed time between the start() and stop(), the frame processing time
+    PlaybackClock& m_clock;         // wall clock when playing, a virtual clock when simulating
+    int64_t m_frameStart;           // start time of the frame in microseconds
+    int64_t m_frameTime;            // elapsed milliseconds between the start() and stop(), the frame processing time
+    int64_t m_frameIndex = 0;       // counts start() calls, matches the loops' frame_index in trace events
+    bool m_warnings = true;         // warn when running slow
     int m_targetFPS;                // target number of frames-per-second
     int64_t m_targetFrameDuration; // duration in milliseconds
 };
 
+/**
+ * @brief Where FramePlayer's frames go: the window and SoLoud when playing, a simulated device when simulating
+ * @note Every hook runs on the playback thread. charge() is called as each stage starts, so a
+ * simulation can make the stage take its configured time, it does nothing when playing.
+ */
+class PlaybackOutput {
+    public:
+    enum Stage { DEMUX, DECODE_VIDEO, UPLOAD, DECODE_AUDIO, CONVERT, PRESENT };
+    enum Input { NONE, RESUMED, QUIT }; // RESUMED: playback was paused since the last call, that time is not playback time
+
+    virtual ~PlaybackOutput() { }
+
+    virtual void charge([[maybe_unused]] Stage stage, [[maybe_unused]] double mediaSeconds) { }
+    virtual Input poll() { return NONE; }         // once per frame, before decoding
+    virtual Input waitForAudio() { return NONE; } // between 1 ms sleeps while the PCM budget is full
+    virtual bool showPicture(const VPXDecoder::Image& image) = 0;
+    virtual bool showRgba(const std::vector<uint8_t>& rgba, int width, int height) = 0;
+    virtual void startAudio(double mediaSeconds) = 0; // after every push, starts the source if it is not playing
+    virtual void present(bool hasNewPicture, double pictureSeconds) = 0;
+};
+
+/**
+ * @brief Plays a file one frame at a time: demux, decode, push the audio and pace
+ * @note main and the simulator both play through this class, only their PlaybackOutput and
+ * PlaybackClock differ. The playback position is read from the clock, so the pacing rule is the
+ * same against the wall clock and against a VirtualClock. Decoders, the audio source, the history
+ * and the budget belong to the caller.
+ */
+class FramePlayer {
+    public:
+    enum Status { PLAYING, FINISHED, QUIT, FAILED };
+
+    FramePlayer(WebMDemuxer& demuxer, VPXDecoder& videoDec, OpusVorbisDecoder& audioDec, AlphaVideoDecoder* alphaVideo, BlockAdditionalReader* alphaReader,
+                CustomAudioSource& source, FrameHistory& history, MemoryBudget& budget, double frame_rate, PlaybackClock& clock = PlaybackClock::wall())
+        : m_demuxer(demuxer), m_videoDec(videoDec), m_audioDec(audioDec), m_alphaVideo(alphaVideo), m_alphaReader(alphaReader),
+          m_source(source), m_history(history), m_budget(budget), m_clock(clock), m_regulator(frame_rate, clock),
+          m_resampler(static_cast<int>(demuxer.getSampleRate()), source.mBaseSamplerate, demuxer.getChannels(), PolyphaseResampler::BEST),
+          m_pcm(audioDec.isOpen() ? audioDec.getBufferSamples() * demuxer.getChannels() : 0),
+          m_last(clock.nowMicroseconds()) { }
+    ~FramePlayer() { };
+
+    /**
+     * @brief Reads, decodes and shows the next frame, then waits until the next one is due
+     * @return PLAYING while there are frames left, otherwise why playback stopped
+     */
+    Status playFrame(PlaybackOutput& output) {
+        output.charge(PlaybackOutput::DEMUX, std::max(m_videoFrame.time, m_audioFrame.time));
+        if (!read_frames(m_demuxer, &m_videoFrame, &m_audioFrame, m_frameIndex)) {
+            if (m_audioDec.isOpen()) {
+                // the resampler still holds the last few frames
+                m_resampled.clear();
+                m_resampler.flushS16(m_resampled);
+                if (pushAudio(output) == QUIT) return QUIT;
+            }
+            return FINISHED;
+        }
+        m_regulator.start(); // consider this the start of the frame
+        ++m_frameIndex;
+        m_budget.track(MemoryBudget::DEMUX, m_demuxBytes, static_cast<size_t>(m_videoFrame.bufferCapacity + m_audioFrame.bufferCapacity + m_alphaFrame.bufferCapacity));
+
+        const PlaybackOutput::Input input = output.poll();
+        if (input == PlaybackOutput::QUIT) return QUIT;
+        if (input == PlaybackOutput::RESUMED) m_last = m_clock.nowMicroseconds();
+
+        // update the playback position
+        const int64_t now = m_clock.nowMicroseconds();
+        m_deltaMs = (now - m_last) / 1000.0f;
+        m_position += (now - m_last) / 1e6;
+        m_last = now;
+
+        // decode the video frame and put its pictures into the output
+        bool has_new_picture = false;
+        if (m_videoDec.isOpen() && m_videoFrame.isValid()) {
+            output.charge(PlaybackOutput::DECODE_VIDEO, m_videoFrame.time);
+            bool decoded;
+            {
+                TRACE_SCOPE(DECODE_VIDEO, "VPXDecoder::decode", m_frameIndex);
+                if (m_alphaVideo) {
+                    m_alphaReader->read(m_videoFrame.time, &m_alphaFrame);
+                    decoded = m_alphaVideo->decode(m_videoFrame, m_alphaFrame); // both streams at once
+                } else {
+                    decoded = m_videoDec.decode(m_videoFrame);
+                }
+            }
+            if (!decoded) {
+                std::cerr << "Failed to decode video frame at " << m_videoFrame.time << " s" << std::endl;
+                return FAILED;
+            }
+
+            int rgba_width = 0, rgba_height = 0;
+            while (m_alphaVideo && m_alphaVideo->getImage(m_rgba, rgba_width, rgba_height)) {
+                if (rgba_width != m_demuxer.getWidth() || rgba_height != m_demuxer.getHeight()) continue; // the texture has the track's size
+
+                output.charge(PlaybackOutput::UPLOAD, m_videoFrame.time);
+                TRACE_SCOPE(UPLOAD, "SDL_UpdateTexture", m_frameIndex);
+                if (!output.showRgba(m_rgba, rgba_width, rgba_height)) return FAILED;
+                has_new_picture = true;
+            }
+            if (m_alphaVideo) m_budget.track(MemoryBudget::VIDEO_FRAMES, m_frameBytes, m_rgba.capacity());
+
+            while (!m_alphaVideo && m_videoDec.getImage(m_image) == VPXDecoder::NO_ERROR) {
+                output.charge(PlaybackOutput::UPLOAD, m_videoFrame.time);
+                {
+                    TRACE_SCOPE(UPLOAD, "SDL_UpdateYUVTexture", m_frameIndex);
+                    if (!output.showPicture(m_image)) return FAILED;
+                }
+                has_new_picture = true;
+                if (!m_history.addPicture(m_image, m_videoFrame.time)) TRACE_INSTANT(CONVERT, "history full", m_frameIndex);
+            }
+        }
+
+        // decode the audio frame, convert it to the mixer's rate and push it into the source
+        if (m_audioDec.isOpen() && m_audioFrame.isValid()) {
+            output.charge(PlaybackOutput::DECODE_AUDIO, m_audioFrame.time);
+            int numOutSamples;
+            bool decoded;
+            {
+                TRACE_SCOPE(DECODE_AUDIO, "OpusVorbisDecoder::getPCMS16", m_frameIndex);
+                decoded = m_audioDec.getPCMS16(m_audioFrame, m_pcm.data(), numOutSamples);
+            }
+            if (!decoded) {
+                std::cerr << "Failed to decode audio frame at " << m_audioFrame.time << " s" << std::endl;
+                return FAILED;
+            }
+
+            output.charge(PlaybackOutput::CONVERT, m_audioFrame.time);
+            {
+                TRACE_SCOPE(CONVERT, "resample", m_frameIndex);
+                m_resampled.clear();
+                m_resampler.processS16(m_pcm.data(), numOutSamples, m_resampled);
+            }
+
+            if (pushAudio(output) == QUIT) return QUIT;
+            output.startAudio(m_audioFrame.time);
+        }
+
+        output.charge(PlaybackOutput::PRESENT, m_videoFrame.time);
+        {
+            TRACE_SCOPE(PRESENT, "present", m_frameIndex);
+            output.present(has_new_picture, m_videoFrame.time);
+        }
+
+        m_regulator.stop(); // consider this the end of the frame
+
+        // pace the video by performing...
+        if (m_videoFrame.time < m_position) {
+            // ...no operation (nop) anytime the video is running behind
+        } else {
+            // ...or adding delays to ensure its playback speed matches the goal frame rate when running ahead
+            m_regulator.delay();
+        }
+        return PLAYING;
+    }
+
+    void setWarnings(bool warnings) { m_regulator.setWarnings(warnings); }
+    float getDeltaMs() const { return m_deltaMs; } // time between the last two frames
+
+    private:
+    /**
+     * @brief Pushes m_resampled into the source and the history
+     * @note Throttles decoding while the buffered audio fills the PCM budget, the mixer drains it meanwhile.
+     * @return QUIT if the user quit while waiting, otherwise PLAYING
+     */
+    Status pushAudio(PlaybackOutput& output) {
+        while (!m_source.push(m_resampled)) {
+            TRACE_SCOPE(PACING, "PCM budget wait", m_frameIndex);
+            m_clock.sleepFor(1000);
+            const PlaybackOutput::Input waited = output.waitForAudio();
+            if (waited == PlaybackOutput::QUIT) return QUIT;
+            if (waited == PlaybackOutput::RESUMED) m_last = m_clock.nowMicroseconds();
+        }
+        m_history.addAudio(m_resampled);
+        TRACE_COUNTER(BUFFER_LEVEL, "audioBuffer samples", m_source.getBufferedSamples());
+        return PLAYING;
+    }
+
+    WebMDemuxer& m_demuxer;
+    VPXDecoder& m_videoDec;
+    OpusVorbisDecoder& m_audioDec;
+    AlphaVideoDecoder* m_alphaVideo;       // decodes both streams instead of m_videoDec when the video has alpha
+    BlockAdditionalReader* m_alphaReader;  // the alpha stream's frames, only with m_alphaVideo
+    CustomAudioSource& m_source;
+    FrameHistory& m_history;
+    MemoryBudget& m_budget;
+    PlaybackClock& m_clock;
+    FrameRegulator m_regulator;
+
+    PolyphaseResampler m_resampler;   // converts the decoded audio to the mixer's rate, a no-op when they already match
+    std::vector<short> m_pcm;         // one decoded packet
+    std::vector<short> m_resampled;   // the same packet at the mixer's rate
+    WebMFrame m_videoFrame, m_audioFrame, m_alphaFrame;
+    VPXDecoder::Image m_image;
+    std::vector<uint8_t> m_rgba;      // premultiplied RGBA picture when the video has alpha
+    size_t m_demuxBytes = 0;          // held by the demuxer's frames
+    size_t m_frameBytes = 0;          // held by the RGBA picture
+
+    int64_t m_frameIndex = 0;         // counts frames, ties trace events to a frame
+    int64_t m_last;                   // clock time of the previous frame in microseconds
+    double m_position = 0.0;          // playback position in seconds, pauses excluded
+    float m_deltaMs = 0.0f;
+};
+
+/**
+ * @brief Creates the history of the last seconds played, within the video frame budget
+ */
+std::unique_ptr<FrameHistory> create_history(MemoryBudget& budget, double frame_rate, int width, int height) {
+    const size_t history_bytes = std::min(HISTORY_BYTES, budget.getHeadroom(MemoryBudget::VIDEO_FRAMES));
+    const size_t history_frames = static_cast<size_t>(HISTORY_SECONDS * frame_rate);
+    return std::make_unique<FrameHistory>(budget, history_frames, history_bytes, FrameHistory::chooseDownscale(width, height, history_frames, history_bytes));
+}
+
+/**
+ * @brief Allocates the audio source's queue out of the PCM budget, the way test3 sizes its ring
+ * @note FramePlayer holds one decoded packet while the queue is full, the queue gets the rest of the
+ * budget, or PCM_QUEUE_SECONDS when there is no PCM budget. It must hold a whole packet and one
+ * mixer period, or decoding would wait for room that never comes.
+ * @param source The audio source, its channels, rate and budget already set
+ * @param budget The budget the queue is taken from, the same as source.budget
+ * @param audioDec The audio decoder, its buffer holds the largest packet
+ * @param media_rate Sample rate of the decoded audio, before it is resampled to the source's rate
+ * @param period_frames Frames the mixer reads at once
+ * @return Zero upon success, otherwise a nonzero error code.
+ */
+uint32_t allocate_audio_queue(CustomAudioSource& source, MemoryBudget& budget, const OpusVorbisDecoder& audioDec, double media_rate, unsigned period_frames) {
+    const size_t channels = source.mChannels;
+    const size_t packet_samples = audioDec.isOpen() ? (static_cast<size_t>(audioDec.getBufferSamples() * source.mBaseSamplerate / media_rate) + 16) * channels : 0;
+    const size_t minimum_samples = std::max(packet_samples, static_cast<size_t>(period_frames) * channels);
+
+    const size_t limit_samples = budget.getLimit(MemoryBudget::PCM) / sizeof(short);
+    size_t queue_samples = static_cast<size_t>(PCM_QUEUE_SECONDS * source.mBaseSamplerate) * channels;
+    if (limit_samples == MemoryBudget::UNLIMITED) queue_samples = std::max(queue_samples, minimum_samples);
+    else queue_samples = (limit_samples - std::min(packet_samples, limit_samples)) / channels * channels;
+
+    if (queue_samples < minimum_samples || !source.allocate(queue_samples)) {
+        std::cerr << "Error: The PCM budget must hold one decoded packet and one mixer period, at least "
+                  << (packet_samples + minimum_samples) * sizeof(short) << " bytes." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief FramePlayer's output for a simulated run
+ * @note Every stage advances the virtual clock by its configured cost plus any stall injected at
+ * that media time. Nothing is drawn, the audio goes to a SimulatedAudioDevice.
+ */
+class SimulatedOutput: public PlaybackOutput {
+    public:
+    SimulatedOutput(VirtualClock& clock, SimulatedAudioDevice& device, SimulationConfig& config, PacingReport& report)
+        : m_clock(clock), m_device(device), m_config(config), m_report(report) { }
+
+    void charge(Stage stage, double mediaSeconds) override {
+        switch (stage) {
+            case DEMUX:        m_clock.advanceMs(m_config.demuxMs + m_config.takeStall(SimulationConfig::IO, mediaSeconds)); break;
+            case DECODE_VIDEO: m_clock.advanceMs(m_config.decodeVideoMs + m_config.takeStall(SimulationConfig::DECODE, mediaSeconds)); break;
+            case UPLOAD:       m_clock.advanceMs(m_config.uploadMs); break;
+            case DECODE_AUDIO: m_clock.advanceMs(m_config.decodeAudioMs); break;
+            case CONVERT:      m_clock.advanceMs(m_config.convertMs); break;
+            case PRESENT:      m_clock.advanceMs(m_config.presentMs); break;
+        }
+    }
+
+    bool showPicture([[maybe_unused]] const VPXDecoder::Image& image) override { return true; }
+    bool showRgba([[maybe_unused]] const std::vector<uint8_t>& rgba, [[maybe_unused]] int width, [[maybe_unused]] int height) override { return true; }
+
+    void startAudio(double mediaSeconds) override {
+        if (m_audioStart < 0.0) m_audioStart = mediaSeconds;
+        m_device.play(m_clock.nowMicroseconds());
+    }
+
+    void present(bool hasNewPicture, double pictureSeconds) override {
+        if (hasNewPicture) {
+            m_report.presented(m_clock.nowMicroseconds(), pictureSeconds, m_device.isPlaying() ? m_audioStart + m_device.getHeardSeconds() : -1.0);
+        }
+    }
+
+    private:
+    VirtualClock& m_clock;
+    SimulatedAudioDevice& m_device;
+    SimulationConfig& m_config;
+    PacingReport& m_report;
+    double m_audioStart = -1.0; // media time of the first audio frame, where the device starts playing
+};
+
+/**
+ * @brief Plays the file against a virtual clock and a simulated audio device, as fast as it decodes
+ * @note It plays through main's FramePlayer, so demuxing, decoding, resampling, the PCM budget,
+ * the history and the pacing rule are main's. Only the window and SoLoud's device are replaced,
+ * and every stage advances the virtual clock by its configured cost instead of the time it really
+ * took, so a run gives the same report on any machine.
+ * @param demuxer The demultiplexer to read from
+ * @param frame_rate The video's frame rate
+ * @param alphaReader The alpha stream's frames when the video has alpha, otherwise nullptr
+ * @param config Costs, injected stalls and the gates the run must pass
+ * @return Zero if the run passed every gate, otherwise a nonzero error code.
+ */
+uint32_t simulate_playback(WebMDemuxer& demuxer, double frame_rate, BlockAdditionalReader* alphaReader, SimulationConfig& config) {
+    MemoryBudget budget; // the same budgets as playback, e.g. OPENAVMEDIA_MEMORY_BUDGET=pcm=512K
+    if (!budget.configureFromEnvironment()) return 1;
+
+    VirtualClock clock;
+    CustomAudioSource customSource;
+    customSource.mChannels = demuxer.getChannels();
+    customSource.mBaseSamplerate = MIXER_SAMPLE_RATE;
+    customSource.budget = &budget;
+    SimulatedAudioDevice device(customSource, MIXER_SAMPLE_RATE, config.periodFrames);
+    clock.attach(&device);
+
+    VPXDecoder videoDec(demuxer, 8);
+    OpusVorbisDecoder audioDec(demuxer);
+    std::unique_ptr<VPXDecoder> alphaDec = alphaReader ? std::make_unique<VPXDecoder>(demuxer, 8) : nullptr;
+    std::unique_ptr<AlphaVideoDecoder> alphaVideo = alphaReader ? std::make_unique<AlphaVideoDecoder>(videoDec, *alphaDec) : nullptr;
+    std::unique_ptr<FrameHistory> history = create_history(budget, frame_rate, demuxer.getWidth(), demuxer.getHeight());
+    if (allocate_audio_queue(customSource, budget, audioDec, demuxer.getSampleRate(), config.periodFrames) != 0) return 1;
+
+    PacingReport report;
+    SimulatedOutput output(clock, device, config, report);
+    FramePlayer player(demuxer, videoDec, audioDec, alphaVideo.get(), alphaReader, customSource, *history, budget, frame_rate, clock);
+    player.setWarnings(false);
+    const auto wall_start = std::chrono::steady_clock::now();
+
+    FramePlayer::Status status;
+    while ((status = player.playFrame(output)) == FramePlayer::PLAYING) { }
+    if (status == FramePlayer::FAILED) return 2;
+
+    // let the device play out what is left
+    device.setEndOfStream();
+    const int64_t drained = clock.nowMicroseconds() + static_cast<int64_t>(customSource.getBufferedSamples() / customSource.mChannels * 1e6 / MIXER_SAMPLE_RATE) + 1000000;
+    while (customSource.getBufferedSamples() != 0 && clock.nowMicroseconds() < drained) clock.advance(1000);
+
+    const double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    report.finish(clock.nowMicroseconds(), (config.refreshHz > 0.0) ? config.refreshHz : frame_rate, device.getUnderruns());
+    report.print(std::cout, config);
+    std::cout << "Wall time:      " << wall_seconds << " s (" << clock.nowMicroseconds() / 1e6 / std::max(wall_seconds, 1e-6) << "x realtime)" << std::endl;
+
+    if (!config.csvPath.empty() && !report.writeCsv(config.csvPath)) {
+        std::cerr << "Failed to write " << config.csvPath << std::endl;
+    }
+    return report.passes(config) ? 0 : 3;
+}
+
+/**
+ * @brief Scrubs through the video showing keyframes only, audio is neither read nor decoded
+ * @param filePath The file path of the webm file
+ * @param rate Scrub rate, 2 to 64 times realtime, negative rates rewind from the end
+ * @param frame_rate Rate the scrubbed pictures are presented at
+ * @param videoDec Decoder for the video track
+ * @param renderer Renderer to present with
+ * @param texture Texture to upload the decoded pictures to
+ * @return Zero upon success, otherwise a nonzero error code.
+ */
+uint32_t trick_play(const char* filePath, double rate, double frame_rate, VPXDecoder& videoDec, SDL_Renderer*& renderer, SDL_Texture*& texture) {
+    MkvReader reader(filePath);
+    KeyframeDemuxer keyframes(&reader);
+    if (!keyframes.isOpen() || !videoDec.isOpen()) {
+        std::cerr << "Failed to index keyframes in " << filePath << std::endl;
+        return 1;
+    }
+    keyframes.setRate(rate);
+    if (keyframes.getRate() < 0.0) keyframes.seek(keyframes.getDuration()); // rewind from the end
+
+    std::cout << "Trick Play:   " << keyframes.getRate() << "x over " << keyframes.getKeyframeCount() << " keyframes" << std::endl;
+
+    FrameRegulator frameRegulator(frame_rate);
+    WebMFrame videoFrame;
+    VPXDecoder::Image image;
+    SDL_Event e;
+    auto last = std::chrono::steady_clock::now();
+    int64_t frame_index = 0;
+
+    while (!keyframes.isFinished()) {
+        frameRegulator.start();
+        ++frame_index;
+
+        SDL_PollEvent(&e);
+        if (sdl::handle_sdl_events(&e)) break;
+
+        // only decode when a different keyframe is due, otherwise the last picture stays up
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - last).count();
+        last = now;
+        if (keyframes.readKeyframe(elapsed, &videoFrame)) {
+            bool decoded;
+            {
+                TRACE_SCOPE(DECODE_VIDEO, "VPXDecoder::decode keyframe", frame_index);
+                decoded = videoDec.decode(videoFrame);
+            }
+            if (!decoded) {
+                std::cerr << "Failed to decode keyframe at " << videoFrame.time << " s" << std::endl;
+                return 2;
+            }
+            while (videoDec.getImage(image) == VPXDecoder::NO_ERROR) {
+                TRACE_SCOPE(UPLOAD, "SDL_UpdateYUVTexture", frame_index);
+                if (SDL_UpdateYUVTexture(texture, NULL, image.planes[0], image.linesize[0], image.planes[1], image.linesize[1], image.planes[2], image.linesize[2]) == -1) {
+                    std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
+                    return 3;
+                }
+            }
+        }
+
+        {
+            TRACE_SCOPE(PRESENT, "present", frame_index);
+            sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+        }
+
+        frameRegulator.stop();
+        frameRegulator.delay();
+    }
+
+    std::cout << "Keyframes decoded: " << keyframes.getKeyframesRead() << " of " << keyframes.getKeyframeCount()
+        << ", payload read: " << keyframes.getBytesRead() << " bytes" << std::endl;
+    return 0;
+}
+
+/**
+ * @brief Pushes decoded audio into the source, waiting while its queue is full
+ * @note For the players that are paced by their video alone, their queue holds PCM_QUEUE_SECONDS,
+ * so this only waits when decoding has run that far ahead of the mixer.
+ */
+void push_audio(CustomAudioSource& source, const std::vector<short>& samples) {
+    while (!source.push(samples)) {
+        TRACE_SCOPE(PACING, "PCM queue wait", 0);
+        SDL_Delay(1);
+    }
+}
+
+/**
+ * @brief Plays several clips back to back without a gap, the return key branches to the next clip at once
+ * @param files The clips in playing order
+ * @param loop Loops the last clip when true
+ * @param channels Channel count every clip's audio is mapped to
+ * @param frame_rate Rate the video is presented at
+ * @param renderer Renderer to present with
+ * @param texture Texture to upload the decoded pictures to, recreated when a clip is another size
+ * @return Zero upon success, otherwise a nonzero error code.
+ */
+uint32_t play_playlist(const std::vector<std::string>& files, bool loop, int channels, double frame_rate, DecoderPool& decoderPool, SDL_Renderer*& renderer, SDL_Texture*& texture) {
+    // one SoLoud voice plays every clip, the scheduler keeps its buffer fed across switches
+    CustomAudioSource customSource;
+    SoLoud::Soloud& soloud = SharedAudioEngine::get(MIXER_SAMPLE_RATE);
+    customSource.mChannels = channels;
+    customSource.mBaseSamplerate = soloud.mSamplerate;
+    customSource.allocate(static_cast<size_t>(PCM_QUEUE_SECONDS * soloud.mSamplerate) * customSource.mChannels); // no PCM budget here, a fixed queue
+    SoLoud::handle soundHandle = 0;
+
+    ClipScheduler<MkvReader> scheduler(soloud.mSamplerate, channels, 8, &decoderPool);
+    if (!scheduler.open(files[0])) return 1;
+    for (size_t i = 1; i < files.size(); ++i) scheduler.append(files[i]);
+    scheduler.setLoop(loop);
+    size_t branch_target = 1 % files.size();
+    scheduler.preload(files[branch_target]); // so the return key never waits for a pre-roll, nothing to do when it is the clip queued next
+    int texture_width = 0, texture_height = 0;
+    SDL_QueryTexture(texture, NULL, NULL, &texture_width, &texture_height);
+
+    FrameRegulator frameRegulator(frame_rate);
+    ClipScheduler<MkvReader>::Frame frame;
+    std::vector<short> audio;
+    SDL_Event e;
+    const auto start = std::chrono::steady_clock::now();
+    int64_t frame_index = 0;
+
+    while (scheduler.readFrame(frame, audio)) {
+        frameRegulator.start();
+        ++frame_index;
+
+        if (SDL_PollEvent(&e)) {
+            if (sdl::handle_sdl_events(&e)) break;
+            if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_RETURN) { // branch, cut at the next frame
+                scheduler.branch(files[branch_target]);
+                branch_target = (branch_target + 1) % files.size();
+                scheduler.preload(files[branch_target]);
+            }
+        }
+
+        if (frame.switched) {
+            std::cout << "Now playing: " << scheduler.getCurrentPath() << std::endl;
+            if (scheduler.getWidth() != texture_width || scheduler.getHeight() != texture_height) {
+                texture_width = scheduler.getWidth();
+                texture_height = scheduler.getHeight();
+                if (sdl::resize_yuv_texture(texture_width, texture_height, renderer, texture) != 0) return 2;
+            }
+        }
+
+        if (frame.hasPicture) {
+            TRACE_SCOPE(UPLOAD, "SDL_UpdateYUVTexture", frame_index);
+            if (SDL_UpdateYUVTexture(texture, NULL, frame.image.planes[0], frame.image.linesize[0], frame.image.planes[1], frame.image.linesize[1], frame.image.planes[2], frame.image.linesize[2]) == -1) {
+                std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
+                return 2;
+            }
+        }
+
+        if (!audio.empty()) {
+            push_audio(customSource, audio);
+            audio.clear();
+            if (!soloud.isValidVoiceHandle(soundHandle) || !soloud.getVoiceCount()) {
+                soundHandle = soloud.play(customSource);
+            }
+        }
+
+        if (frame.hasPicture) {
+            TRACE_SCOPE(PRESENT, "present", frame_index);
+            sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+        }
+
+        frameRegulator.stop();
+
+        // pace by the playlist's timeline, it keeps running across clip switches
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (frame.hasPicture && frame.time >= elapsed) frameRegulator.delay();
+    }
+
+    std::cout << "Clip switches: " << scheduler.getSwitchCount() << ", late: " << scheduler.getLateSwitchCount() << std::endl;
+    soloud.stopAudioSource(customSource);
+    return 0;
+}
+
+/**
+ * @brief Plays a file that is still being written, pausing to buffer whenever playback catches up with the writer
+ * @param filePath The file being written, it does not even need to exist yet
+ * @param buffer_seconds Media that must be on disk ahead of the playback position before playing starts or resumes
+ * @param expected_size Final size of the file in bytes if known, otherwise -1
+ * @param stall_timeout_ms How long the writer may pause before playback gives up, 0 waits forever
+ * @return Zero upon success, otherwise a nonzero error code.
+ */
+uint32_t play_progressive(const char* filePath, double buffer_seconds, long long expected_size, int stall_timeout_ms) {
+    GrowingFileReader reader(filePath, expected_size);
+    reader.setStallTimeout(stall_timeout_ms);
+    ProgressiveDemuxer demuxer(&reader);
+
+    // wait for the headers to be written
+    ProgressiveDemuxer::Status status;
+    while ((status = demuxer.open()) == ProgressiveDemuxer::UNDERFLOW && !reader.isStalled()) demuxer.waitForData(100);
+    if (status == ProgressiveDemuxer::UNDERFLOW) {
+        std::cerr << "Error: " << filePath << " stopped growing for " << stall_timeout_ms << " ms before its headers were written." << std::endl;
+        return 1;
+    }
+    if (status != ProgressiveDemuxer::FRAME) {
+        std::cerr << "Failed to open " << filePath << " for progressive playback" << std::endl;
+        return 1;
+    }
+    const WebMDemuxer& headers = demuxer.getHeaderDemuxer();
+
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    if (sdl::bootstrap_sdl_window(headers.getWidth(), headers.getHeight(), window, renderer, texture) != 0) {
+        SDL_Quit();
+        return 2;
+    }
+
+    VPXDecoder videoDec(headers, 8);
+    OpusVorbisDecoder audioDec(headers);
+    CustomAudioSource customSource;
+    SoLoud::Soloud& soloud = SharedAudioEngine::get(MIXER_SAMPLE_RATE);
+    customSource.mChannels = headers.getChannels();
+    customSource.mBaseSamplerate = soloud.mSamplerate;
+    customSource.allocate(static_cast<size_t>(PCM_QUEUE_SECONDS * soloud.mSamplerate) * customSource.mChannels); // no PCM budget here, a fixed queue
+    SoLoud::handle soundHandle = 0;
+    PolyphaseResampler resampler(static_cast<int>(headers.getSampleRate()), soloud.mSamplerate, headers.getChannels(), PolyphaseResampler::BEST);
+    std::vector<short> resampled;
+    std::vector<short> pcm(audioDec.isOpen() ? audioDec.getBufferSamples() * headers.getChannels() : 0);
+
+    FrameRegulator frameRegulator(demuxer.getFrameRate());
+    WebMFrame videoFrame, audioFrame;
+    VPXDecoder::Image image;
+    SDL_Event e;
+    double media_time = 0.0;                          // time of the last frame read
+    auto clock_start = std::chrono::steady_clock::now(); // playback clock, moved forward by the time spent buffering
+    auto buffering_since = clock_start;
+    bool buffering = true;
+    size_t stalls = 0;
+    uint32_t result = 0;
+
+    while (result == 0) {
+        if (SDL_PollEvent(&e) && sdl::handle_sdl_events(&e)) break;
+
+        // buffer until enough media is on disk ahead of the playback position
+        if (buffering) {
+            if (demuxer.getBufferedUntil() < media_time + buffer_seconds) {
+                if (reader.isStalled()) { // the writer stopped, report it rather than taking the file for finished
+                    std::cerr << "Error: " << filePath << " stopped growing for " << stall_timeout_ms << " ms, underflow at " << media_time << " s." << std::endl;
+                    result = 6;
+                    break;
+                }
+                demuxer.waitForData(50);
+                continue;
+            }
+            buffering = false;
+            clock_start += std::chrono::steady_clock::now() - buffering_since;
+            soloud.setPause(soundHandle, false);
+            std::cout << "Buffered, playing from " << media_time << " s" << std::endl;
+        }
+
+        frameRegulator.start();
+        status = demuxer.readFrame(&videoFrame, &audioFrame);
+        if (status == ProgressiveDemuxer::END_OF_STREAM) {
+            if (audioDec.isOpen()) {
+                resampled.clear();
+                resampler.flushS16(resampled); // the filter still holds the last few frames
+                push_audio(customSource, resampled);
+            }
+            break;
+        }
+        if (status == ProgressiveDemuxer::ERROR) {
+            std::cerr << "Failed to demux " << filePath << " at " << media_time << " s" << std::endl;
+            result = 3;
+            break;
+        }
+        if (status == ProgressiveDemuxer::UNDERFLOW) { // caught up with the writer, pause and buffer again
+            ++stalls;
+            buffering = true;
+            buffering_since = std::chrono::steady_clock::now();
+            soloud.setPause(soundHandle, true);
+            std::cerr << "Underflow at " << media_time << " s, buffering..." << std::endl;
+            continue;
+        }
+
+        if (videoFrame.isValid()) {
+            media_time = videoFrame.time;
+            if (!videoDec.decode(videoFrame)) {
+                std::cerr << "Failed to decode video frame." << std::endl;
+                result = 4;
+                break;
+            }
+            while (videoDec.getImage(image) == VPXDecoder::NO_ERROR) {
+                SDL_UpdateYUVTexture(texture, NULL, image.planes[0], image.linesize[0], image.planes[1], image.linesize[1], image.planes[2], image.linesize[2]);
+            }
+            sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+        }
+
+        if (audioFrame.isValid() && audioDec.isOpen()) {
+            media_time = audioFrame.time;
+            int numOutSamples;
+            if (!audioDec.getPCMS16(audioFrame, pcm.data(), numOutSamples)) {
+                std::cerr << "Failed to decode audio frame." << std::endl;
+                result = 5;
+                break;
+            }
+            resampled.clear();
+            resampler.processS16(pcm.data(), numOutSamples, resampled);
+            push_audio(customSource, resampled);
+            if (!soloud.isValidVoiceHandle(soundHandle) || !soloud.getVoiceCount()) {
+                soundHandle = soloud.play(customSource);
+            }
+        }
+
+        frameRegulator.stop();
+
+        // pace by the playback clock, which stood still while buffering
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - clock_start).count();
+        if (videoFrame.isValid() && videoFrame.time > elapsed) frameRegulator.delay();
+    }
+
+    std::cout << "Progressive playback stalled " << stalls << " time(s)" << std::endl;
+    soloud.stopAudioSource(customSource);
+    SharedAudioEngine::shutdown();
+    sdl::shutdown_sdl_window(window, renderer, texture);
+    return result;
+}
+
+#if defined(OPENAVMEDIA_ASYNC)
+/**
+ * @brief The coroutine form of webm_frame_rate(), it probes on the I/O pool
+ */
+async::Task<async::Result<double>> webm_frame_rate_async(std::string filePath, async::Executors& executors, async::CancellationToken token) {
+    co_await executors.io.schedule();
+    if (token.isCancelled()) co_return {async::Status::CANCELLED};
+
+    double rate = 0.0;
+    if (webm_frame_rate(filePath.c_str(), rate) != 0) co_return {async::Status::FAILED};
+    co_return {async::Status::OK, rate};
+}
+
+/**
+ * @brief Starts the shared audio engine on the CPU pool, opening the audio device takes a while
+ */
+async::Task<async::Result<SoLoud::Soloud*>> start_audio_engine_async(async::Executors& executors) {
+    co_await executors.cpu.schedule();
+    co_return {async::Status::OK, &SharedAudioEngine::get(MIXER_SAMPLE_RATE)};
+}
+
+/**
+ * @brief Opens and pre-rolls a file through the coroutine API while the main thread stays free, then plays it
+ * @note Opening, probing the frame rate and starting the audio engine run at once. The pre-roll runs
+ * while the window already handles events, escape cancels it.
+ * @param filePath The video file
+ * @return Zero upon success or when cancelled, otherwise a nonzero error code.
+ */
+uint32_t play_async(const char* filePath) {
+    async::Executors executors;
+    async::CancellationSource cancel;
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&start]() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+
+    async::Pending<async::Result<std::unique_ptr<WebMDemuxer>>> opening = async::spawn(async::open<MkvReader>(filePath, executors, cancel.token()));
+    async::Pending<async::Result<double>> probing = async::spawn(webm_frame_rate_async(filePath, executors, cancel.token()));
+    async::Pending<async::Result<SoLoud::Soloud*>> starting = async::spawn(start_audio_engine_async(executors));
+
+    // the main thread is free meanwhile, a game would keep running its frames here
+    size_t main_ticks = 0;
+    while (!opening.isReady() || !probing.isReady() || !starting.isReady()) {
+        ++main_ticks;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    async::Result<std::unique_ptr<WebMDemuxer>> opened = opening.get();
+    const async::Result<double> frame_rate = probing.get();
+    SoLoud::Soloud& soloud = *starting.get().value;
+    if (!opened.ok() || !frame_rate.ok()) {
+        if (!opened.ok()) std::cerr << "Error: Could not open " << filePath << "." << std::endl;
+        if (!frame_rate.ok()) std::cerr << "Error: Could not determine the frame rate of " << filePath << "." << std::endl;
+        SharedAudioEngine::shutdown();
+        return 1;
+    }
+    std::cout << "Opened in " << elapsed_ms() << " ms, the main thread ticked " << main_ticks << " times meanwhile" << std::endl;
+
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    if (sdl::bootstrap_sdl_window(opened.value->getWidth(), opened.value->getHeight(), window, renderer, texture) != 0) {
+        SharedAudioEngine::shutdown();
+        SDL_Quit();
+        return 2;
+    }
+
+    // the window keeps presenting and handling events while the pre-roll decodes
+    DecoderPool decoderPool;
+    AsyncPlayer player(std::move(opened.value), soloud.mSamplerate, executors, &decoderPool);
+    async::Pending<async::Status> prerolling = async::spawn(player.preroll(cancel.token()));
+    SDL_Event e;
+    while (!prerolling.isReady()) {
+        if (SDL_PollEvent(&e) && sdl::handle_sdl_events(&e)) cancel.cancel();
+        sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+    }
+    const async::Status prerolled = prerolling.get();
+    if (prerolled != async::Status::OK) {
+        if (prerolled == async::Status::CANCELLED) std::cout << "Cancelled while pre-rolling" << std::endl;
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return (prerolled == async::Status::CANCELLED) ? 0 : 3;
+    }
+    std::cout << "Ready to play after " << elapsed_ms() << " ms" << std::endl;
+
+    CustomAudioSource customSource;
+    customSource.mChannels = player.getDemuxer().getChannels();
+    customSource.mBaseSamplerate = soloud.mSamplerate;
+    customSource.allocate(static_cast<size_t>(PCM_QUEUE_SECONDS * soloud.mSamplerate) * customSource.mChannels); // no PCM budget here, a fixed queue
+    SoLoud::handle soundHandle = 0;
+
+    FrameRegulator frameRegulator(frame_rate.value);
+    std::vector<short> audio;
+    bool has_picture = false;
+    const auto play_start = std::chrono::steady_clock::now();
+    uint32_t result = 0;
+
+    while (player.readFrame(has_picture, audio)) {
+        frameRegulator.start();
+        if (SDL_PollEvent(&e) && sdl::handle_sdl_events(&e)) break;
+
+        if (has_picture) {
+            const VPXDecoder::Image& image = player.getImage();
+            if (SDL_UpdateYUVTexture(texture, NULL, image.planes[0], image.linesize[0], image.planes[1], image.linesize[1], image.planes[2], image.linesize[2]) == -1) {
+                std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
+                result = 4;
+                break;
+            }
+            sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+        }
+
+        if (!audio.empty()) {
+            push_audio(customSource, audio);
+            audio.clear();
+            if (!soloud.isValidVoiceHandle(soundHandle) || !soloud.getVoiceCount()) {
+                soundHandle = soloud.play(customSource);
+            }
+        }
+
+        frameRegulator.stop();
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - play_start).count();
+        if (has_picture && player.getVideoTime() >= elapsed) frameRegulator.delay();
+    }
+
+    soloud.stopAudioSource(customSource);
+    SharedAudioEngine::shutdown();
+    sdl::shutdown_sdl_window(window, renderer, texture);
+    return result;
+}
+#endif
+
+/**
+ * @brief Shows frames from the history while playback is paused, the decoder is not touched
+ * @note Left and right step one frame back and forward, R replays the whole history with its audio
+ * at the pace it was played, space or stepping forward past the newest frame goes back to playback.
+ * @param history Frames played so far
+ * @param replay Starts with a replay instead of a step back
+ * @param soloud Plays the replayed audio
+ * @param channels Channel count of the history's audio
+ * @param renderer Renderer to present with
+ * @return 0 to carry on playing, 1 when the user quits, 2 on an SDL error
+ */
+uint32_t review_history(const FrameHistory& history, bool replay, SoLoud::Soloud& soloud, unsigned channels, SDL_Renderer*& renderer) {
+    if (history.getCount() == 0) return 0;
+
+    // a texture of the history's own size, its pictures may be downscaled, the renderer stretches them back
+    const FrameHistory::Frame& newest = history.getFrame(0);
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, newest.width[0], newest.height[0]);
+    if (texture == nullptr) {
+        std::cerr << "Failed to create history texture: " << SDL_GetError() << std::endl;
+        return 2;
+    }
+
+    // the replay queue holds the whole history's audio, a copy of memory the history already accounts for
+    CustomAudioSource replaySource;
+    replaySource.mChannels = channels;
+    replaySource.mBaseSamplerate = soloud.mSamplerate;
+    size_t replay_samples = 0;
+    for (size_t a = 0; a < history.getCount(); ++a) replay_samples += history.getFrame(a).audio.size();
+    replaySource.allocate(replay_samples);
+
+    const size_t oldest = history.getCount() - 1;
+    size_t age = replay ? oldest : std::min<size_t>(1, oldest); // 0 is the frame that was on screen
+    size_t shown_age = oldest + 1;
+    bool replaying = false;
+    Uint32 replay_start = 0;
+    uint32_t result = 0;
+    SDL_Event e;
+
+    while (true) {
+        if (replay) { // the audio goes out in one piece, the pictures follow its clock
+            soloud.stopAudioSource(replaySource);
+            replaySource.clear();
+            for (size_t a = oldest + 1; a-- > 0;) replaySource.push(history.getFrame(a).audio);
+            soloud.play(replaySource);
+            age = oldest;
+            replay_start = SDL_GetTicks();
+            replaying = true;
+            replay = false;
+        }
+
+        if (SDL_WaitEventTimeout(&e, 5)) {
+            if (sdl::handle_sdl_events(&e)) {
+                result = 1;
+                break;
+            }
+            if (e.type == SDL_KEYDOWN) {
+                const int key = e.key.keysym.sym;
+                if (key == SDLK_SPACE || (key == SDLK_RIGHT && age == 0)) break;
+                if (key == SDLK_LEFT || key == SDLK_RIGHT) {
+                    if (replaying) soloud.stopAudioSource(replaySource);
+                    replaying = false;
+                    if (key == SDLK_LEFT && age < oldest) ++age;
+                    if (key == SDLK_RIGHT) --age;
+                }
+                if (key == SDLK_r) replay = true;
+            }
+        }
+
+        if (replaying) {
+            const double due = history.getFrame(oldest).time + (SDL_GetTicks() - replay_start) / 1000.0;
+            while (age > 0 && history.getFrame(age - 1).time <= due) --age;
+            if (age == 0) replaying = false; // the audio plays out on its own
+        }
+
+        if (age != shown_age) {
+            const FrameHistory::Frame& frame = history.getFrame(age);
+            TRACE_SCOPE(UPLOAD, "SDL_UpdateYUVTexture history", static_cast<int64_t>(age));
+            if (SDL_UpdateYUVTexture(texture, NULL, frame.getPlane(0), frame.width[0], frame.getPlane(1), frame.width[1], frame.getPlane(2), frame.width[2]) == -1) {
+                std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
+                result = 2;
+                break;
+            }
+            sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
+            shown_age = age;
+        }
+    }
+
+    soloud.stopAudioSource(replaySource);
+    SDL_DestroyTexture(texture);
+    return result;
+}
+
+/**
+ * @brief FramePlayer's output when playing: pictures go to the window, audio to SoLoud
+ * @note Left arrow and R pause playback and open the history, see review_history().
+ */
+class WindowOutput: public PlaybackOutput {
+    public:
+    WindowOutput(SDL_Renderer*& renderer, SDL_Texture*& texture, SoLoud::Soloud& soloud, CustomAudioSource& source, const FrameHistory& history, StartupMetrics& startup)
+        : m_renderer(renderer), m_texture(texture), m_soloud(soloud), m_source(source), m_history(history), m_startup(startup) { }
+
+    Input poll() override {
+        SDL_Event e; // SDL's structure for tracking input
+        if (!SDL_PollEvent(&e)) return NONE;
+        if (sdl::handle_sdl_events(&e)) return QUIT;
+
+        // step back or replay from the history while the decoder stays where it is
+        if (e.type == SDL_KEYDOWN && (e.key.keysym.sym == SDLK_LEFT || e.key.keysym.sym == SDLK_r) && m_history.getCount()) {
+            m_soloud.setPause(m_soundHandle, true);
+            const uint32_t result = review_history(m_history, e.key.keysym.sym == SDLK_r, m_soloud, m_source.mChannels, m_renderer);
+            m_soloud.setPause(m_soundHandle, false);
+            return (result != 0) ? QUIT : RESUMED; // the time spent reviewing is not playback time
+        }
+        return NONE;
+    }
+
+    Input waitForAudio() override {
+        return poll(); // left arrow and R work while decoding waits for the mixer too
+    }
+
+    bool showPicture(const VPXDecoder::Image& image) override {
+        // For each color plane...
+        for (int p = 0; p < 3; ++p) {
+            // ...determine the dimensions
+            // Note: This can be necessary because for some formats, e.g., YUV, the format contains planes with differing dimensions.
+            const int h = image.getHeight(p);
+
+            // ...then copy each row of the current plane from the decoder's color plane to the Image's color plane
+            int offset = 0;
+            for (int y = 0; y < h; ++y) {
+                offset += image.linesize[p];
+            }
+        }
+
+        // copy the Image data to the SDL texture by...
+        // ...updating the texture with YUV frame data
+        if (SDL_UpdateYUVTexture(m_texture, NULL,
+                            image.planes[0], image.linesize[0],           // Y plane
+                            image.planes[1], image.linesize[1],           // U (Cb) plane
+                            image.planes[2], image.linesize[2]) == -1) {  // V (Cr) plane
+            std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
+            return false;
+        }
+
+        // ...and then rendering this texture, SDL will handle the YUV to RGB conversion internally
+        if (SDL_RenderCopy(m_renderer, m_texture, NULL, NULL) < 0) {
+            std::cerr << "Unable to update render target with the latest texture: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool showRgba(const std::vector<uint8_t>& rgba, int width, [[maybe_unused]] int height) override {
+        if (SDL_UpdateTexture(m_texture, NULL, rgba.data(), width * 4) == -1) {
+            std::cerr << "Unable to update the texture with RGBA data: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void startAudio([[maybe_unused]] double mediaSeconds) override {
+        // ensure playback can't repeat and play
+        if (!m_soloud.isValidVoiceHandle(m_soundHandle) || !m_soloud.getVoiceCount()) {
+            m_soundHandle = m_soloud.play(m_source);
+        }
+    }
+
+    void present(bool hasNewPicture, [[maybe_unused]] double pictureSeconds) override {
+        sdl::copy_sdl_texture_to_sdl_renderer(m_renderer, m_texture);
+        if (hasNewPicture) m_startup.markFirstFrame();
+    }
+
+    private:
+    SDL_Renderer*& m_renderer;
+    SDL_Texture*& m_texture;
+    SoLoud::Soloud& m_soloud;
+    CustomAudioSource& m_source;
+    const FrameHistory& m_history;
+    StartupMetrics& m_startup;
+    SoLoud::handle m_soundHandle = 0;
+};
+
 /**
  * --------------------------------------------------------------------------------
  * Main
@@ -289,11 +1336,46 @@ class FrameRegulator {
  */
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Requires a single argument that contains the video file's file path." << std::endl;
+    if (argc < 2) {
+        std::cerr << "Requires the video file's file path, optionally followed by a trick-play rate (2 to 64, negative rewinds),"
+            " by more files to play back to back (add --loop to loop the last one, --low-latency for small mixer periods)"
+            " by --progressive [buffer seconds] [expected bytes] [stall timeout ms] for a file that is still being written,"
+            " by --async to open and pre-roll it through the coroutine API"
+            " or by --simulate [options] for a deterministic pacing run against a virtual clock." << std::endl;
         return EXIT_FAILURE;
     }
 
+    // a file still being written cannot be opened by WebMDemuxer, it has its own demuxer
+    if (argc >= 3 && strcmp(argv[2], "--progressive") == 0) {
+        const double buffer_seconds = (argc >= 4) ? std::atof(argv[3]) : 2.0;
+        const long long expected_size = (argc >= 5) ? std::atoll(argv[4]) : -1; // a download's Content-Length, -1 when unknown
+        const int stall_timeout_ms = (argc >= 6) ? std::atoi(argv[5]) : 0;       // 0 waits for the writer forever
+        return (play_progressive(argv[1], buffer_seconds, expected_size, stall_timeout_ms) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // opening, probing and pre-rolling run as coroutines on worker pools, the main thread stays free
+    if (argc >= 3 && strcmp(argv[2], "--async") == 0) {
+#if defined(OPENAVMEDIA_ASYNC)
+        return (play_async(argv[1]) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+        std::cerr << "--async needs the coroutine API, configure with ENABLE_COROUTINES=ON" << std::endl;
+        return EXIT_FAILURE;
+#endif
+    }
+
+    // a number after the file is a trick-play rate, anything else makes a playlist
+    char* rate_end = nullptr;
+    const double trick_rate = (argc == 3) ? std::strtod(argv[2], &rate_end) : 0.0;
+    const bool is_trick_play = (argc == 3) && rate_end != argv[2] && *rate_end == '\0';
+    std::vector<std::string> playlist;
+    bool loop_playlist = false;
+    bool low_latency = false;
+    for (int i = 1; i < argc && !is_trick_play; ++i) {
+        if (strcmp(argv[i], "--loop") == 0) loop_playlist = true;
+        else if (strcmp(argv[i], "--low-latency") == 0) low_latency = true;
+        else playlist.push_back(argv[i]);
+    }
+
     // get video information needed to setup the and play the video
     WebMDemuxer demuxer(new MkvReader(argv[1]));
     if (demuxer.isOpen()) {
@@ -308,8 +1390,26 @@ int main(int argc, char* argv[]) {
     double frame_rate = 0.0;
     if (webm_frame_rate(argv[1], frame_rate) != 0) return EXIT_FAILURE;
 
+    // WebM with an alpha channel carries it as a second VP8/VP9 stream, in each block's BlockAdditional
+    MkvReader alphaFile(argv[1]);
+    BlockAdditionalReader alphaReader(&alphaFile);
+    const bool has_alpha = alphaReader.hasAlpha();
+
     // status message
-    std::cout << "Play File:    " << argv[1] << "\nVideo Length: " << demuxer.getLength() << "\nFrame Rate: " << frame_rate << std::endl;
+    std::cout << "Play File:    " << argv[1] << "\nVideo Length: " << demuxer.getLength() << "\nFrame Rate: " << frame_rate
+        << (has_alpha ? "\nAlpha:        yes" : "") << std::endl;
+
+    // a deterministic run against a virtual clock, it needs neither a window nor an audio device
+    if (argc >= 3 && strcmp(argv[2], "--simulate") == 0) {
+        SimulationConfig config;
+        for (int i = 3; i < argc; ++i) {
+            if (!config.parse(argv[i])) {
+                std::cerr << "Unknown simulation option: " << argv[i] << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        return (simulate_playback(demuxer, frame_rate, has_alpha ? &alphaReader : nullptr, config) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     // get a SDL window open
     SDL_Window* window;
@@ -319,152 +1419,110 @@ int main(int argc, char* argv[]) {
         SDL_Quit();
         return EXIT_FAILURE;
     }
+    if (has_alpha && sdl::use_premultiplied_rgba_texture(video_width, video_height, renderer, texture) != 0) {
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return EXIT_FAILURE;
+    }
 
-    // creating variables prior to the loop, so they aren't created repeatedly per iteration
-    bool is_user_quitting = false;        // controls when to quit running the app
+    // decoders and the audio engine are made ready before playback is asked for, like a game would while loading
+    DecoderPool decoderPool;
+    decoderPool.prewarm(demuxer, 8, has_alpha ? 2 : 1); // the alpha stream needs a decoder of its own
+    SoLoud::Soloud& soloud = SharedAudioEngine::get(MIXER_SAMPLE_RATE, low_latency ? LOW_LATENCY_BUFFER_FRAMES : static_cast<unsigned int>(SoLoud::Soloud::AUTO));
+
+    // scrub through keyframes only when a trick-play rate was given, audio stays muted
+    if (is_trick_play) {
+        std::unique_ptr<VPXDecoder> videoDec = decoderPool.acquireVideo(demuxer, 8);
+        const uint32_t result = trick_play(argv[1], trick_rate, frame_rate, *videoDec, renderer, texture);
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-	int64_t last = 0;                     // these 3 track the amount of time that elapses between iterations
-    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    float delta = 0.0f;
-    float accumulated_delta = 0.0f;
+    // play the clips back to back, switching on exact frame boundaries
+    if (playlist.size() > 1 || loop_playlist) {
+        const uint32_t result = play_playlist(playlist, loop_playlist, demuxer.getChannels(), frame_rate, decoderPool, renderer, texture);
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
+    // creating variables prior to the loop, so they aren't created repeatedly per iteration
     int32_t frame_count = 0;                   // stores frame count over last second
-    FrameRegulator frameRegulator(frame_rate); // utilized to reach the playback frame rate goal
 
-    SDL_Event e;                         // SDL's structure for tracking input
+    StartupMetrics startup;              // playback is asked for here, it measures the time to the first frame and sample
+    startup.start();
 
-    VPXDecoder videoDec(demuxer, 8);     // interfaces for video codecs
-    OpusVorbisDecoder audioDec(demuxer);
+    std::unique_ptr<VPXDecoder> videoDecoder = decoderPool.acquireVideo(demuxer, 8); // interfaces for video codecs, taken already initialized
+    std::unique_ptr<OpusVorbisDecoder> audioDecoder = decoderPool.acquireAudio(demuxer);
+    VPXDecoder& videoDec = *videoDecoder;
+    OpusVorbisDecoder& audioDec = *audioDecoder;
+
+    std::unique_ptr<VPXDecoder> alphaDecoder = has_alpha ? decoderPool.acquireVideo(demuxer, 8) : nullptr;
+    std::unique_ptr<AlphaVideoDecoder> alphaVideo = has_alpha ? std::make_unique<AlphaVideoDecoder>(videoDec, *alphaDecoder) : nullptr;
+
+    // buffers are accounted per category, budgets come from e.g. OPENAVMEDIA_MEMORY_BUDGET=pcm=512K
+    MemoryBudget budget;
+    if (!budget.configureFromEnvironment()) {
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return EXIT_FAILURE;
+    }
 
-    CustomAudioSource customSource;      // get SoLoud initialized
+    // the last seconds played stay decoded, left arrow steps back through them and R replays them
+    std::unique_ptr<FrameHistory> history = create_history(budget, frame_rate, video_width, video_height);
+    if (!has_alpha) std::cout << "History:      " << HISTORY_SECONDS << " s at 1/" << history->getDownscale() << " size, left arrow steps back, R replays" << std::endl;
+
+    CustomAudioSource customSource;      // SoLoud already runs at the global mixer rate, not the media's rate
     customSource.mChannels = demuxer.getChannels();
-    customSource.mBaseSamplerate = demuxer.getSampleRate();
-    SoLoud::Soloud soloud;
-    soloud.init(SoLoud::Soloud::CLIP_ROUNDOFF, SoLoud::Soloud::AUTO, demuxer.getSampleRate(), 0, demuxer.getChannels());
-    SoLoud::handle soundHandle;
+    customSource.mBaseSamplerate = soloud.mSamplerate;
+    customSource.metrics = &startup;
+    customSource.budget = &budget;       // the queue comes out of the PCM budget, decoding waits while it is full
+    if (allocate_audio_queue(customSource, budget, audioDec, demuxer.getSampleRate(), soloud.mBufferSize) != 0) {
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return EXIT_FAILURE;
+    }
 
-    WebMFrame videoFrame, audioFrame;    // two frame types and two buffers for manipulating the data within them
-    VPXDecoder::Image image;
-    short* pcm = audioDec.isOpen() ? new short[audioDec.getBufferSamples() * demuxer.getChannels()] : nullptr;
+    // demuxes, decodes and paces every frame, the output shows them in the window and plays their audio
+    FramePlayer player(demuxer, videoDec, audioDec, alphaVideo.get(), has_alpha ? &alphaReader : nullptr, customSource, *history, budget, frame_rate);
+    WindowOutput output(renderer, texture, soloud, customSource, *history, startup);
 
     // status
-    std::cout << "Audio deque/buffer size: " << customSource.audioBuffer.size()
+    std::cout << "Audio queue size: " << customSource.getCapacity() << " samples (" << 1000.0 * customSource.getCapacity() / customSource.mChannels / soloud.mSamplerate << " ms)"
         << "\nSoloud Global Samplerate: " << soloud.mSamplerate
-        << "\nSoloud Global Buffer Size: " << soloud.mBufferSize << std::endl;
-
-    // loop for playing the video
-	while ((!is_user_quitting) && demuxer.readFrame(&videoFrame, &audioFrame)) {
-        frameRegulator.start(); // consider this the start of the frame
+        << "\nSoloud Global Buffer Size: " << soloud.mBufferSize
+        << "\nMedia Samplerate: " << demuxer.getSampleRate() << std::endl;
 
-        // get latest input events
-        SDL_PollEvent(&e);
-        is_user_quitting = sdl::handle_sdl_events(&e); // process them
-
-        // delta is the time that has elapsed since last update_frame_rate() call
-        delta = get_time_delta(&last, &now);
+    TRACE_THREAD_NAME("main");
 
-        // update the playback position
-        accumulated_delta += delta;
-        
+    // loop for playing the video
+    FramePlayer::Status status;
+    while ((status = player.playFrame(output)) == FramePlayer::PLAYING) {
         // update the frame count
-        frame_count = update_frames_per_second(delta);
+        frame_count = update_frames_per_second(player.getDeltaMs());
         if (frame_count != -1) std::cout << "Video Frames Per Second: " << frame_count << std::endl;
+    }
+    if (status == FramePlayer::FAILED) {
+        std::cerr << "Shutting down..." << std::endl;
+        soloud.stopAudioSource(customSource);
+        SharedAudioEngine::shutdown();
+        sdl::shutdown_sdl_window(window, renderer, texture);
+        return EXIT_FAILURE;
+    }
 
-        // get the next video frame based on playback position and put its pixels into a texture
-        if (videoDec.isOpen() && videoFrame.isValid()) {
-            if (!videoDec.decode(videoFrame))
-            {
-                std::cerr << "Failed to decode video frame. Shutting down..." << std::endl;
-                soloud.deinit();
-                sdl::shutdown_sdl_window(window, renderer, texture);
-                return EXIT_FAILURE;
-            }
-            while (videoDec.getImage(image) == VPXDecoder::NO_ERROR)
-            {
-                // For each color plane...
-                for (int p = 0; p < 3; ++p) {
-                    // ...determine the dimensions
-                    // Note: This can be necessary because for some formats, e.g., YUV, the format contains planes with differing dimensions.
-                    const int h = image.getHeight(p);
-
-                    // ...then copy each row of the current plane from the decoder's color plane to the Image's color plane
-                    int offset = 0;
-                    for (int y = 0; y < h; ++y) {
-                        offset += image.linesize[p];
-                    }
-                }
-
-                // copy the Image data to the SDL texture by...
-                // ...updating the texture with YUV frame data
-                if (SDL_UpdateYUVTexture(texture, NULL,
-                                    image.planes[0], image.linesize[0],           // Y plane
-                                    image.planes[1], image.linesize[1],           // U (Cb) plane
-                                    image.planes[2], image.linesize[2]) == -1) {  // V (Cr) plane
-                    std::cerr << "Unable to update the texture with YUV data: " << SDL_GetError() << std::endl;
-                    soloud.deinit();
-                    sdl::shutdown_sdl_window(window, renderer, texture);
-                    return EXIT_FAILURE;
-                }
-
-                // ...and then rendering this texture, SDL will handle the YUV to RGB conversion internally
-                if (SDL_RenderCopy(renderer, texture, NULL, NULL) < 0) {
-                    std::cerr << "Unable to update render target with the latest texture: " << SDL_GetError() << std::endl;
-                    soloud.deinit();
-                    sdl::shutdown_sdl_window(window, renderer, texture);
-                    return EXIT_FAILURE;
-                }
-            }
-            
-            //DEBUG: std::cout << "videoFrame: " << videoFrame.time << " progress: " << (accumulated_delta/MILLISECONDS_IN_A_SECOND) << std::endl;
-        }
-
-        // get the next video frame based on playback position and put its pixels into a texture
-        if (audioDec.isOpen() && audioFrame.isValid())
-        {
-            int numOutSamples;
-            if (!audioDec.getPCMS16(audioFrame, pcm, numOutSamples))
-            {
-                std::cerr << "Failed to decode audio frame. Shutting down..." << std::endl;
-                soloud.deinit();
-                sdl::shutdown_sdl_window(window, renderer, texture);
-                return EXIT_FAILURE;
-            }
-
-            /*
-            // DEBUG: Printing the raw audio out to a file to check/hear it in Audacity software
-            FILE* descriptor = fopen("./theraw", "ab");
-            fwrite(pcm, 1, numOutSamples * demuxer.getChannels() * sizeof(short), descriptor);
-            fclose(descriptor);
-            */
-           
-            // Push the decoded samples into the buffer.
-            for (int i = 0; i < (numOutSamples * demuxer.getChannels()); i++) {
-                customSource.audioBuffer.push_back(pcm[i]);
-            }
-            
-            // ensure playback can't repeat and play
-            if (!soloud.isValidVoiceHandle(soundHandle) || !soloud.getVoiceCount()) {
-                soundHandle = soloud.play(customSource);
-            }
-        }
-
-        // render the texture
-        sdl::copy_sdl_texture_to_sdl_renderer(renderer, texture);
-
-        frameRegulator.stop();  // consider this the end of the frame
+    startup.print(std::cout);
+    std::cout << "Decoder pool hits: " << decoderPool.getHits() << ", misses: " << decoderPool.getMisses() << std::endl;
+    if (has_alpha) std::cout << "Alpha payload read: " << alphaReader.getBytesRead() << " bytes" << std::endl;
+    budget.print(std::cout);
 
-        // pace the video by performing...
-        if (videoFrame.time < (accumulated_delta/MILLISECONDS_IN_A_SECOND)) {
-            // ...no operation (nop) anytime the video is running behind
-        } else {
-            // ...or adding delays to ensure its playback speed matches the goal frame rate when running ahead
-            frameRegulator.delay();
-        }
+    // save the trace so a hitch can be matched to its frame and stage
+    if (TRACE_WRITE_JSON("openavmedia_trace.json")) {
+        std::cout << "Trace written to openavmedia_trace.json (open it in chrome://tracing or ui.perfetto.dev)" << std::endl;
     }
 
     // clean up
-    delete[] pcm;
-    soloud.deinit();
+    soloud.stopAudioSource(customSource);
+    SharedAudioEngine::shutdown();
     sdl::shutdown_sdl_window(window, renderer, texture);
 
     return EXIT_SUCCESS;
@@ -1,8 +1,13 @@
 #pragma once
-#include <deque>
+#include <algorithm>
+#include <vector>
 
 #include "soloud/soloud.h"
 
+#include "../tests/decoder_pool.hpp"
+#include "../tests/memory_budget.hpp"
+#include "../tests/trace.hpp"
+
 
 // prototype for CustomAudioSourceInstance
 /**
@@ -25,21 +30,63 @@ public:
 /**
  * @brief Custom audio source
  * @note The SoLoud library requires that this CustomAudioSource class define the createInstance().
+ * The decoding thread appends with push() while SoLoud's audio thread drains the queue in getAudio().
+ * The queue is a PcmRing allocated once before playback, so neither side ever locks or allocates.
  */
 class CustomAudioSource: public SoLoud::AudioSource {
     public:
-    std::deque<short> audioBuffer;     // audio buffer (for simplicity, public access)
+    StartupMetrics* metrics = nullptr; // when set, told about the first sample that is played
+    MemoryBudget* budget = nullptr;    // when set, allocate() takes the queue out of the PCM budget
 
     CustomAudioSource() {
         this->mChannels = 1;           // starts mono
         this->mBaseSamplerate = 44100; // starts 44100 Hz
     }
-    virtual ~CustomAudioSource() noexcept {}
+    virtual ~CustomAudioSource() noexcept { }
+
+    /**
+     * @brief Allocates the queue, call it once before the first push()
+     * @param samples Interleaved samples the queue holds, at least the largest block that is pushed
+     * @return false if the PCM budget cannot hold that many samples
+     */
+    bool allocate(size_t samples) {
+        if (budget) return m_queue.allocate(samples, *budget);
+        m_queue.allocate(samples);
+        return true;
+    }
+
+    /**
+     * @brief Appends decoded samples to the queue
+     * @note A block that does not fit whole is refused, the caller holds on to it and decodes
+     * nothing more until the mixer has played enough, push() again later. That is what throttles
+     * decoding to the playback speed.
+     * @return false if the queue had no room, nothing was appended then
+     */
+    bool push(const std::vector<short>& samples) {
+        if (samples.size() > m_queue.getFree()) return false;
+        m_queue.write(samples.data(), samples.size());
+        return true;
+    }
+
+    /**
+     * @brief Drops everything queued, stop the source first so the mixer is not reading at the same time
+     */
+    void clear() {
+        m_queue.skip(m_queue.getQueued());
+    }
+
+    size_t getBufferedSamples() const { return m_queue.getQueued(); }
+    size_t getCapacity() const { return m_queue.getCapacity(); }
 
     virtual SoLoud::AudioSourceInstance* createInstance()
     {
         return new CustomAudioSourceInstance(this);
     }
+
+    private:
+    friend class CustomAudioSourceInstance;
+
+    PcmRing m_queue; // interleaved samples waiting for the mixer
 };
 
 
@@ -49,52 +96,51 @@ CustomAudioSourceInstance::CustomAudioSourceInstance(CustomAudioSource* aSource)
 
 unsigned int CustomAudioSourceInstance::getAudio(float* aBuffer, unsigned int aSamplesToRead, unsigned int aBufferSize)
 {
-    unsigned int samplesWritten = 0;
-    for (unsigned int i = 0; i < aSamplesToRead; ++i, ++samplesWritten)
-    {
-        // Mono audio
-        if (mParentSource->mChannels == 1) {
-            if (!mParentSource->audioBuffer.empty()) {
-                short sample = mParentSource->audioBuffer.front();
-                mParentSource->audioBuffer.pop_front();
-                aBuffer[i] = sample / 32768.0f;
-            } else {
-                aBuffer[i] = 0.0f;
+    TRACE_THREAD_NAME("audio");
+    TRACE_SCOPE(AUDIO_CALLBACK, "getAudio", aSamplesToRead);
+    PcmRing& queue = mParentSource->m_queue;
+    const unsigned int channels = mParentSource->mChannels;
+    TRACE_COUNTER(BUFFER_LEVEL, "audioBuffer samples", queue.getQueued());
+
+    if (channels != 1 && channels != 2) return aSamplesToRead; // only mono and stereo are played
+    if (mParentSource->metrics && queue.getQueued() >= channels) mParentSource->metrics->markFirstSample();
+
+    // copy out in blocks through the stack, whole frames only, a frame the decoder is still writing waits for the next call
+    const unsigned int BLOCK_FRAMES = 256;
+    short samples[BLOCK_FRAMES * 2];
+    for (unsigned int frame = 0; frame < aSamplesToRead;) {
+        const unsigned int wanted = std::min(aSamplesToRead - frame, BLOCK_FRAMES);
+        const unsigned int count = static_cast<unsigned int>(std::min<size_t>(wanted, queue.getQueued() / channels));
+        queue.read(samples, static_cast<size_t>(count) * channels);
+
+        for (unsigned int i = 0; i < wanted; ++i) {
+            const unsigned int out = frame + i;
+
+            // Mono audio
+            if (channels == 1) {
+                aBuffer[out] = (i < count) ? samples[i] / 32768.0f : 0.0f;
             }
-        }
 
-        // Stereo audio
-        else if (mParentSource->mChannels == 2) {
-            if (mParentSource->audioBuffer.size() >= 2) { // check if we have at least two samples (one for each channel)
-                short sampleLeft = mParentSource->audioBuffer.front();
-                mParentSource->audioBuffer.pop_front();
-                short sampleRight = mParentSource->audioBuffer.front();
-                mParentSource->audioBuffer.pop_front();
-                
+            // Stereo audio
+            else if (i < count) {
                 // normalize the samples to the range of -1.0 to 1.0
                 // also add some headroom, to prevent clipping
                 // left channel is first half of the buffer, right channel is second half of the buffer
-                aBuffer[i]     = (sampleLeft / 32768.0f)*0.95;            // left channel
-                aBuffer[i + aBufferSize] = (sampleRight / 32768.0f)*0.95; // right channel
+                aBuffer[out]               = (samples[i * 2] / 32768.0f)*0.95;     // left channel
+                aBuffer[out + aBufferSize] = (samples[i * 2 + 1] / 32768.0f)*0.95; // right channel
             } else {
                 // DEBUG: std::cout << "Lack of Data - aSamplesToRead: " << aSamplesToRead << " - aBufferSize:" << aBufferSize << std::endl;
-                aBuffer[i] = aBuffer[i + aBufferSize] = 0.0f; // when there is not enough data for stereo, output silence
+                aBuffer[out] = aBuffer[out + aBufferSize] = 0.0f; // when there is not enough data for stereo, output silence
             }
         }
+        frame += wanted;
     }
 
-    /*
-    // DEBUG: 
-    std::cout << "aBufferSize: " << aBufferSize 
-        << " - mParentSource->audioBuffer.size(): " << mParentSource->audioBuffer.size()
-        << " - samplesWritten: " << samplesWritten << std::endl;
-    std::cout << "Consuming " << aSamplesToRead << " samples from buffer. Remaining size: " << mParentSource->audioBuffer.size() << std::endl;
-    */
-
-    return samplesWritten;
+    // the queue's memory stays allocated and accounted, there is nothing to release per block
+    return aSamplesToRead;
 }
 bool CustomAudioSourceInstance::hasEnded()
 {
     // stream ends when there are no more samples left to play
-    return mParentSource->audioBuffer.empty();
+    return mParentSource->getBufferedSamples() == 0;
 }
\ No newline at end of file
@@ -3,76 +3,134 @@
 #include <SDL_mixer/SDL_mixer.h>
 #include <map>
 #include <string>
-#include <thread>
-#include <chrono>
+
+#include "../tests/submix.hpp"
+#include "../tests/flac_loader.hpp"
+#include "../tests/low_latency.hpp"
+#include "../tests/memory_budget.hpp"
+#include "../tests/sound_bank.hpp"
+#include "../tests/sound_cache.hpp"
 
 #define ASSETS_DIR "../../tests/assets/"
 
 // utility functions
-// Note: I suspect Mix_PlayChannel is not thread safe and I should not be using it for threading.
-// However, since this is small example, I'll use playSound and playFadeInSound and just fudge it anyway.
-// Race conditions, catch me if you can, YOLO, LOL.
+// Note: every sound plays through the SubmixGraph. playSound and playFadeInSound only post commands,
+// the graph runs them on the audio thread, delays included. Gains are per voice, so the shared
+// Mix_Chunks are never modified. They come from a SoundCache, which loads a sound again if the
+// sound budget made it evict the sound.
 
 Mix_Chunk* loadSound(const std::string& file) {
-    Mix_Chunk* chunk = Mix_LoadWAV(file.c_str());
+    // the lossless beds are the slow ones to load, their frames decode on every core
+    static FlacLoader flacLoader;
+    const bool isFlac = file.size() > 5 && file.compare(file.size() - 5, 5, ".flac") == 0;
+
+    Mix_Chunk* chunk = isFlac ? flacLoader.loadChunk(file) : Mix_LoadWAV(file.c_str());
     if (!chunk) {
         std::cerr << "Failed to load " << file << ": " << Mix_GetError() << std::endl;
     }
     return chunk;
 }
 
-void playSound(Mix_Chunk* sound, int channel = -1, int loops = 0, int delayMs = 0, int volume = MIX_MAX_VOLUME) {
-    std::thread([sound, channel, loops, delayMs, volume]() {
-        if (delayMs > 0) {
-            SDL_Delay(delayMs); // add delay before playing the sound
-        }
-        Mix_VolumeChunk(sound, volume);
-        if (Mix_PlayChannel(channel, sound, loops) == -1) {
-            std::cerr << "Failed to play sound: " << Mix_GetError() << std::endl;
-        }
-    }).detach(); // Run in a detached thread
+void playSound(SoundCache& sounds, int id, int bus, int delayMs = 0, float gain = 1.0f, float pan = 0.0f, EffectChain* effects = nullptr) {
+    if (sounds.play(id, bus, gain, pan, 0, delayMs, 0, effects) == SubmixGraph::INVALID_VOICE) {
+        std::cerr << "Failed to queue sound " << id << std::endl;
+    }
 }
 
-void playFadeInSound(Mix_Chunk* sound, int channel = -1, int loops = 0, int delayMs = 0, int fadeDurationMs = 1000, int volume = MIX_MAX_VOLUME) {
-    std::thread([sound, channel, loops, delayMs, fadeDurationMs, volume]() {
-        if (delayMs > 0) {
-            SDL_Delay(delayMs); // add delay before starting the fade-in
-        }
+void playFadeInSound(SoundCache& sounds, int id, int bus, int delayMs = 0, int fadeDurationMs = 1000, float gain = 1.0f, float pan = 0.0f) {
+    if (sounds.play(id, bus, gain, pan, 0, delayMs, fadeDurationMs) == SubmixGraph::INVALID_VOICE) {
+        std::cerr << "Failed to queue sound " << id << " with fade-in" << std::endl;
+    }
+}
 
-        Mix_VolumeChunk(sound, volume); // Set the maximum volume for the chunk
-        if (Mix_FadeInChannel(channel, sound, loops, fadeDurationMs) == -1) {
-            std::cerr << "Failed to play sound with fade-in: " << Mix_GetError() << std::endl;
-        }
-    }).detach(); // Run in a detached thread
+/**
+ * @brief Post-mix hook that times SDL_mixer's callback, it runs once at the end of every mix
+ */
+void SDLCALL timeMix(void* userdata, [[maybe_unused]] Uint8* stream, [[maybe_unused]] int len) {
+    CallbackTimer* timer = static_cast<CallbackTimer*>(userdata);
+    timer->begin();
+    timer->end();
+}
+
+
+/**
+ * @brief The forest scene's buses, a bus is processed before its parent and before any bus added earlier
+ */
+struct ForestBuses {
+    int ambience = -1; // streams and rain, ducks under the thunder
+    int distant = -1;  // feeds ambience, low-pass and reverb push the rain and streams back
+    int sfx = -1;      // frogs
+    int thunder = -1;  // feeds sfx, measured so the ambience can duck under it
+    int dialogue = -1; // unused by this scene
+    int video = -1;    // unused by this scene
+
+    SidechainKey thunderKey;
+    EffectChain farFrog; // low-pass on one frog voice only, it sits further back than the other on its bus
+};
+
+/**
+ * @brief Builds the forest's submix graph and its per-voice effects, call with the mixer open
+ * @return false if a bus could not be added or the mixer is not open
+ */
+bool setupForestBuses(SubmixGraph& graph, ForestBuses& buses) {
+    buses.ambience = graph.addBus("ambience");
+    buses.distant = graph.addBus("distant", buses.ambience);
+    buses.sfx = graph.addBus("sfx");
+    buses.thunder = graph.addBus("thunder", buses.sfx);
+    buses.dialogue = graph.addBus("dialogue");
+    buses.video = graph.addBus("video");
+    if (buses.ambience < 0 || buses.distant < 0 || buses.sfx < 0 || buses.thunder < 0 || buses.dialogue < 0 || buses.video < 0) return false;
+
+    graph.addBusEffect<BiquadFilter>(buses.distant, BiquadFilter::LOW_PASS, 1800.0f);
+    graph.addBusEffect<FdnReverb>(buses.distant, 2.0f, 0.35f);
+    graph.addBusEffect<EnvelopeFollower>(buses.thunder, buses.thunderKey);
+    graph.addBusEffect<Limiter>(buses.thunder, 0.95f);
+    graph.addBusEffect<DuckingEffect>(buses.ambience, std::vector<const SidechainKey*>{&buses.thunderKey}, 0.2f, 0.4f);
+    graph.addBusEffect<Limiter>(SubmixGraph::MASTER, 0.98f); // keeps the sum from clipping
+
+    graph.setBusGain(buses.distant, 0.25f);
+
+    buses.farFrog.add<BiquadFilter>(BiquadFilter::LOW_PASS, 2500.0f);
+    return buses.farFrog.prepare();
 }
 
+/**
+ * @brief Prints how much of one core each bus and voice effect has used
+ */
+void printEffectCosts(const SubmixGraph& graph, const ForestBuses& buses) {
+    for (int bus = 0; bus < graph.getBusCount(); ++bus) {
+        for (const auto& effect : graph.getBusEffects(bus)) {
+            std::cout << "  " << graph.getBusName(bus) << " " << effect->getName() << ": "
+                      << (effect->getCpuLoad(graph.getSampleRate()) * 100.0) << "% CPU" << std::endl;
+        }
+    }
+    for (const auto& effect : buses.farFrog.getEffects()) {
+        std::cout << "  far frog voice " << effect->getName() << ": "
+                  << (effect->getCpuLoad(graph.getSampleRate()) * 100.0) << "% CPU" << std::endl;
+    }
+}
 
 // plays a soundscape that sounds like a forest in the rain
-void playForestScene(const std::map<int, Mix_Chunk*>& sounds) {
+void playForestScene(SoundCache& sounds, ForestBuses& buses) {
     // play 443972 light water stream and 643666/536759 frogs
-    playFadeInSound(sounds.at(443972), 0, 0, 0, 1000, 48);
-    playSound(sounds.at(643666), 1, 0, 1500);
-    playSound(sounds.at(536759), 2, 0, 2000);
-    playSound(sounds.at(536759), 2, 0, 3300, 64);
+    playFadeInSound(sounds, 443972, buses.ambience, 0, 1000, 0.375f);
+    playSound(sounds, 643666, buses.sfx, 1500, 1.0f, -0.4f);
+    playSound(sounds, 536759, buses.sfx, 2000, 1.0f, 0.3f);
+    playSound(sounds, 536759, buses.sfx, 3300, 0.5f, 0.6f, &buses.farFrog); // same chunk, its own gain and its own low-pass
 
     // play 750670 thunder, 5-second pause, then play faded in 243776/643666 rain and thunder
-    playSound(sounds.at(750670), 3, 0, 6000);
-    playFadeInSound(sounds.at(243776), 4, 0, 5000, 2000, 48);
-    playFadeInSound(sounds.at(536260), 5, 0, 5000, 2000, 48);
-
-    // play 475094 thunder, fade in 454283 faster larger stream
-    playSound(sounds.at(475094), 5, 0, 12000);
-    playFadeInSound(sounds.at(454283), 6, 0, 6000, 2000, 48);
-
-    playSound(sounds.at(475094), 5, 0, 16000, 82); // another random crack of thunder, but louder by layering via 2 channels
-    playSound(sounds.at(475094), 2, 0, 16000, 82);
-
-    // dull playing sounds, then play 451158 water trickling off roof
-    Mix_Volume(4, MIX_MAX_VOLUME / 8);
-    Mix_Volume(5, MIX_MAX_VOLUME / 8);
-    Mix_Volume(6, MIX_MAX_VOLUME / 8);
-    playSound(sounds.at(451158), 8, 0, 23000, 96); // After delay, play 451158
-    playSound(sounds.at(451158), 2, 0, 23000, 96);
+    playSound(sounds, 750670, buses.thunder, 6000);
+    playFadeInSound(sounds, 243776, buses.distant, 5000, 2000, 1.5f, -0.5f);
+    playFadeInSound(sounds, 536260, buses.distant, 5000, 2000, 1.5f, 0.5f);
+
+    // play 475094 thunder in the distance, fade in 454283 faster larger stream
+    playSound(sounds, 475094, buses.distant, 12000, 4.0f);
+    playFadeInSound(sounds, 454283, buses.distant, 6000, 2000, 1.5f);
+
+    playSound(sounds, 475094, buses.thunder, 16000, 1.28f); // another random crack of thunder, close and loud
+
+    // then play 451158 water trickling off roof
+    playSound(sounds, 451158, buses.ambience, 23000, 0.75f);
 }
 
 std::string chooseAudioDevice() {
@@ -112,7 +170,11 @@ std::string chooseAudioDevice() {
     return SDL_GetAudioDeviceName(choice, 0);
 }
 
-int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
+int main(int argc, char *argv[]) {
+    // low latency mode: 256 frame chunks (about 6 ms) instead of 2048
+    const bool low_latency = (argc == 2) && std::string(argv[1]) == "--low-latency";
+    const int chunk_size = low_latency ? 256 : 2048;
+
     // init SDL
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
         std::cerr << "SDL could not initialize: " << SDL_GetError() << std::endl;
@@ -124,30 +186,81 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     std::cout << "Output device selected: " << selectedDevice << std::endl;
 
     // init SDL_mixer
-    if (Mix_OpenAudioDevice(44100, MIX_DEFAULT_FORMAT, 2, 2048, selectedDevice.c_str(), SDL_AUDIO_ALLOW_ANY_CHANGE) < 0) {
+    if (Mix_OpenAudioDevice(44100, MIX_DEFAULT_FORMAT, 2, chunk_size, selectedDevice.c_str(), SDL_AUDIO_ALLOW_ANY_CHANGE) < 0) {
         std::cerr << "SDL_mixer could not initialize: " << Mix_GetError() << std::endl;
         SDL_Quit();
         return EXIT_FAILURE;
     }
-    Mix_AllocateChannels(8); // explicitly allocate 8 channels
+
+    Mix_AllocateChannels(8); // explicitly allocate 8 channels, plain channels still mix on top of the graph
+
+    // every sound is mixed by the graph, it renders through SDL_mixer's music hook
+    std::unique_ptr<ForestBuses> buses = std::make_unique<ForestBuses>();
+    SubmixGraph graph;
+    if (!setupForestBuses(graph, *buses) || !graph.start()) {
+        std::cerr << "Submix graph could not start: " << Mix_GetError() << std::endl;
+        Mix_CloseAudio();
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
+
+    // time the mixer's callback, the hook is installed after the reset so the audio thread never sees a half reset timer
+    int mixRate = 0, mixChannels = 0;
+    Uint16 mixFormat = 0;
+    Mix_QuerySpec(&mixRate, &mixFormat, &mixChannels);
+    CallbackTimer mixTimer;
+    mixTimer.reset(chunk_size, mixRate);
+    Mix_SetPostMix(timeMix, &mixTimer);
 
     // load sound files into a map
-    std::map<int, Mix_Chunk*> sounds = {
-        {243776, loadSound(ASSETS_DIR"243776.mp3")},
-        {443972, loadSound(ASSETS_DIR"443972.wav")},
-        {451158, loadSound(ASSETS_DIR"451158.flac")},
-        {454283, loadSound(ASSETS_DIR"454283.flac")},
-        {475094, loadSound(ASSETS_DIR"475094.ogg")},
-        {536260, loadSound(ASSETS_DIR"536260.opus")},
-        {536759, loadSound(ASSETS_DIR"536759.ogg")},
-        {643666, loadSound(ASSETS_DIR"643666.mp3")},
-        {750670, loadSound(ASSETS_DIR"750670.wav")}
+    const std::map<int, std::string> soundFiles = {
+        {243776, ASSETS_DIR"243776.mp3"},
+        {443972, ASSETS_DIR"443972.wav"},
+        {451158, ASSETS_DIR"451158.flac"},
+        {454283, ASSETS_DIR"454283.flac"},
+        {475094, ASSETS_DIR"475094.ogg"},
+        {536260, ASSETS_DIR"536260.opus"},
+        {536759, ASSETS_DIR"536759.ogg"},
+        {643666, ASSETS_DIR"643666.mp3"},
+        {750670, ASSETS_DIR"750670.wav"}
     };
 
+    // decoded sounds stay resident within the sound budget, e.g. OPENAVMEDIA_MEMORY_BUDGET=sound=16M
+    MemoryBudget budget;
+    if (!budget.configureFromEnvironment()) {
+        Mix_CloseAudio();
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
+    SoundCache sounds(graph, budget, loadSound);
+    for (const auto& [id, file] : soundFiles) sounds.add(id, file);
+
+    // preload every sound, the ones that do not fit are loaded again when they play
+    const Uint64 loadStart = SDL_GetPerformanceCounter();
+    std::map<int, bool> loaded;
+#if defined(OPENAVMEDIA_ASYNC)
+    // every file loads at once, reads on the I/O pool and decodes on the CPU pool
+    async::Executors executors;
+    SoundBank bank(executors);
+    std::map<int, async::Pending<async::Result<Mix_Chunk*>>> loads;
+    for (const auto& [id, file] : soundFiles) bank.add(id, file);
+    for (const auto& [id, _] : soundFiles) loads.emplace(id, async::spawn(bank.load(id)));
+    for (auto& [id, load] : loads) {
+        Mix_Chunk* chunk = load.get().value;
+        loaded[id] = chunk != nullptr;
+        if (chunk) sounds.insert(id, chunk);
+    }
+#else
+    for (const auto& [id, _] : soundFiles) loaded[id] = sounds.preload(id);
+#endif
+
+    std::cout << "Sounds loaded in " << (SDL_GetPerformanceCounter() - loadStart) * 1000.0 / SDL_GetPerformanceFrequency() << " ms" << std::endl;
+
     // verify that all sounds loaded correctly
-    for (const auto& [id, chunk] : sounds) {
-        if (!chunk) {
+    for (const auto& [id, ok] : loaded) {
+        if (!ok) {
             std::cerr << "Failed to load sound ID: " << id << std::endl;
+            sounds.clear();
             Mix_CloseAudio();
             SDL_Quit();
             return EXIT_FAILURE;
@@ -155,7 +268,7 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     }
 
     // play the forest soundscape
-    playForestScene(sounds);
+    playForestScene(sounds, *buses);
     
     // wait to let sound finish playing
     /*
@@ -165,10 +278,24 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     */
    SDL_Delay(30000);
 
-    // cleanup
-    for (const auto& [_, chunk] : sounds) {
-        Mix_FreeChunk(chunk);
+    if (graph.getDroppedCount()) {
+        std::cerr << "Submix graph commands dropped: " << graph.getDroppedCount() << std::endl;
     }
+
+    std::cout << "Effect CPU cost:" << std::endl;
+    printEffectCosts(graph, *buses);
+
+    Mix_SetPostMix(nullptr, nullptr);
+    std::cout << "Mixer callback, " << chunk_size << " frames (est. latency " << 2000.0 * chunk_size / mixRate << " ms):" << std::endl
+              << "  mean interval " << mixTimer.getMeanIntervalMs() << " ms, jitter " << mixTimer.getJitterMs()
+              << " ms, max interval " << mixTimer.getMaxIntervalMs() << " ms, underruns " << mixTimer.getUnderruns() << std::endl;
+
+    std::cout << "Sound cache: " << sounds.getHits() << " hits, " << sounds.getMisses() << " misses, " << sounds.getEvictions() << " evictions" << std::endl;
+    budget.print(std::cout);
+
+    // cleanup
+    graph.stop();
+    sounds.clear();
     Mix_CloseAudio();
     SDL_Quit();
 
@@ -0,0 +1,290 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Hot-path instrumentation for the playback loop
+ * @note Build with -DOPENAVMEDIA_TRACE (cmake -DENABLE_TRACING=ON) to record events. Without it every
+ * TRACE_* macro below expands to nothing, so the instrumented code costs exactly zero.
+ *
+ * Each thread records into its own fixed size ring buffer, so recording never takes a lock and never
+ * allocates after the thread's first event. When a thread exits its ring goes back to the registry
+ * and the next new thread reuses it, so threads that come and go do not pile up rings. The rings
+ * can be exported as Chrome trace-event JSON, which chrome://tracing and ui.perfetto.dev both open
+ * directly.
+ */
+namespace trace {
+    /**
+     * @brief The pipeline stage an event belongs to, exported as the event's category
+     */
+    enum Stage {
+        DEMUX,
+        DECODE_VIDEO,
+        DECODE_AUDIO,
+        CONVERT,
+        UPLOAD,
+        PRESENT,
+        AUDIO_CALLBACK,
+        BUFFER_LEVEL,
+        PACING,
+        STAGE_COUNT
+    };
+
+    inline const char* stageName(Stage stage) {
+        static const char* names[STAGE_COUNT] = {
+            "demux", "decode_video", "decode_audio", "convert", "upload", "present", "audio_callback", "buffer_level", "pacing"
+        };
+        return (stage < STAGE_COUNT) ? names[stage] : "unknown";
+    }
+
+    /**
+     * @brief One recorded event, kept small and trivially copyable so recording is a handful of stores
+     */
+    struct Event {
+        uint64_t timestamp; // nanoseconds since the trace epoch
+        uint64_t duration;  // nanoseconds, only used by complete ('X') events
+        const char* name;   // must point at a string literal or other storage that outlives the trace
+        int64_t value;      // frame index for scopes and instants, the sampled value for counters
+        Stage stage;
+        char phase;         // Chrome trace-event phase: 'X' complete, 'i' instant, 'C' counter
+    };
+
+    /**
+     * @brief Nanoseconds elapsed since the first call, shared by every thread
+     */
+    inline uint64_t now() {
+        static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    /**
+     * @brief False while an export copies the rings, events recorded meanwhile are dropped
+     */
+    inline std::atomic<bool>& recording() {
+        static std::atomic<bool> enabled{true};
+        return enabled;
+    }
+
+    /**
+     * @brief Single-producer ring of events owned by one thread
+     * @note Only the owning thread writes. Slots are plain memory, so they may only be read while
+     * no event is being recorded into them: the registry pauses recording() and waits for every
+     * writer to leave record() before it calls copyTo(), see Registry::writeChromeJson().
+     */
+    class ThreadBuffer {
+        public:
+        static const size_t CAPACITY = 1 << 16; // must be a power of two
+
+        ThreadBuffer(uint32_t tid): m_tid(tid), m_events(CAPACITY) { }
+
+        void record(const Event& event) {
+            // announce the write before checking for a pause, the exporter does the opposite, so one of them always sees the other
+            m_writing.store(true, std::memory_order_seq_cst);
+            if (recording().load(std::memory_order_seq_cst)) {
+                const uint64_t index = m_written.load(std::memory_order_relaxed);
+                m_events[index & (CAPACITY - 1)] = event;
+                m_written.store(index + 1, std::memory_order_release); // publish the slot
+            }
+            m_writing.store(false, std::memory_order_release);
+        }
+
+        /**
+         * @brief Waits until the owning thread is not inside record(), call it with recording() paused
+         */
+        void waitForWriter() const {
+            while (m_writing.load(std::memory_order_seq_cst)) std::this_thread::yield();
+        }
+
+        /**
+         * @brief Copies out every event still in the ring, oldest first
+         * @note Only safe while recording() is paused and after waitForWriter(), or once the owning thread exited.
+         */
+        void copyTo(std::vector<Event>& out) const {
+            const uint64_t written = m_written.load(std::memory_order_acquire);
+            const uint64_t first = (written > CAPACITY) ? written - CAPACITY : 0; // oldest event still in the ring
+            for (uint64_t i = first; i < written; ++i) {
+                out.push_back(m_events[i & (CAPACITY - 1)]);
+            }
+        }
+
+        /**
+         * @brief Empties the ring for a new thread, only called on a ring whose thread exited
+         */
+        void reuse(uint32_t tid) {
+            m_tid = tid;
+            m_written.store(0, std::memory_order_relaxed);
+            name.store(nullptr, std::memory_order_relaxed);
+        }
+
+        uint32_t tid() const { return m_tid; }
+        std::atomic<const char*> name{nullptr}; // set through setThreadName(), read when exporting
+
+        private:
+        uint32_t m_tid;
+        std::vector<Event> m_events;
+        std::atomic<uint64_t> m_written{0};
+        std::atomic<bool> m_writing{false}; // the owning thread is inside record()
+    };
+
+    /**
+     * @brief Owns every thread's buffer so they outlive the threads that wrote them
+     * @note A buffer whose thread exited keeps its events, and is exported, until a new thread takes it over.
+     */
+    class Registry {
+        public:
+        static Registry& instance() {
+            static Registry registry;
+            return registry;
+        }
+
+        ThreadBuffer* add() {
+            std::lock_guard<std::mutex> lock(m_mutex); // only taken once per thread, on its first event
+            const uint32_t tid = ++m_threads;
+            if (!m_free.empty()) {
+                ThreadBuffer* buffer = m_free.back();
+                m_free.pop_back();
+                buffer->reuse(tid);
+                return buffer;
+            }
+            m_buffers.push_back(std::make_unique<ThreadBuffer>(tid));
+            return m_buffers.back().get();
+        }
+
+        /**
+         * @brief Hands back the buffer of a thread that is exiting
+         */
+        void retire(ThreadBuffer* buffer) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(buffer);
+        }
+
+        /**
+         * @brief Writes every recorded event as Chrome trace-event JSON
+         * @note Recording pauses while the rings are copied, events other threads record meanwhile are dropped.
+         * @param filePath Where to write the .json file
+         * @return true on success
+         */
+        bool writeChromeJson(const std::string& filePath) {
+            std::ofstream out(filePath);
+            if (!out.is_open()) return false;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<std::vector<Event>> events(m_buffers.size());
+            recording().store(false, std::memory_order_seq_cst);
+            for (size_t i = 0; i < m_buffers.size(); ++i) {
+                m_buffers[i]->waitForWriter();
+                m_buffers[i]->copyTo(events[i]);
+            }
+            recording().store(true, std::memory_order_seq_cst);
+
+            out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+            bool first = true;
+            for (size_t i = 0; i < m_buffers.size(); ++i) {
+                const ThreadBuffer* buffer = m_buffers[i].get();
+                // name the thread's track...
+                if (const char* threadName = buffer->name.load(std::memory_order_relaxed)) {
+                    out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid()
+                        << ",\"args\":{\"name\":\"" << threadName << "\"}}";
+                    first = false;
+                }
+
+                // ...then add its events, timestamps are in microseconds with nanosecond precision
+                for (const Event& e : events[i]) {
+                    out << (first ? "" : ",\n");
+                    first = false;
+                    out << "{\"name\":\"" << e.name << "\",\"cat\":\"" << stageName(e.stage) << "\",\"ph\":\"" << e.phase
+                        << "\",\"pid\":1,\"tid\":" << buffer->tid() << ",\"ts\":" << (e.timestamp / 1000) << '.' << pad3(e.timestamp % 1000);
+                    if (e.phase == 'X') {
+                        out << ",\"dur\":" << (e.duration / 1000) << '.' << pad3(e.duration % 1000) << ",\"args\":{\"frame\":" << e.value << "}";
+                    } else if (e.phase == 'C') {
+                        out << ",\"args\":{\"value\":" << e.value << "}";
+                    } else {
+                        out << ",\"s\":\"t\",\"args\":{\"frame\":" << e.value << "}";
+                    }
+                    out << "}";
+                }
+            }
+            out << "\n]}\n";
+
+            return out.good();
+        }
+
+        private:
+        static std::string pad3(uint64_t v) {
+            std::string s = std::to_string(v);
+            return std::string(3 - s.size(), '0') + s;
+        }
+
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+        std::vector<ThreadBuffer*> m_free; // buffers of threads that exited, reused before allocating
+        uint32_t m_threads = 0;            // threads that recorded so far, numbers their tracks
+    };
+
+    /**
+     * @brief Holds a thread's buffer and gives it back to the registry when the thread exits
+     */
+    struct BufferOwner {
+        ThreadBuffer* buffer = Registry::instance().add();
+        ~BufferOwner() { Registry::instance().retire(buffer); }
+    };
+
+    /**
+     * @brief The calling thread's buffer, taken on first use
+     */
+    inline ThreadBuffer& threadBuffer() {
+        thread_local BufferOwner owner;
+        return *owner.buffer;
+    }
+
+    inline void setThreadName(const char* name) { threadBuffer().name.store(name, std::memory_order_relaxed); }
+
+    inline void instant(Stage stage, const char* name, int64_t frame) {
+        threadBuffer().record({now(), 0, name, frame, stage, 'i'});
+    }
+
+    inline void counter(Stage stage, const char* name, int64_t value) {
+        threadBuffer().record({now(), 0, name, value, stage, 'C'});
+    }
+
+    /**
+     * @brief Records a complete event covering its own lifetime
+     */
+    class Scope {
+        public:
+        Scope(Stage stage, const char* name, int64_t frame): m_start(now()), m_name(name), m_frame(frame), m_stage(stage) { }
+        ~Scope() {
+            const uint64_t end = now();
+            threadBuffer().record({m_start, end - m_start, m_name, m_frame, m_stage, 'X'});
+        }
+
+        private:
+        uint64_t m_start;
+        const char* m_name;
+        int64_t m_frame;
+        Stage m_stage;
+    };
+}
+
+#if defined(OPENAVMEDIA_TRACE)
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(stage, name, frame) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(trace::stage, name, frame)
+#define TRACE_INSTANT(stage, name, frame) trace::instant(trace::stage, name, frame)
+#define TRACE_COUNTER(stage, name, value) trace::counter(trace::stage, name, static_cast<int64_t>(value))
+#define TRACE_THREAD_NAME(name) trace::setThreadName(name)
+#define TRACE_WRITE_JSON(filePath) trace::Registry::instance().writeChromeJson(filePath)
+#else
+#define TRACE_SCOPE(stage, name, frame) ((void)0)
+#define TRACE_INSTANT(stage, name, frame) ((void)0)
+#define TRACE_COUNTER(stage, name, value) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#define TRACE_WRITE_JSON(filePath) (false)
+#endif
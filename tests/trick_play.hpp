@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "webm/mkvparser/mkvparser.h"
+#include "simplewebm/WebMDemuxer.hpp"
+
+#include "../tests/trace.hpp"
+
+/**
+ * @brief Keyframe-only demuxer for fast-forward and rewind
+ * @note WebMDemuxer::readFrame reads every block in order, so scrubbing through it costs as much as
+ * playing. This class indexes the video track's keyframes up front and only ever reads the payload
+ * of the keyframe that is due, so scrubbing costs I/O and decode time per keyframe shown rather than
+ * per frame. Keyframes decode without any earlier frame, so they can be handed to VPXDecoder in any
+ * order. Audio is not read at all.
+ *
+ * The index comes from the Cues element when the file has one, which only touches the clusters that
+ * hold keyframes. Without Cues every cluster is loaded, but still only block headers are parsed.
+ */
+class KeyframeDemuxer {
+    public:
+    static constexpr double MIN_RATE = 2.0;
+    static constexpr double MAX_RATE = 64.0;
+
+    /**
+     * @param reader Reader for the WebM file, it must outlive this object
+     */
+    KeyframeDemuxer(mkvparser::IMkvReader* reader): m_reader(reader) {
+        mkvparser::EBMLHeader ebmlHeader;
+        long long pos = 0;
+        if (ebmlHeader.Parse(m_reader, pos) < 0) return;
+        if (mkvparser::Segment::CreateInstance(m_reader, pos, m_segment) < 0 || !m_segment) return;
+        if (m_segment->ParseHeaders() < 0) return;
+
+        // the first VP8 or VP9 track is the one WebMDemuxer plays
+        const mkvparser::Tracks* tracks = m_segment->GetTracks();
+        for (unsigned long i = 0; tracks && i < tracks->GetTracksCount(); ++i) {
+            const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+            if (track && track->GetType() == mkvparser::Track::kVideo &&
+                (strcmp(track->GetCodecId(), "V_VP8") == 0 || strcmp(track->GetCodecId(), "V_VP9") == 0)) {
+                m_track = track;
+                break;
+            }
+        }
+        if (!m_track) return;
+
+        if (!indexFromCues()) indexFromClusters();
+        m_isOpen = !m_keyframes.empty();
+    }
+    ~KeyframeDemuxer() {
+        delete m_segment;
+    }
+
+    bool isOpen() const { return m_isOpen; }
+    size_t getKeyframeCount() const { return m_keyframes.size(); }
+    double getDuration() const { return m_keyframes.empty() ? 0.0 : m_keyframes.back().time; }
+
+    /**
+     * @brief Sets the scrub speed, negative rates rewind
+     * @param rate Playback rate, its magnitude is clamped to MIN_RATE..MAX_RATE
+     */
+    void setRate(double rate) {
+        const double magnitude = std::clamp(std::abs(rate), MIN_RATE, MAX_RATE);
+        m_rate = (rate < 0.0) ? -magnitude : magnitude;
+    }
+    double getRate() const { return m_rate; }
+
+    /**
+     * @brief Moves the scrub position, the next keyframe read is the last one at or before it
+     */
+    void seek(double seconds) {
+        m_position = std::clamp(seconds, 0.0, getDuration());
+        m_current = -1;
+    }
+    double getPosition() const { return m_position; }
+
+    /**
+     * @brief True once the position has run off either end of the file
+     */
+    bool isFinished() const {
+        return (m_rate > 0.0) ? m_position >= getDuration() && m_current == static_cast<long>(m_keyframes.size()) - 1
+                              : m_position <= 0.0 && m_current == 0;
+    }
+
+    /**
+     * @brief Advances the position by elapsed wall time times the rate, then reads the keyframe now due
+     * @param elapsedSeconds Wall time since the last call
+     * @param frame Receives the keyframe, its buffer is grown as WebMDemuxer::readFrame grows it
+     * @return false if the due keyframe is the one already returned, so there is nothing new to decode
+     */
+    bool readKeyframe(double elapsedSeconds, WebMFrame* frame) {
+        if (!m_isOpen) return false;
+        m_position = std::clamp(m_position + elapsedSeconds * m_rate, 0.0, getDuration());
+
+        // the last keyframe at or before the position, the ones skipped over are never read
+        auto next = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), m_position,
+                                     [](double time, const Keyframe& keyframe) { return time < keyframe.time; });
+        const long index = std::max<long>(0, static_cast<long>(next - m_keyframes.begin()) - 1);
+        if (index == m_current) return false;
+
+        TRACE_SCOPE(DEMUX, "readKeyframe", index);
+        const mkvparser::Block::Frame& blockFrame = m_keyframes[index].entry->GetBlock()->GetFrame(0);
+        if (blockFrame.len > frame->bufferCapacity) {
+            unsigned char* buffer = static_cast<unsigned char*>(realloc(frame->buffer, blockFrame.len));
+            if (!buffer) return false;
+            frame->buffer = buffer;
+            frame->bufferCapacity = blockFrame.len;
+        }
+        if (blockFrame.Read(m_reader, frame->buffer) < 0) {
+            std::cerr << "Failed to read keyframe at " << m_keyframes[index].time << " s" << std::endl;
+            frame->bufferSize = 0;
+            return false;
+        }
+        frame->bufferSize = blockFrame.len;
+        frame->time = m_keyframes[index].time;
+        frame->key = true;
+
+        m_current = index;
+        m_bytesRead += blockFrame.len;
+        ++m_keyframesRead;
+        return true;
+    }
+
+    size_t getKeyframesRead() const { return m_keyframesRead; }
+    long long getBytesRead() const { return m_bytesRead; } // payload bytes, block headers are not counted
+
+    private:
+    struct Keyframe {
+        double time; // seconds
+        const mkvparser::BlockEntry* entry;
+    };
+
+    bool indexFromCues() {
+        const mkvparser::Cues* cues = m_segment->GetCues();
+        if (!cues) return false;
+        while (!cues->DoneParsing()) cues->LoadCuePoint();
+
+        for (const mkvparser::CuePoint* cuePoint = cues->GetFirst(); cuePoint; cuePoint = cues->GetNext(cuePoint)) {
+            const mkvparser::CuePoint::TrackPosition* position = cuePoint->Find(m_track);
+            if (!position) continue;
+
+            const mkvparser::BlockEntry* entry = cues->GetBlock(cuePoint, position);
+            addKeyframe(entry);
+        }
+        sortKeyframes();
+        return !m_keyframes.empty();
+    }
+
+    void indexFromClusters() {
+        if (m_segment->Load() < 0) return;
+
+        const mkvparser::BlockEntry* entry = nullptr;
+        if (m_track->GetFirst(entry) < 0) return;
+        while (entry && !entry->EOS()) {
+            addKeyframe(entry);
+            if (m_track->GetNext(entry, entry) < 0) break;
+        }
+        sortKeyframes();
+    }
+
+    void addKeyframe(const mkvparser::BlockEntry* entry) {
+        if (!entry || entry->EOS()) return;
+        const mkvparser::Block* block = entry->GetBlock();
+        if (!block || !block->IsKey() || block->GetFrameCount() < 1 || block->GetTrackNumber() != m_track->GetNumber()) return;
+
+        m_keyframes.push_back({block->GetTime(entry->GetCluster()) / 1e9, entry});
+    }
+
+    void sortKeyframes() {
+        std::sort(m_keyframes.begin(), m_keyframes.end(), [](const Keyframe& a, const Keyframe& b) { return a.time < b.time; });
+        m_keyframes.erase(std::unique(m_keyframes.begin(), m_keyframes.end(),
+                                      [](const Keyframe& a, const Keyframe& b) { return a.entry == b.entry; }), m_keyframes.end());
+    }
+
+    mkvparser::IMkvReader* m_reader;
+    mkvparser::Segment* m_segment = nullptr;
+    const mkvparser::Track* m_track = nullptr;
+    std::vector<Keyframe> m_keyframes;
+    bool m_isOpen = false;
+
+    double m_rate = MIN_RATE;
+    double m_position = 0.0; // seconds
+    long m_current = -1;     // index of the keyframe last returned
+
+    size_t m_keyframesRead = 0;
+    long long m_bytesRead = 0;
+};